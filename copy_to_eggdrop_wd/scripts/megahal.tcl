@@ -55,6 +55,11 @@ set surprise 1
 # Recommended setting is about 25-40, set to 0 to allow unlimited size
 set maxreplywords 30
 
+# Reply search time in microseconds, for the channels and for DCC chat
+# The longer it searches, the better the replies but the longer the bot takes to answer
+set replyusec 1000000
+set dccreplyusec 2000000
+
 
 #####################################################################
 
@@ -79,7 +84,7 @@ proc auto_brainsave {min b c d e} {
 bind pub m ".savebrain" pub_savebrain
 proc pub_savebrain {nick uhost hand chan arg} {
  savebrain
- puthelp "PRIVMSG $chan :Brain saved"
+ puthelp "PRIVMSG $chan :Saving brain"
 }
 bind pub n ".trimbrain" pub_trimbrain
 proc pub_trimbrain {nick uhost hand chan arg} {
@@ -94,12 +99,12 @@ proc pub_trimbrain {nick uhost hand chan arg} {
 
 bind pub n ".lobotomy" pub_lobotomy
 proc pub_lobotomy {nick uhost hand chan arg} {
- savebrain
+ savebrain wait
  file delete megahal.old
  file copy megahal.brn megahal.old
  file delete megahal.brn
- reloadbrain
- savebrain
+ reloadbrain wait
+ savebrain wait
  puthelp "PRIVMSG $chan :Lobotomy completed! Creating a new brain..." 
 }
 
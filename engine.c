@@ -0,0 +1,5820 @@
+/*
+ *	engine.c -- the MegaHAL language model, reply generator and brain upkeep.
+ *
+ *	Nothing in here knows about eggdrop: megahal.c includes this file after
+ *	the module headers so it ends up in the one module object, and
+ *	libmegahal.c includes it after standalone.h to build the engine as a
+ *	library of its own.  Either way the includer provides nmalloc, nfree,
+ *	nrealloc, Context and putlog.  See megahal.c for the history.
+ */
+
+#define COOKIE "MegaHAL84"
+#define OLD_COOKIE "MegaHAL83"
+#define BRAIN_VERSION 4
+#define JOURNAL_COOKIE "MegaHALj"
+#define JOURNAL_VERSION 1
+#define JOURNAL_LEARN 'L'
+#define JOURNAL_FORGET 'D'
+#define JOURNAL_TRIM 'T'
+#define JOURNAL_OLDEST 'O'
+#define JOURNAL_NEXT 'N'
+
+/* predefinitions for megahal*/
+
+static int order = 2;
+static DICTIONARY *ban = NULL;
+static DICTIONARY *aux = NULL;
+static SWAP *swp = NULL;
+static REPLYCONTEXT *replycontext = NULL;
+static char directory_cache[513] = DIR_DEFAULT_CACHE;
+static char directory_resources[513] = DIR_DEFAULT_RESOURCES;
+static DICTIONARY *words = NULL;
+static MODEL *model = NULL;
+static int maxreplywords = 0;
+static int surprise = 1;
+static int replycandidates = 0, replyscore = 0;
+static int replythreads = 1;
+static int trainthreads = 1;
+static int replyseed = 0;
+static bool quiet = FALSE;
+#ifdef MEGAHAL_THREADS
+// the share a training helper thread is working on, where error() and warn() leave their message instead of logging it
+static _Thread_local TRAINSHARE *helpershare = NULL;
+#endif
+static FILE *journal = NULL;
+static bool journaldirty = FALSE;
+static BYTE8 journalbase = 0;
+static DICTIONARY *prev1, *prev2, *prev3, *prev4, *prev5;
+
+static wchar_t *locale_to_wchar(char *str)
+{
+	wchar_t *ptr;
+	size_t s;
+
+	Context;
+	/* first arg == NULL means 'calculate needed space' */
+	s = mbstowcs(NULL, str, 0);
+
+	/* a size of -1 is triggered by an error in encoding; never
+	   happen in ISO-8859-* locales, but possible in UTF-8 */
+	if(s == -1)
+		return NULL;
+
+	/* malloc the necessary space */
+	if((ptr = (wchar_t *)nmalloc((s+1)*sizeof(wchar_t))) == NULL)
+		return NULL;
+
+	/* really do it */
+	mbstowcs(ptr, str, s);
+
+	/* ensure NULL-termination */
+	ptr[s] = L'\0';
+
+	/* remember to free() ptr when done */
+	return ptr;
+}
+
+static char *wchar_to_locale(wchar_t *str)
+{
+	char *ptr;
+	size_t s;
+
+	Context;
+	/* first arg == NULL means 'calculate needed space' */
+	s = wcstombs(NULL, str, 0);
+
+	/* a size of -1 means there are characters that could not
+	   be converted to current locale */
+	if(s == -1)
+		return NULL;
+
+	/* malloc the necessary space */
+	if((ptr = (char *)nmalloc(s+1)) == NULL)
+		return NULL;
+
+	/* really do it */
+	wcstombs(ptr, str, s);
+
+	/* ensure NULL-termination */
+	ptr[s] = '\0';
+
+	/* remember to free() ptr when done */
+	return ptr;
+}
+
+// Next, a hacked attempt at strdup(), since I can't use malloc() anywhere.
+static wchar_t *mystrdup(const wchar_t *s)
+{
+	wchar_t *mytmp = nmalloc((wcslen(s)+1)*sizeof(wchar_t));
+
+	Context;
+	if(mytmp == NULL)
+		return NULL;
+	else wcscpy(mytmp, s);
+
+	return mytmp;
+}
+
+// returns the amount of nodes/leaves in a tree by recursing through all its branches - the pool of a model counts those of both its trees without this
+static int recurse_tree(TREE *node)
+{
+	int size = 0;
+	register int i;
+
+	Context;
+	size++;
+	for(i=0; i<node->branch; ++i)
+		size += recurse_tree(node->tree[i]);
+
+	return size;
+}
+
+/* Note: These are personal notes on the various ways I tried to trim the brain (^Baron^). This will not be of interest to many.
+ *
+ * To trim a brain one cannot just trim branches at random or older branches because:
+ * 1. Branches are usually snippets of phrases and you will be left with nonsensical pieces in the end - but this is not as important as:
+ * 2. You could delete all possible endings of a phrase and so the AI gets stuck in a loop trying to find the end! This is pretty straightforward but the next is very tricky:
+ * 3. The way the halcontext is used, it is filled up with the other branches that are actually continuations of the
+ *    current branch (if any) under another 'context' and since it usually has to use the longest context in order to generate a normal looking reply, it will get
+ *    stuck since it can't find the next nearest longest context that will end or continue the sentence (study the reply&babble functions to understand this).
+ *    I tried forcing it to use smaller contexts but that just caused tons of gibberish.
+ *
+ * I also tried trimming by changing the format of the brain so that sentences are always stored with a <BEGIN> marker as the first word in every sentence.
+ * This way I knew how to find FULL sentences at least by going to the branch that starts with <BEGIN> and going on from there.
+ * Then I used full contexts searches to hop from one branch to the next in order to create a real phrase just as if we were creating a reply to the user.
+ * Some branches are hopped onto by random and therefore the sentence will often not be the same as the original that was learned by megahal,
+ * but at least we dont leave behind scraps of sentences or incomplete contexts.
+ *
+ * This wasn't enough however because of a very tricky case: There are sentences that repeat themselves in the middle and therefore we may
+ * branch off to the latter part of the sentence while trying to create a sentence and then leave the middle snippets behind and cause other
+ * unexpected bugs and problems. For example, an even worse case scenario is that we will REPEAT the same snippet twice because we find
+ * ourselves back in the same context a few times. This will even cause null pointer exceptions, etc.
+ *
+ * So in the end I changed the brain again so that it keeps track of phrases as soon as it learns them and stores them together with the model.
+ * We can't go wrong like this if we delete the EXACT original sentence.
+ */
+
+// deletes the oldest phrases until the model has no more than newsize nodes, then drops the words nothing uses anymore
+static void trimbrain(int newsize)
+{
+	Context;
+	del_oldest_phrases(model->phrasecount, newsize);
+	trimdictionary();
+}
+
+// deletes a phrase from the model using all its contexts, decrementing counters or deleting branches where necessary
+static void del_phrase(int phrase)
+{
+	Context;
+	if (phrase >= model->phrasecount) return;
+	write_journal(JOURNAL_FORGET, &phrase, sizeof(BYTE4));
+	unlearn_phrase(model, PHRASE(model, phrase));
+	unindex_phrase(model, phrase);
+
+	// remove the phrase from the model
+	remove_phrase(model, phrase);
+}
+
+// deletes up to count of the oldest phrases, stopping once the model has no more than newsize nodes, and takes them off the phrase store in one go - returns how many went
+static BYTE4 del_oldest_phrases(BYTE4 count, int newsize)
+{
+	BYTE4 done = 0;
+
+	Context;
+	// the pool counts the nodes of both trees, so the size can be checked after every phrase
+	while(done < count && done < model->phrasecount && newsize < (int)model->pool.nodes) {
+		unlearn_phrase(model, PHRASE(model, done));
+		unindex_phrase(model, done++);
+	}
+	if(done == 0)
+		return 0;
+	write_journal(JOURNAL_OLDEST, &done, sizeof(BYTE4));
+	drop_oldest_phrases(model, done);
+
+	return done;
+}
+
+// takes a phrase out of both trees using all its contexts, the opposite of learn_phrase() - the phrase itself is left as it was
+static void unlearn_phrase(MODEL *model, SYMBOL *phrase)
+{
+	bool fnd = FALSE;
+	register int j, k;
+	SYMBOL size;
+
+	Context;
+	size = phrase[0];
+
+	// go through the words/symbols and start trimming sets of context branches one symbol at a time
+	for (j=1; j<=size; j++) {
+		initialize_context(model, model->halcontext);
+
+		// build the context using the next batch of symbols
+		model->halcontext[0] = model->forward->tree[search_node(model->forward, phrase[j], &fnd)];
+		for (k=1; k<=model->order; k++) {
+			if ((k+j) > size)
+				break;
+			model->halcontext[k] = model->halcontext[k-1]->tree[search_node(model->halcontext[k-1], phrase[j+k], &fnd)];
+		}
+
+		// now decrement the usage and delete unused branches - must go backwards in case branches are erased
+		for (k=model->order; k>0; k--)
+			decrement_tree(&model->pool, model->halcontext[k], model->halcontext[k-1]);
+		decrement_tree(&model->pool, model->halcontext[0], model->forward);
+	}
+
+
+	// start the trimming in the backwards tree
+	// first move the <FIN> symbol to the other side because we are going backwards now
+	for (j=size; j>1; j--)
+		phrase[j] = phrase[j-1];
+	phrase[1] = 1;
+
+	for (j=size; j>0; j--) {
+		initialize_context(model, model->halcontext);
+
+		model->halcontext[0] = model->backward->tree[search_node(model->backward, phrase[j], &fnd)];
+		for (k=1; k<=model->order; k++) {
+			if (k>j-1) break;
+			model->halcontext[k] = model->halcontext[k-1]->tree[search_node(model->halcontext[k-1], phrase[j-k], &fnd)];
+		}
+
+		for (k=model->order; k>0; k--)
+			decrement_tree(&model->pool, model->halcontext[k], model->halcontext[k-1]);
+		decrement_tree(&model->pool, model->halcontext[0], model->backward);
+	}
+
+	// move the symbol back again
+	for (j=1; j<size; j++)
+		phrase[j] = phrase[j+1];
+	phrase[size] = 1;
+}
+
+// this decrements the usage and count counters in a branch and deletes branches that arent used anymore
+static void decrement_tree(NODEPOOL *pool, TREE *node, TREE *parent)
+{
+	int position;
+	bool fnd;
+
+	Context;
+	if(node == NULL || parent == NULL)
+		return;
+
+	position = search_node(parent, node->symbol, &fnd);
+	--parent->usage;
+	if(--COUNTS(parent)[position] < 1) {
+		free_tree(pool, node);
+		memmove(&parent->tree[position], &parent->tree[position+1], sizeof(TREE *)*(parent->branch-1-position));
+		memmove(&SYMBOLS(parent)[position], &SYMBOLS(parent)[position+1], sizeof(SYMBOL)*(parent->branch-1-position));
+		memmove(&COUNTS(parent)[position], &COUNTS(parent)[position+1], sizeof(SYMBOL)*(parent->branch-1-position));
+		--parent->branch;
+		realloc_tree(pool, parent);
+	}
+}
+
+// tries to find words in the main dictionary that arent being used in the model anymore and deletes them and updates everything thats necessary
+static void trimdictionary()
+{
+	register BYTE4 i;
+	BYTE4 size = model->dictionary->size, kept = 0;
+	SYMBOL *remap;
+
+	Context;
+	write_journal(JOURNAL_TRIM, NULL, 0);
+	/* Every word the model still uses starts a context at the top of the trees, so mark the
+	   children of both roots as used, keeping the default words created when dic init */
+	remap = (SYMBOL *)nmalloc(sizeof(SYMBOL)*size);
+	if(remap == NULL) {
+		error("trimdictionary", "Unable to allocate remap.");
+		return;
+	}
+	memset(remap, 0, sizeof(SYMBOL)*size);
+	for(i=0; i<model->forward->branch; ++i)
+		remap[SYMBOLS(model->forward)[i]] = 1;
+	for(i=0; i<model->backward->branch; ++i)
+		remap[SYMBOLS(model->backward)[i]] = 1;
+
+	/* Shift the words that are kept down over the ones that aren't, and remember where each
+	   one went, so that one walk of the trees and the phrases renumbers everything */
+	for(i=0; i<size; ++i) {
+		if(i >= 2 && remap[i] == 0) {
+			free_word(model->dictionary->entry[i]);
+			continue;
+		}
+		model->dictionary->entry[kept] = model->dictionary->entry[i];
+		remap[i] = kept++;
+	}
+
+	// only if there is anything to trim:
+	if(kept < size) {
+		renumber_tree(model->forward, remap);
+		renumber_tree(model->backward, remap);
+		renumber_index(model, remap, size);
+
+		// resize the dictionary and reallocate the mem, then hash the words again under their new symbols
+		model->dictionary->size = kept;
+		if(realloc_dictionary(model->dictionary) == NULL ||
+		   rehash_dictionary(model->dictionary, model->dictionary->buckets) == FALSE) {
+			error("trimdictionary", "Unable to reallocate dictionary.");
+			nfree(remap);
+			return;
+		}
+	}
+	nfree(remap);
+}
+
+/* This recurses through the model and gives every symbol the number the remap table has for it,
+   used when entries in the dictionary are deleted and everything is shifted down for example.
+   The table never changes the order of two symbols, so the children stay sorted. */
+static void renumber_tree(TREE *node, SYMBOL *remap)
+{
+	register int i;
+
+	node->symbol = remap[node->symbol];
+	for(i=0; i<node->branch; ++i) {
+		renumber_tree(node->tree[i], remap);
+		SYMBOLS(node)[i] = node->tree[i]->symbol;
+	}
+}
+
+static DICTIONARY *realloc_dictionary(DICTIONARY *dictionary)
+{
+	Context;
+	if(dictionary->entry == NULL)
+		dictionary->entry = (STRING *)nmalloc(sizeof(STRING)*(dictionary->size));
+	else
+		dictionary->entry = (STRING *)nrealloc((STRING *)(dictionary->entry),sizeof(STRING)*(dictionary->size));
+	if(dictionary->entry == NULL)
+		return NULL;
+
+	return dictionary;
+}
+
+// child arrays double when they fill up and only halve once they are three quarters empty,
+// so a node hovering around a power of two doesn't keep reallocating its array
+static TREE *realloc_tree(NODEPOOL *pool, TREE *tree)
+{
+	TREE **array;
+	BYTE4 capacity;
+	int keep;
+
+	Context;
+	if(tree->branch == 0) {
+		if(tree->tree != NULL)
+			free_array(pool, tree->tree, array_class(tree->capacity));
+		tree->tree = NULL;
+		tree->capacity = 0;
+		return tree;
+	}
+
+	capacity = tree->capacity;
+	if(tree->branch > capacity) {
+		if(capacity == 0)
+			capacity = 1;
+		while(capacity < tree->branch)
+			capacity *= 2;
+	} else if(tree->branch <= capacity/4) {
+		capacity /= 2;
+	} else {
+		return tree;
+	}
+
+	array = new_array(pool, array_class(capacity));
+	if(array == NULL)
+		return NULL;
+
+	if(tree->tree != NULL) {
+		keep = MIN(tree->capacity, tree->branch);
+		memcpy(array, tree->tree, sizeof(TREE *)*keep);
+		memcpy(array+capacity, SYMBOLS(tree), sizeof(SYMBOL)*keep);
+		memcpy((SYMBOL *)(array+capacity)+capacity, COUNTS(tree), sizeof(SYMBOL)*keep);
+		free_array(pool, tree->tree, array_class(tree->capacity));
+	}
+	tree->tree = array;
+	tree->capacity = capacity;
+
+	return tree;
+}
+
+static bool isrepeating(DICTIONARY *replywords)
+{
+	register int i, j, k;
+	bool same;
+
+	Context;
+	if (replywords->size <= model->order*2+1)
+		return FALSE;
+
+	for (i=model->order+1; i<replywords->size-model->order; i++) {
+		for (j=0; j<i-model->order; j++) {
+			same = TRUE;
+			for (k=0; k<=model->order; k++) {
+				if (wordcmp(replywords->entry[i+k], replywords->entry[j+k]) != 0) {
+					same = FALSE;
+					break;
+				}
+			}
+			if (same)
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void strip_codes(wchar_t *text)
+{
+	wchar_t *dd = text;
+
+	Context;
+	while (*text) {
+		switch (*text) {
+		case 2:						/* Bold text */
+			text++;
+			continue;
+		case 3:						/* mIRC colors? */
+			if (iswdigit(text[1])) {		/* Is the first wchar_t a number? */
+				text += 2;			/* Skip over the ^C and the first digit */
+				if (iswdigit(*text))
+					text++;			/* Is this a double digit number? */
+				if (*text == L',') {		/* Do we have a background color next? */
+					if (iswdigit(text[1]))
+						text += 2;	/* Skip over the first background digit */
+					if (iswdigit(*text))
+						text++;		/* Is it a double digit? */
+				}
+			} else
+				text++;
+			continue;
+		case 7:
+			text++;
+			continue;
+		case 0x16:					/* Reverse video */
+			text++;
+			continue;
+		case 0x1f:					/* Underlined text */
+			text++;
+			continue;
+		case 033:
+			text++;
+			if (*text == L'[') {
+				text++;
+				while ((*text == L';') || iswdigit(*text))
+					text++;
+				if (*text)
+					text++;			/* also kill the following char */
+			}
+			continue;
+		}
+		*dd++ = *text++;				/* Move on to the next char */
+	}
+	*dd = 0;
+}
+
+static bool isinprevs(DICTIONARY *words)
+{
+	Context;
+	if (dissimilar2(words, prev1) && dissimilar2(words, prev2) && dissimilar2(words, prev3) &&
+	    dissimilar2(words, prev4) && dissimilar2(words, prev5))
+		return FALSE;
+	return TRUE;
+}
+
+static bool dissimilar2(DICTIONARY *words1, DICTIONARY *words2)
+{
+	register int i, j;
+	int count = 0;
+
+	Context;
+	for(i=0; i<words1->size; ++i) {
+		for(j=0; j<words2->size; ++j) {
+			if(wordcmp(words1->entry[i], words2->entry[j])==0) {
+				count++;
+				break;
+			}
+		}
+	}
+	if (count>(words1->size/4*3))
+		return FALSE;
+	return TRUE;
+}
+
+static void updateprevs(wchar_t *words)
+{
+	Context;
+	free_words(prev1);
+	free_dictionary(prev1);
+	nfree(prev1);
+
+	prev1 = prev2;
+	prev2 = prev3;
+	prev3 = prev4;
+	prev4 = prev5;
+
+	prev5 = new_dictionary();
+	make_words(words, prev5);
+}
+
+/*
+ * The remainder of this code was just pasted from the rest of megahal.c, and
+ * modified where necessary to get messages put in the right place, etc.
+ */
+
+/*---------------------------------------------------------------------------*/
+/*
+ *	Function:	Error
+ *
+ *	Purpose:	Print the specified message to the error file.
+ */
+static void error(char *title, char *fmt, ...)
+{
+	va_list argp;
+	char stuff[512];
+	int length;
+
+	Context;
+	length = snprintf(stuff, sizeof(stuff), "%s: ", title);
+	va_start(argp, fmt);
+	vsnprintf(stuff+length, sizeof(stuff)-length, fmt, argp);
+	va_end(argp);
+	report(stuff);
+
+	/* FIXME - I think I need to die here */
+}
+
+/*---------------------------------------------------------------------------*/
+
+static bool warn(char *title, char *fmt, ...)
+{
+	va_list argp;
+	char stuff[512];
+	int length;
+
+	Context;
+	length = snprintf(stuff, sizeof(stuff), "%s: ", title);
+	va_start(argp, fmt);
+	vsnprintf(stuff+length, sizeof(stuff)-length, fmt, argp);
+	va_end(argp);
+	report(stuff);
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Report
+ *
+ *	Purpose:	Log a message from error() or warn(), unless this is the
+ *			forked saver, which keeps quiet, or a training helper
+ *			thread, which keeps the first for run_shares() to log.
+ */
+static void report(char *stuff)
+{
+#ifdef MEGAHAL_THREADS
+	if(helpershare != NULL) {
+		if(helpershare->trouble[0] == '\0')
+			snprintf(helpershare->trouble, sizeof(helpershare->trouble), "%s", stuff);
+		return;
+	}
+#endif
+	if(!quiet)
+		putlog(LOG_MISC, "*", "%s", stuff);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Capitalize
+ *
+ *	Purpose:	Convert a string to look nice.
+ */
+static void capitalize(wchar_t *string)
+{
+	register size_t i;
+	bool start = TRUE;
+
+	Context;
+	for(i=0; i<wcslen(string); ++i) {
+		if(iswalpha(string[i])) {
+			if(start == TRUE)
+				string[i] = (wchar_t)towupper(string[i]);
+			else
+				string[i] = (wchar_t)towlower(string[i]);
+			start = FALSE;
+		}
+		if((i>2)&&(wcschr(L"!.?", string[i-1])!=NULL)&&(iswspace(string[i])))
+			start = TRUE;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Upper
+ *
+ *	Purpose:	Convert a string to its uppercase representation.
+ */
+static void upper(wchar_t *string)
+{
+	register size_t i;
+
+	Context;
+	for(i=0; i<wcslen(string); ++i)
+		string[i] = (wchar_t)towupper(string[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Add_Word
+ *
+ *	Purpose:	Add a word to a dictionary, and return the identifier
+ *			assigned to the word.  If the word already exists in
+ *			the dictionary, then return its current identifier
+ *			without adding it again.
+ */
+static SYMBOL add_word(DICTIONARY *dictionary, STRING word)
+{
+	register int i;
+	BYTE4 bucket;
+	SYMBOL symbol;
+	wchar_t folded[256];
+
+	Context;
+	/*
+	 *	The word may come straight from a file or a constant, so fold a
+	 *	copy of it before looking it up.
+	 */
+	for(i=0; i<word.length; ++i)
+		folded[i] = word.word[i];
+	word.word = folded;
+	fold_word(&word);
+
+	/*
+	 *	If the word's already in the dictionary, there is no need to add it
+	 */
+	if(dictionary->buckets != 0) {
+		bucket = find_bucket(dictionary, word);
+		if(dictionary->table[bucket] != 0)
+			return dictionary->table[bucket]-1;
+	}
+
+	/*
+	 *	Refuse the word rather than let its identifier wrap around
+	 *	onto an existing one.
+	 */
+	if(dictionary->size >= SYMBOL_MAX) {
+		error("add_word", "The dictionary is full.");
+		goto fail;
+	}
+
+	/*
+	 *	Grow the hash table before it gets more than half full
+	 */
+	if(2*(dictionary->size+1) > dictionary->buckets) {
+		if(rehash_dictionary(dictionary, dictionary->buckets ? 2*dictionary->buckets : DICTIONARY_BUCKETS) == FALSE) {
+			error("add_word", "Unable to grow the dictionary hash.");
+			goto fail;
+		}
+	}
+	bucket = find_bucket(dictionary, word);
+
+	/*
+	 *	Increase the number of words in the dictionary
+	 */
+	dictionary->size += 1;
+
+	/*
+	 *	Allocate one more entry for the word
+	 */
+	if(realloc_dictionary(dictionary) == NULL) {
+		error("add_word", "Unable to reallocate the dictionary.");
+		goto fail;
+	}
+
+	/*
+	 *	Copy the new word into the word array
+	 */
+	symbol = dictionary->size-1;
+	dictionary->entry[symbol].length = word.length;
+	dictionary->entry[symbol].hash = word.hash;
+	dictionary->entry[symbol].word = (wchar_t *)nmalloc(sizeof(wchar_t)*(word.length));
+	if(dictionary->entry[symbol].word == NULL) {
+		error("add_word", "Unable to allocate the word.");
+		goto fail;
+	}
+	for(i=0; i<word.length; ++i)
+		dictionary->entry[symbol].word[i] = word.word[i];
+
+	/*
+	 *	Point the word's bucket at the new symbol identifier
+	 */
+	dictionary->table[bucket] = symbol+1;
+
+	return symbol;
+
+fail:
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Hash_Word
+ *
+ *	Purpose:	Return an FNV-1a hash of a word that has already been
+ *			folded to upper case.
+ */
+static BYTE4 hash_word(STRING word)
+{
+	register int i;
+	BYTE4 hash = 2166136261U;
+
+	for(i=0; i<word.length; ++i) {
+		hash ^= (BYTE4)word.word[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Fold_Word
+ *
+ *	Purpose:	Convert a word to the upper case form that all words are
+ *			kept in, and cache its hash.  Every word must go through
+ *			here before it is compared with another.
+ */
+static void fold_word(STRING *word)
+{
+	register int i;
+
+	for(i=0; i<word->length; ++i)
+		word->word[i] = (wchar_t)towupper(word->word[i]);
+	word->hash = hash_word(*word);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Find_Bucket
+ *
+ *	Purpose:	Probe the dictionary's hash table for the specified word,
+ *			returning the bucket that holds it, or the empty bucket
+ *			where it belongs if it isn't there.  The table must exist.
+ */
+static BYTE4 find_bucket(DICTIONARY *dictionary, STRING word)
+{
+	BYTE4 mask = dictionary->buckets-1;
+	BYTE4 bucket = hash_word(word)&mask;
+	SYMBOL symbol;
+
+	while((symbol = dictionary->table[bucket]) != 0) {
+		if(wordcmp(dictionary->entry[symbol-1], word) == 0)
+			break;
+		bucket = (bucket+1)&mask;
+	}
+
+	return bucket;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Rehash_Dictionary
+ *
+ *	Purpose:	Rebuild the hash table of the dictionary with the given
+ *			number of buckets, which must be a power of two.  This is
+ *			used to grow the table, and after words are removed and
+ *			the remaining ones get new symbols.
+ */
+static bool rehash_dictionary(DICTIONARY *dictionary, BYTE4 buckets)
+{
+	register int i;
+
+	Context;
+	while(2*dictionary->size > buckets)
+		buckets *= 2;
+
+	if(dictionary->table != NULL)
+		nfree(dictionary->table);
+	dictionary->table = (SYMBOL *)nmalloc(sizeof(SYMBOL)*buckets);
+	if(dictionary->table == NULL) {
+		dictionary->buckets = 0;
+		return FALSE;
+	}
+	memset(dictionary->table, 0, sizeof(SYMBOL)*buckets);
+	dictionary->buckets = buckets;
+
+	for(i=0; i<dictionary->size; ++i)
+		dictionary->table[find_bucket(dictionary, dictionary->entry[i])] = i+1;
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Search_Dictionary
+ *
+ *	Purpose:	Search the dictionary for the specified word, returning its
+ *			symbol if found, or zero otherwise.
+ */
+static int search_dictionary(DICTIONARY *dictionary, STRING word, bool *find)
+{
+	BYTE4 bucket;
+
+	Context;
+	/*
+	 *	If the dictionary has no words, then obviously the word won't be found
+	 */
+	if(dictionary->buckets == 0)
+		goto notfound;
+
+	bucket = find_bucket(dictionary, word);
+	if(dictionary->table[bucket] == 0)
+		goto notfound;
+
+	*find=TRUE;
+	return dictionary->table[bucket]-1;
+
+notfound:
+	*find=FALSE;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Find_Word
+ *
+ *	Purpose:	Return the symbol corresponding to the word specified.
+ *			We assume that the word with index zero is equal to a
+ *			NULL word, indicating an error condition.
+ */
+static SYMBOL find_word(DICTIONARY *dictionary, STRING word)
+{
+	bool found;
+
+	Context;
+	return search_dictionary(dictionary, word, &found);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Wordcmp
+ *
+ *	Purpose:	Compare two folded words, and return zero if they are
+ *			equal.  Words are ordered by their hash first and then
+ *			by their length and characters, which is arbitrary but
+ *			consistent, and means that words which differ almost
+ *			never get as far as comparing characters.
+ */
+static int wordcmp(STRING word1, STRING word2)
+{
+	if(word1.hash != word2.hash)
+		return (word1.hash < word2.hash) ? -1 : 1;
+	if(word1.length != word2.length)
+		return (word1.length < word2.length) ? -1 : 1;
+
+	return wmemcmp(word1.word, word2.word, word1.length);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Free_Dictionary
+ *
+ *	Purpose:	Release the memory consumed by the dictionary.
+ */
+static void free_dictionary(DICTIONARY *dictionary)
+{
+	Context;
+	if(dictionary == NULL)
+		return;
+	if(dictionary->entry != NULL) {
+		nfree(dictionary->entry);
+		dictionary->entry = NULL;
+	}
+	if(dictionary->table != NULL) {
+		nfree(dictionary->table);
+		dictionary->table = NULL;
+	}
+	dictionary->buckets = 0;
+	dictionary->size = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void free_model(MODEL *model)
+{
+	Context;
+	if(model == NULL)
+		return;
+	/*
+	 *	Every node and child array of both trees lives in the pool, so
+	 *	there is no need to walk the trees to release them.
+	 */
+	free_pool(&model->pool);
+	if(model->halcontext != NULL) {
+		nfree(model->halcontext);
+	}
+	free_index(&model->index);
+	free_phrases(&model->phrases);
+	if(model->dictionary != NULL) {
+		free_words(model->dictionary);
+		free_dictionary(model->dictionary);
+		nfree(model->dictionary);
+	}
+	nfree(model);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Free_Tree
+ *
+ *	Purpose:	Return a tree and all of its subtrees to the free lists of
+ *			the pool, so that they can be reused by new_node().
+ */
+static void free_tree(NODEPOOL *pool, TREE *tree)
+{
+	static int level = 0;
+	register int i;
+
+	Context;
+	if(tree == NULL)
+		return;
+
+	if(tree->tree!=NULL) {
+		for(i=0; i<tree->branch; ++i) {
+			++level;
+			free_tree(pool, tree->tree[i]);
+			--level;
+		}
+		free_array(pool, tree->tree, array_class(tree->capacity));
+	}
+	tree->tree = (TREE **)pool->free_node;
+	pool->free_node = tree;
+	--pool->nodes;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Initialize_Pool
+ *
+ *	Purpose:	Set up an empty pool for the nodes and child arrays of a
+ *			model.
+ */
+static void initialize_pool(NODEPOOL *pool)
+{
+	register int i;
+
+	Context;
+	pool->slab = NULL;
+	pool->top = NULL;
+	pool->left = 0;
+	pool->free_node = NULL;
+	for(i=0; i<POOL_CLASSES; ++i)
+		pool->free_array[i] = NULL;
+	pool->big = NULL;
+	pool->nodes = 0;
+	pool->bytes = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Pool_Alloc
+ *
+ *	Purpose:	Carve a block of memory off the current slab of the pool,
+ *			starting a new slab if the current one is used up.
+ */
+static void *pool_alloc(NODEPOOL *pool, size_t size)
+{
+	SLAB *slab;
+	void *block;
+
+	size = (size+sizeof(void *)-1) & ~(sizeof(void *)-1);
+	if(size > pool->left) {
+		slab = (SLAB *)nmalloc(POOL_SLAB);
+		if(slab == NULL) {
+			error("pool_alloc", "Unable to allocate slab");
+			return NULL;
+		}
+		slab->next = pool->slab;
+		pool->slab = slab;
+		pool->bytes += POOL_SLAB;
+		pool->top = (char *)(slab+1);
+		pool->left = POOL_SLAB-sizeof(SLAB);
+	}
+
+	block = pool->top;
+	pool->top += size;
+	pool->left -= size;
+
+	return block;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Free_Pool
+ *
+ *	Purpose:	Release every slab and large array owned by the pool at
+ *			once.
+ */
+static void free_pool(NODEPOOL *pool)
+{
+	SLAB *slab;
+	BLOCK *block;
+
+	Context;
+	while(pool->slab != NULL) {
+		slab = pool->slab;
+		pool->slab = slab->next;
+		nfree(slab);
+	}
+	while(pool->big != NULL) {
+		block = pool->big;
+		pool->big = block->next;
+		nfree(block);
+	}
+	initialize_pool(pool);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Array_Class
+ *
+ *	Purpose:	Return the size class of a child array with room for the
+ *			given number of children.  Class n holds 2^n pointers.
+ */
+static int array_class(int size)
+{
+	int class = 0;
+
+	while((1<<class) < size)
+		++class;
+
+	return class;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	New_Array
+ *
+ *	Purpose:	Allocate a child block of the given size class, reusing
+ *			a freed one if possible.  Arrays that are too big for a
+ *			slab are allocated on their own and kept on a list so
+ *			that free_pool() can still find them.
+ */
+static TREE **new_array(NODEPOOL *pool, int class)
+{
+	TREE **array;
+	BLOCK *block;
+
+	if(class >= POOL_CLASSES) {
+		block = (BLOCK *)nmalloc(sizeof(BLOCK)+ARRAY_SIZE(class));
+		if(block == NULL) {
+			error("new_array", "Unable to allocate array");
+			return NULL;
+		}
+		block->prev = NULL;
+		block->next = pool->big;
+		if(pool->big != NULL)
+			pool->big->prev = block;
+		pool->big = block;
+		pool->bytes += sizeof(BLOCK)+ARRAY_SIZE(class);
+		return (TREE **)(block+1);
+	}
+
+	if(pool->free_array[class] != NULL) {
+		array = (TREE **)pool->free_array[class];
+		pool->free_array[class] = *(void **)array;
+		return array;
+	}
+
+	return (TREE **)pool_alloc(pool, ARRAY_SIZE(class));
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Free_Array
+ *
+ *	Purpose:	Put a child array back on the free list of its size class.
+ */
+static void free_array(NODEPOOL *pool, TREE **array, int class)
+{
+	BLOCK *block;
+
+	if(class >= POOL_CLASSES) {
+		block = (BLOCK *)array-1;
+		if(block->prev != NULL)
+			block->prev->next = block->next;
+		else
+			pool->big = block->next;
+		if(block->next != NULL)
+			block->next->prev = block->prev;
+		pool->bytes -= sizeof(BLOCK)+ARRAY_SIZE(class);
+		nfree(block);
+		return;
+	}
+
+	*(void **)array = pool->free_array[class];
+	pool->free_array[class] = array;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Initialize_Phrases
+ *
+ *	Purpose:	Set up an empty phrase store.
+ */
+static void initialize_phrases(PHRASESTORE *store)
+{
+	store->ring = NULL;
+	store->serial = NULL;
+	store->capacity = 0;
+	store->first = 0;
+	store->nextserial = 0;
+	store->oldest = NULL;
+	store->newest = NULL;
+	store->bytes = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Free_Phrases
+ *
+ *	Purpose:	Release the rings and every chunk of a phrase store.
+ */
+static void free_phrases(PHRASESTORE *store)
+{
+	PHRASECHUNK *chunk;
+
+	Context;
+	while((chunk = store->oldest) != NULL) {
+		store->oldest = chunk->next;
+		nfree(chunk);
+	}
+	if(store->ring != NULL)
+		nfree(store->ring);
+	if(store->serial != NULL)
+		nfree(store->serial);
+	initialize_phrases(store);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Reserve_Phrases
+ *
+ *	Purpose:	Make room in the phrase store of a model for count more
+ *			phrases, whose lengths and symbols add up to symbols, so
+ *			that appending them allocates nothing.  The rings grow
+ *			to the next power of two that holds them, and they all
+ *			go in the newest chunk or a new one big enough.
+ */
+static bool reserve_phrases(MODEL *model, BYTE4 count, size_t symbols)
+{
+	PHRASESTORE *store = &model->phrases;
+	PHRASECHUNK *chunk;
+	SYMBOL **ring;
+	BYTE4 *serial;
+	size_t size;
+	BYTE4 capacity;
+	register BYTE4 i;
+
+	if(model->phrasecount+count > store->capacity) {
+		capacity = store->capacity > 0 ? store->capacity : 64;
+		while(capacity < model->phrasecount+count)
+			capacity *= 2;
+		ring = (SYMBOL **)nmalloc(sizeof(SYMBOL *)*capacity);
+		serial = (BYTE4 *)nmalloc(sizeof(BYTE4)*capacity);
+		if(ring == NULL || serial == NULL) {
+			error("reserve_phrases", "Unable to allocate ring");
+			if(ring != NULL)
+				nfree(ring);
+			if(serial != NULL)
+				nfree(serial);
+			return FALSE;
+		}
+		/*
+		 *	Unwrap the rings on the way, so that the oldest phrase
+		 *	comes first in the new ones.
+		 */
+		for(i=0; i<model->phrasecount; ++i) {
+			ring[i] = PHRASE(model, i);
+			serial[i] = SERIAL(model, i);
+		}
+		if(store->ring != NULL)
+			nfree(store->ring);
+		if(store->serial != NULL)
+			nfree(store->serial);
+		store->bytes += (sizeof(SYMBOL *)+sizeof(BYTE4))*(capacity-store->capacity);
+		store->ring = ring;
+		store->serial = serial;
+		store->capacity = capacity;
+		store->first = 0;
+	}
+
+	if(store->newest == NULL || store->newest->size-store->newest->used < symbols) {
+		// a newest chunk too small for the phrase with nothing in it is no use to keep
+		if(store->newest != NULL && store->newest->live == 0) {
+			chunk = store->newest;
+			store->newest = chunk->prev;
+			if(store->newest != NULL)
+				store->newest->next = NULL;
+			else
+				store->oldest = NULL;
+			store->bytes -= sizeof(PHRASECHUNK)+sizeof(SYMBOL)*chunk->size;
+			nfree(chunk);
+		}
+		size = symbols > PHRASE_CHUNK ? symbols : PHRASE_CHUNK;
+		chunk = (PHRASECHUNK *)nmalloc(sizeof(PHRASECHUNK)+sizeof(SYMBOL)*size);
+		if(chunk == NULL) {
+			error("reserve_phrases", "Unable to allocate chunk");
+			return FALSE;
+		}
+		chunk->next = NULL;
+		chunk->prev = store->newest;
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->live = 0;
+		if(store->newest != NULL)
+			store->newest->next = chunk;
+		else
+			store->oldest = chunk;
+		store->newest = chunk;
+		store->bytes += sizeof(PHRASECHUNK)+sizeof(SYMBOL)*size;
+	}
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Append_Phrase
+ *
+ *	Purpose:	Add a phrase of the given length to the end of the phrase
+ *			store of a model, and return it with its length set for
+ *			the caller to fill in the symbols.  They are written at
+ *			the end of the newest chunk, but only kept there once
+ *			index_phrase() finds the phrase is new.
+ */
+static SYMBOL *append_phrase(MODEL *model, SYMBOL size)
+{
+	PHRASESTORE *store = &model->phrases;
+	SYMBOL *phrase;
+
+	if(reserve_phrases(model, 1, (size_t)size+1) == FALSE)
+		return NULL;
+	// the serials have run out, so number the phrases from 0 again
+	if(store->nextserial == UINT32_MAX)
+		renumber_serials(model);
+
+	phrase = CHUNK_SYMBOLS(store->newest)+store->newest->used;
+	phrase[0] = size;
+	PHRASE(model, model->phrasecount) = phrase;
+	SERIAL(model, model->phrasecount) = store->nextserial++;
+	model->phrasecount++;
+
+	return phrase;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Repeat_Phrase
+ *
+ *	Purpose:	Add another copy of a phrase already in the phrase store
+ *			of a model to the end of it, for the caller to index.
+ */
+static SYMBOL *repeat_phrase(MODEL *model, SYMBOL *phrase)
+{
+	PHRASESTORE *store = &model->phrases;
+
+	if(reserve_phrases(model, 1, 0) == FALSE)
+		return NULL;
+	if(store->nextserial == UINT32_MAX)
+		renumber_serials(model);
+
+	PHRASE(model, model->phrasecount) = phrase;
+	SERIAL(model, model->phrasecount) = store->nextserial++;
+	model->phrasecount++;
+
+	return phrase;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Drop_Oldest_Phrases
+ *
+ *	Purpose:	Take the oldest phrases off the phrase store of a model
+ *			by moving the start of the ring past them.  They must be
+ *			unindexed first, which frees their symbols if no copy of
+ *			them is left.
+ */
+static void drop_oldest_phrases(MODEL *model, BYTE4 count)
+{
+	PHRASESTORE *store = &model->phrases;
+
+	if(count > model->phrasecount)
+		count = model->phrasecount;
+	if(count == 0)
+		return;
+	store->first = (store->first+count)&(store->capacity-1);
+	model->phrasecount -= count;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Remove_Phrase
+ *
+ *	Purpose:	Take a phrase off the phrase store of a model, closing the
+ *			gap from whichever end of the ring is nearer.  Like the
+ *			oldest, it must be unindexed first.
+ */
+static void remove_phrase(MODEL *model, BYTE4 index)
+{
+	register BYTE4 i;
+
+	if(index >= model->phrasecount)
+		return;
+	if(index < model->phrasecount/2) {
+		for(i=index; i>0; --i) {
+			PHRASE(model, i) = PHRASE(model, i-1);
+			SERIAL(model, i) = SERIAL(model, i-1);
+		}
+		drop_oldest_phrases(model, 1);
+		return;
+	}
+	for(i=index; i+1<model->phrasecount; ++i) {
+		PHRASE(model, i) = PHRASE(model, i+1);
+		SERIAL(model, i) = SERIAL(model, i+1);
+	}
+	model->phrasecount--;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Release_Chunk
+ *
+ *	Purpose:	Count one distinct phrase less in a chunk, and free the
+ *			chunk if that was the last.  The newest chunk is kept to
+ *			append to, and starts over instead.
+ */
+static void release_chunk(PHRASESTORE *store, PHRASECHUNK *chunk)
+{
+	if(--chunk->live > 0)
+		return;
+	if(chunk == store->newest) {
+		chunk->used = 0;
+		return;
+	}
+
+	if(chunk->prev != NULL)
+		chunk->prev->next = chunk->next;
+	else
+		store->oldest = chunk->next;
+	chunk->next->prev = chunk->prev;
+	store->bytes -= sizeof(PHRASECHUNK)+sizeof(SYMBOL)*chunk->size;
+	nfree(chunk);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Initialize_Index
+ *
+ *	Purpose:	Set up an empty phrase index.
+ */
+static void initialize_index(PHRASEINDEX *index)
+{
+	index->symbol = NULL;
+	index->symbols = 0;
+	index->group = NULL;
+	index->groups = 0;
+	index->capacity = 0;
+	index->live = 0;
+	index->bucket = NULL;
+	index->buckets = 0;
+	index->bytes = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Free_Index
+ *
+ *	Purpose:	Release every list, group and bucket of a phrase index.
+ *			The symbols of the groups go with the chunks of the phrase
+ *			store.
+ */
+static void free_index(PHRASEINDEX *index)
+{
+	register BYTE4 i;
+
+	Context;
+	for(i=0; i<index->symbols; ++i)
+		free_postings(index, &index->symbol[i]);
+	for(i=0; i<index->groups; ++i)
+		free_postings(index, &index->group[i].copies);
+	if(index->symbol != NULL)
+		nfree(index->symbol);
+	if(index->group != NULL)
+		nfree(index->group);
+	if(index->bucket != NULL)
+		nfree(index->bucket);
+	initialize_index(index);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Renumber_Serials
+ *
+ *	Purpose:	Number the phrases of a model from 0 again in the order
+ *			they were learnt, along with the copies of every group.
+ */
+static void renumber_serials(MODEL *model)
+{
+	PHRASEINDEX *index = &model->index;
+	POSTINGS *copies;
+	register BYTE4 i, j;
+
+	Context;
+	for(i=0; i<index->groups; ++i) {
+		copies = &index->group[i].copies;
+		for(j=copies->head; j<copies->size; ++j)
+			POSTED(copies)[j] = phrase_place(model, POSTED(copies)[j]);
+	}
+	for(i=0; i<model->phrasecount; ++i)
+		SERIAL(model, i) = i;
+	model->phrases.nextserial = model->phrasecount;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Index_Phrase
+ *
+ *	Purpose:	Add the newest phrase to the group of phrases just like
+ *			it, pointing it at the symbols they share and giving back
+ *			the room append_phrase() wrote it in.  A phrase not seen
+ *			before keeps that room and starts a group, which goes on
+ *			the lists of the symbols in it.  The terminator and the
+ *			error symbol are in every phrase or none, so aren't
+ *			listed.  Returns FALSE if there is no memory for the
+ *			group or its lists, in which case the group is undone
+ *			and the phrase can't be kept.
+ */
+static bool index_phrase(MODEL *model, BYTE4 place)
+{
+	PHRASEINDEX *index = &model->index;
+	PHRASESTORE *store = &model->phrases;
+	SYMBOL *phrase = PHRASE(model, place);
+	SYMBOL highest = 0;
+	BYTE4 hash, group, symbols;
+	POSTINGS *lists, *list;
+	register BYTE4 i;
+
+	hash = hash_phrase(phrase);
+	group = find_group(model, phrase, hash);
+	if(group != NO_GROUP) {
+		PHRASE(model, place) = index->group[group].phrase;
+		return add_posting(index, &index->group[group].copies, SERIAL(model, place));
+	}
+
+	group = new_group(model, phrase, hash);
+	if(group == NO_GROUP)
+		return FALSE;
+	if(add_posting(index, &index->group[group].copies, SERIAL(model, place)) == FALSE)
+		goto fail;
+
+	for(i=1; i<=phrase[0]; ++i)
+		if(phrase[i] > highest)
+			highest = phrase[i];
+	if(highest >= index->symbols) {
+		symbols = index->symbols > 0 ? index->symbols : 256;
+		while(symbols <= highest)
+			symbols *= 2;
+		lists = (POSTINGS *)nrealloc(index->symbol, sizeof(POSTINGS)*symbols);
+		if(lists == NULL) {
+			error("index_phrase", "Unable to reallocate lists");
+			goto fail;
+		}
+		memset(lists+index->symbols, 0, sizeof(POSTINGS)*(symbols-index->symbols));
+		index->bytes += sizeof(POSTINGS)*(symbols-index->symbols);
+		index->symbol = lists;
+		index->symbols = symbols;
+	}
+	for(i=1; i<=phrase[0]; ++i) {
+		if(phrase[i] < 2)
+			continue;
+		// a symbol repeated in the phrase is listed once
+		list = &index->symbol[phrase[i]];
+		if(list->size > list->head && POSTED(list)[list->size-1] == group)
+			continue;
+		if(add_posting(index, list, group) == FALSE)
+			goto fail;
+	}
+
+	store->newest->used += phrase[0]+1;
+	store->newest->live++;
+	index->group[group].chunk = store->newest;
+	index->live++;
+	return TRUE;
+
+fail:
+	/*
+	 *	The group is the newest, so it comes off the lists it got onto
+	 *	and its number is given back.  The room of the phrase was never
+	 *	taken from the chunk.
+	 */
+	unlink_group(index, group);
+	free_postings(index, &index->group[group].copies);
+	index->group[group].phrase = NULL;
+	index->groups--;
+	return FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Unindex_Phrase
+ *
+ *	Purpose:	Take a phrase out of its group.  Once no copy of it is
+ *			left the group comes off the lists of the symbols in it
+ *			and its symbols are given back, so the phrase must have
+ *			been unlearnt by then.  The oldest phrase is at the front
+ *			of its group, and its group usually at the front of the
+ *			lists, so taking it off costs next to nothing.
+ */
+static void unindex_phrase(MODEL *model, BYTE4 place)
+{
+	PHRASEINDEX *index = &model->index;
+	SYMBOL *phrase = PHRASE(model, place);
+	BYTE4 group;
+
+	group = find_group(model, phrase, hash_phrase(phrase));
+	if(group == NO_GROUP)
+		return;
+	remove_posting(index, &index->group[group].copies, SERIAL(model, place));
+	if(index->group[group].copies.size > 0)
+		return;
+
+	unlink_group(index, group);
+	release_chunk(&model->phrases, index->group[group].chunk);
+	index->group[group].phrase = NULL;
+	index->group[group].chunk = NULL;
+	index->live--;
+	// give back the room of the groups once most of them have gone
+	if(index->capacity > 1024 && index->live < index->capacity/8)
+		compact_groups(index);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Renumber_Index
+ *
+ *	Purpose:	Give the phrases of a model, and the lists of its index,
+ *			the symbols that the remap table of trimdictionary() has
+ *			for the old ones, and hash the groups again, since their
+ *			phrases have changed.  The copies of a phrase share its
+ *			symbols, so each group is renumbered once.
+ */
+static void renumber_index(MODEL *model, SYMBOL *remap, BYTE4 size)
+{
+	PHRASEINDEX *index = &model->index;
+	POSTINGS *lists;
+	SYMBOL *phrase;
+	BYTE4 symbols;
+	register BYTE4 i, j;
+
+	Context;
+	/*
+	 *	Words that went had no phrases left, and the rest only move
+	 *	down, so the lists can be moved in place from the bottom up.
+	 */
+	for(i=2; i<size && i<index->symbols; ++i) {
+		if(remap[i] == i)
+			continue;
+		if(index->symbol[i].size > 0 && remap[i] != 0) {
+			index->symbol[remap[i]] = index->symbol[i];
+			memset(&index->symbol[i], 0, sizeof(POSTINGS));
+		} else {
+			free_postings(index, &index->symbol[i]);
+		}
+	}
+	// the words kept are the ones with the highest numbers left
+	for(i=size; i>2 && remap[i-1] == 0; --i)
+		;
+	symbols = index->symbols;
+	while(symbols > 256 && symbols/4 > remap[i-1])
+		symbols /= 2;
+	if(symbols < index->symbols &&
+	   (lists = (POSTINGS *)nrealloc(index->symbol, sizeof(POSTINGS)*symbols)) != NULL) {
+		index->bytes -= sizeof(POSTINGS)*(index->symbols-symbols);
+		index->symbol = lists;
+		index->symbols = symbols;
+	}
+
+	for(i=0; i<index->groups; ++i) {
+		if((phrase = index->group[i].phrase) == NULL)
+			continue;
+		for(j=1; j<=phrase[0]; ++j)
+			phrase[j] = remap[phrase[j]];
+		index->group[i].hash = hash_phrase(phrase);
+	}
+	rehash_groups(index, index->buckets);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Hash_Phrase
+ *
+ *	Purpose:	Hash the length and the symbols of a phrase.
+ */
+static BYTE4 hash_phrase(SYMBOL *phrase)
+{
+	BYTE4 hash = 2166136261U;
+	register BYTE4 i;
+
+	for(i=0; i<=phrase[0]; ++i)
+		hash = (hash^phrase[i])*16777619U;
+
+	return hash;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Find_Group
+ *
+ *	Purpose:	Return the group of phrases that are just like the given
+ *			one, or NO_GROUP if there are none.
+ */
+static BYTE4 find_group(MODEL *model, SYMBOL *phrase, BYTE4 hash)
+{
+	PHRASEINDEX *index = &model->index;
+	SYMBOL *other;
+	BYTE4 group;
+
+	if(index->buckets == 0)
+		return NO_GROUP;
+	for(group = index->bucket[hash&(index->buckets-1)]; group != NO_GROUP; group = index->group[group].next) {
+		if(index->group[group].hash != hash)
+			continue;
+		other = index->group[group].phrase;
+		if(other == phrase || (other[0] == phrase[0] && memcmp(other+1, phrase+1, sizeof(SYMBOL)*phrase[0]) == 0))
+			return group;
+	}
+
+	return NO_GROUP;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	New_Group
+ *
+ *	Purpose:	Start an empty group for a phrase with the given hash,
+ *			numbered after every other.  The groups that have gone
+ *			are closed up first if they are the most of them, and the
+ *			table grows once it has more groups than buckets.
+ */
+static BYTE4 new_group(MODEL *model, SYMBOL *phrase, BYTE4 hash)
+{
+	PHRASEINDEX *index = &model->index;
+	PHRASEGROUP *groups;
+	BYTE4 group, capacity;
+
+	if(index->groups == index->capacity && index->live < index->groups/2)
+		compact_groups(index);
+	if(index->groups == index->capacity) {
+		capacity = index->capacity > 0 ? index->capacity*2 : 256;
+		groups = (PHRASEGROUP *)nrealloc(index->group, sizeof(PHRASEGROUP)*capacity);
+		if(groups == NULL) {
+			error("new_group", "Unable to reallocate groups");
+			return NO_GROUP;
+		}
+		index->bytes += sizeof(PHRASEGROUP)*(capacity-index->capacity);
+		index->group = groups;
+		index->capacity = capacity;
+	}
+	if(index->live >= index->buckets && rehash_groups(index, index->buckets > 0 ? index->buckets*2 : 256) == FALSE)
+		return NO_GROUP;
+
+	group = index->groups++;
+	index->group[group].hash = hash;
+	index->group[group].phrase = phrase;
+	index->group[group].chunk = NULL;
+	memset(&index->group[group].copies, 0, sizeof(POSTINGS));
+	link_group(index, group);
+
+	return group;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Compact_Groups
+ *
+ *	Purpose:	Close up the groups that are left, numbering them from 0
+ *			in the same order, and renumber the lists of the symbols
+ *			to match.  The table shrinks if it is mostly empty.
+ */
+static void compact_groups(PHRASEINDEX *index)
+{
+	PHRASEGROUP *groups;
+	BYTE4 *number, kept = 0, capacity, buckets;
+	POSTINGS *list;
+	register BYTE4 i, j;
+
+	Context;
+	number = (BYTE4 *)nmalloc(sizeof(BYTE4)*index->groups);
+	if(number == NULL)
+		return;
+	for(i=0; i<index->groups; ++i) {
+		if(index->group[i].phrase == NULL)
+			continue;
+		number[i] = kept;
+		index->group[kept++] = index->group[i];
+	}
+	index->groups = kept;
+
+	for(i=0; i<index->symbols; ++i) {
+		list = &index->symbol[i];
+		for(j=list->head; j<list->size; ++j)
+			POSTED(list)[j] = number[POSTED(list)[j]];
+	}
+	nfree(number);
+
+	capacity = index->capacity;
+	while(capacity > 256 && capacity/4 >= kept)
+		capacity /= 2;
+	if(capacity < index->capacity &&
+	   (groups = (PHRASEGROUP *)nrealloc(index->group, sizeof(PHRASEGROUP)*capacity)) != NULL) {
+		index->bytes -= sizeof(PHRASEGROUP)*(index->capacity-capacity);
+		index->group = groups;
+		index->capacity = capacity;
+	}
+	buckets = index->buckets;
+	while(buckets > 256 && buckets/2 > kept)
+		buckets /= 2;
+	if(rehash_groups(index, buckets) == FALSE)
+		rehash_groups(index, index->buckets);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Link_Group
+ *
+ *	Purpose:	Put a group at the head of the chain of its bucket.
+ */
+static void link_group(PHRASEINDEX *index, BYTE4 group)
+{
+	BYTE4 *bucket = &index->bucket[index->group[group].hash&(index->buckets-1)];
+
+	index->group[group].next = *bucket;
+	*bucket = group;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Unlink_Group
+ *
+ *	Purpose:	Take a group off the lists of the symbols in its phrase
+ *			and out of the chain of its bucket.
+ */
+static void unlink_group(PHRASEINDEX *index, BYTE4 group)
+{
+	SYMBOL *phrase = index->group[group].phrase;
+	BYTE4 *link;
+	register BYTE4 i;
+
+	for(i=1; i<=phrase[0]; ++i)
+		if(phrase[i] >= 2 && phrase[i] < index->symbols)
+			remove_posting(index, &index->symbol[phrase[i]], group);
+
+	link = &index->bucket[index->group[group].hash&(index->buckets-1)];
+	while(*link != group)
+		link = &index->group[*link].next;
+	*link = index->group[group].next;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Rehash_Groups
+ *
+ *	Purpose:	Chain the groups in use into a table of the given number
+ *			of buckets, a power of two.
+ */
+static bool rehash_groups(PHRASEINDEX *index, BYTE4 buckets)
+{
+	BYTE4 *bucket;
+	register BYTE4 i;
+
+	if(buckets == 0)
+		return TRUE;
+	if(buckets != index->buckets) {
+		bucket = (BYTE4 *)nmalloc(sizeof(BYTE4)*buckets);
+		if(bucket == NULL) {
+			error("rehash_groups", "Unable to allocate buckets");
+			return FALSE;
+		}
+		if(index->bucket != NULL)
+			nfree(index->bucket);
+		index->bytes += sizeof(BYTE4)*buckets;
+		index->bytes -= sizeof(BYTE4)*index->buckets;
+		index->bucket = bucket;
+		index->buckets = buckets;
+	}
+	for(i=0; i<buckets; ++i)
+		index->bucket[i] = NO_GROUP;
+
+	for(i=0; i<index->groups; ++i)
+		if(index->group[i].phrase != NULL)
+			link_group(index, i);
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Phrase_Place
+ *
+ *	Purpose:	Return where the phrase with the given serial is among
+ *			the phrases of a model, or the number of phrases if it
+ *			has been deleted.
+ */
+static BYTE4 phrase_place(MODEL *model, BYTE4 serial)
+{
+	BYTE4 low = 0, high = model->phrasecount, middle;
+
+	while(low < high) {
+		middle = low+(high-low)/2;
+		if(SERIAL(model, middle) < serial)
+			low = middle+1;
+		else
+			high = middle;
+	}
+	if(low < model->phrasecount && SERIAL(model, low) == serial)
+		return low;
+
+	return model->phrasecount;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Add_Posting
+ *
+ *	Purpose:	Add an entry, greater than any already there, to the end
+ *			of a list.
+ */
+static bool add_posting(PHRASEINDEX *index, POSTINGS *list, BYTE4 entry)
+{
+	BYTE4 *many, capacity, size;
+
+	if(list->capacity == 0 && list->size == 0) {
+		list->entry.one = entry;
+		list->head = 0;
+		list->size = 1;
+		return TRUE;
+	}
+	if(list->size == (list->capacity > 0 ? list->capacity : 1)) {
+		/*
+		 *	Close up the entries deleted from the front first, if
+		 *	that makes room enough.
+		 */
+		if(list->head > 0 && list->head >= list->size/2) {
+			memmove(POSTED(list), POSTED(list)+list->head, sizeof(BYTE4)*(list->size-list->head));
+			list->size -= list->head;
+			list->head = 0;
+		} else {
+			capacity = list->capacity > 0 ? list->capacity*2 : 4;
+			many = (BYTE4 *)nmalloc(sizeof(BYTE4)*capacity);
+			if(many == NULL) {
+				error("add_posting", "Unable to allocate list");
+				return FALSE;
+			}
+			size = list->size-list->head;
+			memcpy(many, POSTED(list)+list->head, sizeof(BYTE4)*size);
+			free_postings(index, list);
+			list->entry.many = many;
+			list->size = size;
+			list->capacity = capacity;
+			index->bytes += sizeof(BYTE4)*capacity;
+		}
+	}
+	POSTED(list)[list->size++] = entry;
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Remove_Posting
+ *
+ *	Purpose:	Take an entry off a list.  The entries are kept in order,
+ *			so the first is only stepped over, and any other is found
+ *			by a binary search.  A list down to a quarter of its room
+ *			moves into half as much.
+ */
+static void remove_posting(PHRASEINDEX *index, POSTINGS *list, BYTE4 entry)
+{
+	BYTE4 *posted = POSTED(list), *many, low = list->head, high = list->size, middle, size;
+
+	if(low < high && posted[low] == entry) {
+		list->head++;
+	} else {
+		while(low < high) {
+			middle = low+(high-low)/2;
+			if(posted[middle] < entry)
+				low = middle+1;
+			else
+				high = middle;
+		}
+		if(low == list->size || posted[low] != entry)
+			return;
+		memmove(posted+low, posted+low+1, sizeof(BYTE4)*(list->size-low-1));
+		list->size--;
+	}
+	if(list->head == list->size) {
+		free_postings(index, list);
+		return;
+	}
+
+	size = list->size-list->head;
+	if(list->capacity > 8 && size <= list->capacity/4 &&
+	   (many = (BYTE4 *)nmalloc(sizeof(BYTE4)*(list->capacity/2))) != NULL) {
+		memcpy(many, posted+list->head, sizeof(BYTE4)*size);
+		nfree(list->entry.many);
+		index->bytes -= sizeof(BYTE4)*(list->capacity-list->capacity/2);
+		list->entry.many = many;
+		list->capacity /= 2;
+		list->head = 0;
+		list->size = size;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Free_Postings
+ *
+ *	Purpose:	Empty a list and release its entries.
+ */
+static void free_postings(PHRASEINDEX *index, POSTINGS *list)
+{
+	if(list->capacity > 0) {
+		nfree(list->entry.many);
+		index->bytes -= sizeof(BYTE4)*list->capacity;
+	}
+	memset(list, 0, sizeof(POSTINGS));
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Initialize_Dictionary
+ *
+ *	Purpose:	Add dummy words to the dictionary.
+ */
+static void initialize_dictionary(DICTIONARY *dictionary)
+{
+	STRING word = { 12, 0, L"<BRAINSTART>" };
+	STRING end = { 5, 0, L"<FIN>" };
+
+	Context;
+	(void)add_word(dictionary, word);
+	(void)add_word(dictionary, end);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	New_Dictionary
+ *
+ *	Purpose:	Allocate room for a new dictionary.
+ */
+static DICTIONARY *new_dictionary(void)
+{
+	DICTIONARY *dictionary = NULL;
+
+	Context;
+	dictionary = (DICTIONARY *)nmalloc(sizeof(DICTIONARY));
+	if(dictionary == NULL) {
+		error("new_dictionary", "Unable to allocate dictionary.");
+		return NULL;
+	}
+
+	dictionary->size = 0;
+	dictionary->entry = NULL;
+	dictionary->buckets = 0;
+	dictionary->table = NULL;
+
+	return dictionary;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Dictionary
+ *
+ *	Purpose:	Save a dictionary to the specified file: the number of
+ *			words and characters, where each word starts (plus
+ *			where the last one ends) and then all the characters.
+ */
+static void save_dictionary(SAVEBUFFER *buffer, DICTIONARY *dictionary)
+{
+	register int i;
+	BYTE4 header[2], start;
+
+	Context;
+	header[0] = dictionary->size;
+	header[1] = 0;
+	for(i=0; i<dictionary->size; ++i)
+		header[1] += dictionary->entry[i].length;
+	save_bytes(buffer, header, sizeof(header));
+
+	start = 0;
+	for(i=0; i<dictionary->size; ++i) {
+		save_bytes(buffer, &start, sizeof(BYTE4));
+		start += dictionary->entry[i].length;
+	}
+	save_bytes(buffer, &start, sizeof(BYTE4));
+	save_padding(buffer);
+
+	for(i=0; i<dictionary->size; ++i)
+		save_bytes(buffer, dictionary->entry[i].word, sizeof(wchar_t)*dictionary->entry[i].length);
+	save_padding(buffer);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Dictionary
+ *
+ *	Purpose:	Load a dictionary from the specified file.
+ */
+static void load_dictionary(FILE *file, DICTIONARY *dictionary)
+{
+	register int i;
+	int size;
+
+	Context;
+	if ( fread(&size, sizeof(BYTE4), 1, file) ) {
+		for(i=0; i<size; ++i) {
+			load_word(file, dictionary);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Word
+ *
+ *	Purpose:	Load a dictionary word from a file.
+ */
+static void load_word(FILE *file, DICTIONARY *dictionary)
+{
+	register int i;
+	STRING word;
+
+	Context;
+	if ( fread(&(word.length), sizeof(BYTE1), 1, file) ) {
+		word.word = (wchar_t *)nmalloc(sizeof(wchar_t)*word.length);
+		if(word.word == NULL) {
+			error("load_word", "Unable to allocate word");
+			return;
+		}
+		for(i=0; i<word.length; ++i) {
+			if (!fread(&(word.word[i]), sizeof(wchar_t), 1, file) ) {
+				break;
+			}
+		}
+		add_word(dictionary, word);
+		nfree(word.word);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	New_Node
+ *
+ *	Purpose:	Allocate a new node for the n-gram tree, and initialise
+ *			its contents to sensible values.
+ */
+static TREE *new_node(NODEPOOL *pool)
+{
+	TREE *node = NULL;
+
+	Context;
+	/*
+	 *	Take a node off the free list, or carve a new one from the pool
+	 */
+	if(pool->free_node != NULL) {
+		node = pool->free_node;
+		pool->free_node = (TREE *)node->tree;
+	} else {
+		node = (TREE *)pool_alloc(pool, sizeof(TREE));
+	}
+	if(node == NULL) {
+		error("new_node", "Unable to allocate the node.");
+		goto fail;
+	}
+
+	/*
+	 *	Initialise the contents of the node
+	 */
+	node->symbol = 0;
+	node->usage = 0;
+	node->branch = 0;
+	node->capacity = 0;
+	node->tree = NULL;
+	++pool->nodes;
+
+	return node;
+
+fail:
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	New_Model
+ *
+ *	Purpose:	Create and initialise a new ngram model.
+ */
+static MODEL *new_model(int order)
+{
+	MODEL *model = NULL;
+
+	Context;
+	model = (MODEL *)nmalloc(sizeof(MODEL));
+	if(model == NULL) {
+		error("new_model", "Unable to allocate model.");
+		goto fail;
+	}
+
+	model->order = order;
+	initialize_pool(&model->pool);
+	model->forward = new_node(&model->pool);
+	model->backward = new_node(&model->pool);
+	model->halcontext = (TREE **)nmalloc(sizeof(TREE *)*(order+2));
+	if(model->halcontext == NULL) {
+		error("new_model", "Unable to allocate context array.");
+		goto fail;
+	}
+	initialize_context(model, model->halcontext);
+	model->phrasecount = 0;
+	initialize_phrases(&model->phrases);
+	initialize_index(&model->index);
+	model->dictionary = new_dictionary();
+	initialize_dictionary(model->dictionary);
+	model->journal = 0;
+
+	return model;
+
+fail:
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Update_Model
+ *
+ *	Purpose:	Update the model with the specified symbol.
+ */
+static void update_model(MODEL *model, int symbol)
+{
+	register int i;
+
+	Context;
+	/*
+	 *	Update all of the models in the current context with the specified
+	 *	symbol.
+	 */
+
+	// add the symbol to all contexts - some may be at different levels deep and there may be max [order] different branches being built at once
+	// Question: Why does it go up to order+1? Nothing ever uses that halcontext as far as I can see.Maybe its only here so that the i-1 can be 'add_symbol'ed within the same loop and the programmer was lazy ;)
+	for(i=(model->order+1); i>0; --i)
+		if(model->halcontext[i-1] != NULL)
+			model->halcontext[i] = add_symbol(&model->pool, model->halcontext[i-1], (SYMBOL)symbol);
+
+	return;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Update_Context
+ *
+ *	Purpose:	Update the given context of the model without adding the
+ *			symbol.
+ */
+static void update_context(MODEL *model, TREE **halcontext, int symbol)
+{
+	register int i;
+
+	Context;
+	for(i=(model->order+1); i>0; --i)
+		if(halcontext[i-1] != NULL)
+			halcontext[i] = find_symbol(halcontext[i-1], symbol);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Add_Symbol
+ *
+ *	Purpose:	Update the statistics of the specified tree with the
+ *			specified symbol, which may mean growing the tree if the
+ *			symbol hasn't been seen in this context before.
+ */
+static TREE *add_symbol(NODEPOOL *pool, TREE *tree, SYMBOL symbol)
+{
+	int i;
+
+	Context;
+	/*
+	 *	Search for the symbol in the subtree of the tree node.
+	 */
+	i = find_symbol_add(pool, tree, symbol);
+	if(i < 0)
+		return NULL;
+
+	/*
+	 *	Increment the symbol counts
+	 */
+	if((COUNTS(tree)[i] < SYMBOL_MAX)) {
+		COUNTS(tree)[i] += 1;
+		tree->usage += 1;
+	}
+
+	return tree->tree[i];
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Find_Symbol
+ *
+ *	Purpose:	Return a pointer to the child node, if one exists, which
+ *			contains the specified symbol.
+ */
+static TREE *find_symbol(TREE *node, int symbol)
+{
+	register int i;
+	TREE *found = NULL;
+	bool found_symbol = FALSE;
+
+	Context;
+	/*
+	 *	Perform a binary search for the symbol.
+	 */
+	i = search_node(node, symbol, &found_symbol);
+	if(found_symbol == TRUE)
+		found=node->tree[i];
+
+	return found;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Find_Symbol_Add
+ *
+ *	Purpose:	This function is conceptually similar to find_symbol,
+ *			apart from the fact that if the symbol is not found,
+ *			a new node is automatically allocated and added to the
+ *			tree.  Return the position of the child in the subtree,
+ *			or -1 if it couldn't be added.
+ */
+static int find_symbol_add(NODEPOOL *pool, TREE *node, int symbol)
+{
+	register int i;
+	TREE *found = NULL;
+	bool found_symbol = FALSE;
+
+	Context;
+	/*
+	 *		Perform a binary search for the symbol.  If the symbol isn't found,
+	 *		attach a new sub-node to the tree node so that it remains sorted.
+	 */
+	i = search_node(node, symbol, &found_symbol);
+	if(found_symbol == FALSE) {
+		found = new_node(pool);
+		if(found == NULL)
+			return -1;
+		found->symbol = symbol;
+		if(add_node(pool, node, found, i) == FALSE) {
+			free_tree(pool, found);
+			return -1;
+		}
+	}
+
+	return i;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Add_Node
+ *
+ *	Purpose:	Attach a new child node to the sub-tree of the tree
+ *			specified, with a count of zero.
+ */
+static bool add_node(NODEPOOL *pool, TREE *tree, TREE *node, int position)
+{
+	int move;
+
+	Context;
+	/*
+	 *	Make sure there is room for one more child node, which may mean
+	 *	allocating the sub-tree from scratch or doubling its capacity.
+	 */
+	tree->branch += 1;
+	if(realloc_tree(pool, tree) == NULL) {
+		error("add_node", "Unable to reallocate subtree.");
+		tree->branch -= 1;
+		return FALSE;
+	}
+
+	/*
+	 *	Shuffle the nodes, symbols and counts down so that we can insert
+	 *	the new node at the subtree index given by position.
+	 */
+	move = tree->branch-1-position;
+	memmove(&tree->tree[position+1], &tree->tree[position], sizeof(TREE *)*move);
+	memmove(&SYMBOLS(tree)[position+1], &SYMBOLS(tree)[position], sizeof(SYMBOL)*move);
+	memmove(&COUNTS(tree)[position+1], &COUNTS(tree)[position], sizeof(SYMBOL)*move);
+
+	/*
+	 *	Add the new node to the sub-tree.
+	 */
+	tree->tree[position] = node;
+	SYMBOLS(tree)[position] = node->symbol;
+	COUNTS(tree)[position] = 0;
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Count_Below
+ *
+ *	Purpose:	Count how many of the given sorted symbols are smaller
+ *			than the specified symbol, which is where the symbol lives
+ *			or should be inserted.  No branch depends on the symbols,
+ *			and when SSE2 or AVX2 is available the comparison is done
+ *			a whole vector at a time.  The symbols are unsigned, so
+ *			both sides are biased by the sign bit before the signed
+ *			vector compare.
+ */
+static int count_below(SYMBOL *symbols, int size, SYMBOL symbol)
+{
+	register int i = 0;
+	int below = 0;
+#ifdef MEGAHAL_WIDE_SYMBOLS
+#if defined(__AVX2__)
+	__m256i bias256 = _mm256_set1_epi32((int)0x80000000);
+	__m256i key256 = _mm256_set1_epi32((int)(symbol^0x80000000));
+
+	for(; i+8 <= size; i += 8) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(symbols+i)), bias256);
+		below += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi32(key256, v)))>>2;
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i bias128 = _mm_set1_epi32((int)0x80000000);
+	__m128i key128 = _mm_set1_epi32((int)(symbol^0x80000000));
+
+	for(; i+4 <= size; i += 4) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((__m128i *)(symbols+i)), bias128);
+		below += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi32(key128, v)))>>2;
+	}
+#endif
+#else
+#if defined(__AVX2__)
+	__m256i bias256 = _mm256_set1_epi16((short)0x8000);
+	__m256i key256 = _mm256_set1_epi16((short)(symbol^0x8000));
+
+	for(; i+16 <= size; i += 16) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(symbols+i)), bias256);
+		below += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi16(key256, v)))>>1;
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i bias128 = _mm_set1_epi16((short)0x8000);
+	__m128i key128 = _mm_set1_epi16((short)(symbol^0x8000));
+
+	for(; i+8 <= size; i += 8) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((__m128i *)(symbols+i)), bias128);
+		below += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi16(key128, v)))>>1;
+	}
+#endif
+#endif
+	for(; i < size; ++i)
+		below += (symbols[i] < symbol);
+
+	return below;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Search_Node
+ *
+ *	Purpose:	Search for the specified symbol on the subtree of the
+ *			given node.  Return the position of the child node in the
+ *			subtree if the symbol was found, or the position where it
+ *			should be inserted to keep the subtree sorted if it wasn't.
+ *			Wide subtrees are narrowed down with a binary search until
+ *			SEARCH_WINDOW symbols are left, which are then scanned by
+ *			count_below() along with every narrower subtree.
+ */
+static int search_node(TREE *node, int symbol, bool *found_symbol)
+{
+	SYMBOL *symbols;
+	register int position;
+	int min;
+	int max;
+	int middle;
+
+	Context;
+	/*
+	 *	Handle the special case where the subtree is empty.
+	 */
+	if(node->branch == 0) {
+		position = 0;
+		goto notfound;
+	}
+
+	/*
+	 *	Narrow a wide subtree down to a window with a lower bound
+	 *	binary search, then scan what is left.
+	 */
+	symbols = SYMBOLS(node);
+	min = 0;
+	max = node->branch;
+	while(max-min > SEARCH_WINDOW) {
+		middle = (min+max)/2;
+		if(symbols[middle] < (SYMBOL)symbol)
+			min = middle+1;
+		else
+			max = middle;
+	}
+	position = min+count_below(symbols+min, max-min, (SYMBOL)symbol);
+	if((position < node->branch) && (symbols[position] == (SYMBOL)symbol))
+		goto found;
+
+notfound:
+Context;
+	*found_symbol = FALSE;
+	return position;
+
+found:
+	*found_symbol = TRUE;
+	return position;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Initialize_Context
+ *
+ *	Purpose:	Set the given context of the model to a default value.
+ */
+static void initialize_context(MODEL *model, TREE **halcontext)
+{
+	register int i;
+
+	Context;
+	for(i=0; i<=model->order; ++i)
+		halcontext[i] = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Learn
+ *
+ *	Purpose:	Learn from the user's input.
+ */
+static void learn(MODEL *model, DICTIONARY *words)
+{
+	SYMBOL *phrase;
+
+	Context;
+	phrase = add_phrase(model, words);
+	if(phrase != NULL)
+		learn_phrase(model, phrase);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Add_Phrase
+ *
+ *	Purpose:	Add the user's input to the end of the model's phrases
+ *			as symbols, putting new words in the dictionary, and
+ *			return the phrase for the trees to be trained on.  Input
+ *			that isn't worth learning from returns NULL.
+ */
+static SYMBOL *add_phrase(MODEL *model, DICTIONARY *words)
+{
+	register int i;
+	SYMBOL *phrase;
+	bool nospace = TRUE;
+
+	Context;
+	/*
+	 *	We only learn from inputs which are long enough
+	 */
+	if(words->size <= (model->order))
+		return NULL;
+
+	// check if there are spaces in the word or its merely one word+punctuation
+	for(i=1; i<words->size; i++)
+		if(words->entry[i].word[0] != (wchar_t)31) {
+			nospace = FALSE;
+			break;
+		}
+	if (nospace)
+		return NULL;
+
+	// Add a new phrase to the model
+	phrase = append_phrase(model, words->size+1);
+	if (phrase == NULL) {
+		error("learn", "Unable to allocate phrase");
+		return NULL;
+	}
+
+	/*
+	 *	Add the symbols to the model's dictionary if necessary, followed
+	 *	by the sentence-terminating symbol.
+	 */
+	for(i=0; i<words->size; ++i)
+		if((phrase[i+1] = add_word(model->dictionary, words->entry[i])) == 0) {
+			// the dictionary is full, and symbol 0 would end the phrase wherever it was learnt
+			model->phrasecount--;
+			return NULL;
+		}
+	phrase[words->size+1] = 1;
+	// a phrase learnt before is kept once, so the copy may point elsewhere
+	if(index_phrase(model, model->phrasecount-1) == FALSE) {
+		model->phrasecount--;
+		error("learn", "Unable to index phrase");
+		return NULL;
+	}
+	// only a phrase that was kept is journalled, so a replay keeps the same ones
+	journal_words(words);
+
+	return PHRASE(model, model->phrasecount-1);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Learn_Phrase
+ *
+ *	Purpose:	Train both trees of the model on a phrase that is already
+ *			in symbols, with its length in front and ending with the
+ *			sentence-terminating symbol.
+ */
+static void learn_phrase(MODEL *model, SYMBOL *phrase)
+{
+	register int i;
+
+	Context;
+	/*
+	 *	Train the model in the forwards direction.  Start by initializing
+	 *	the context of the model.
+	 */
+	initialize_context(model, model->halcontext);
+	model->halcontext[0] = model->forward;
+	for(i=1; i<=phrase[0]; ++i)
+		update_model(model, phrase[i]);
+
+	/*
+	 *	Train the model in the backwards direction, which also ends with
+	 *	the sentence-terminating symbol.
+	 */
+	initialize_context(model, model->halcontext);
+	model->halcontext[0] = model->backward;
+	for(i=phrase[0]-1; i>=1; --i)
+		update_model(model, phrase[i]);
+	update_model(model, 1);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Train
+ *
+ *	Purpose:	Infer a MegaHAL brain from the contents of a text file.
+ */
+static void train(MODEL *model, char *filename)
+{
+	TRAINING *training;
+
+	Context;
+	training = start_training(filename);
+	if(training == NULL)
+		return;
+
+	while(read_batch(training) > 0)
+		learn_batch(training, model, 0);
+
+	stop_training(training);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Start_Training
+ *
+ *	Purpose:	Open a text file to be learnt a batch of lines at a time
+ *			with read_batch() and learn_batch(), and stop_training()
+ *			once it is done or given up.
+ */
+static TRAINING *start_training(char *filename)
+{
+	TRAINING *training;
+	FILE *file;
+	register int i;
+
+	Context;
+	if(filename == NULL)
+		return NULL;
+
+	file = fopen(filename, "r");
+	if(file == NULL) {
+		putlog(LOG_MISC, "*", "Unable to find the personality %s\n", filename);
+		return NULL;
+	}
+
+	training = (TRAINING *)nmalloc(sizeof(TRAINING));
+	if(training == NULL) {
+		error("start_training", "Unable to allocate training");
+		fclose(file);
+		return NULL;
+	}
+	memset(training, 0, sizeof(TRAINING));
+	training->file = file;
+	fseeko(file, 0, SEEK_END);
+	training->length = ftello(file);
+	rewind(file);
+
+	training->name = (char *)nmalloc(strlen(filename)+1);
+	training->size = 65536;
+	training->text = (char *)nmalloc(training->size);
+	if(training->name == NULL || training->text == NULL) {
+		error("start_training", "Unable to allocate training");
+		stop_training(training);
+		return NULL;
+	}
+	strcpy(training->name, filename);
+	for(i=0; i<TRAIN_BATCH; ++i)
+		if((training->words[i] = new_dictionary()) == NULL) {
+			stop_training(training);
+			return NULL;
+		}
+
+	return training;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Read_Batch
+ *
+ *	Purpose:	Read the next batch of lines from the file, skipping
+ *			comments, for learn_batch() to learn.  Return how many
+ *			lines were read, which is 0 at the end of the file.
+ */
+static int read_batch(TRAINING *training)
+{
+	char buffer[1024], *text;
+	size_t length, size;
+
+	Context;
+	training->count = 0;
+	training->next = 0;
+	training->used = 0;
+	while(training->count < TRAIN_BATCH) {
+
+		if(fgets(buffer, 1024, training->file) == NULL)
+			break;
+		length = strlen(buffer);
+		training->done += length;
+		training->lines += 1;
+		if(buffer[0] == '#')
+			continue; // comments
+
+		if(training->used+length+1 > training->size) {
+			size = training->size*2;
+			while(size < training->used+length+1)
+				size *= 2;
+			text = (char *)nrealloc(training->text, size);
+			if(text == NULL) {
+				error("read_batch", "Unable to reallocate text");
+				break;
+			}
+			training->text = text;
+			training->size = size;
+		}
+		memcpy(training->text+training->used, buffer, length+1);
+		training->start[training->count++] = training->used;
+		training->used += length+1;
+	}
+
+	return training->count;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Learn_Batch
+ *
+ *	Purpose:	Learn the lines read by read_batch() that haven't been
+ *			learnt yet, a step at a time, until they are all learnt
+ *			or the deadline on the usec_now() clock has passed (a
+ *			deadline of 0 never does).  A step is one line, or on
+ *			several threads TRAIN_STEP lines for each of them, made
+ *			into words and then learnt.  Return TRUE once the whole
+ *			batch has been learnt; otherwise the next call carries
+ *			on where this one stopped.
+ */
+static bool learn_batch(TRAINING *training, MODEL *model, long long deadline)
+{
+	TRAINSHARE share[MAX_GENERATORS];
+	int threads, last;
+	register int i;
+
+	Context;
+	while(training->next < training->count) {
+		if(deadline > 0 && usec_now() >= deadline)
+			return FALSE;
+		threads = train_threads(training->count-training->next);
+		last = training->next+(threads == 1 ? 1 : threads*TRAIN_STEP);
+		if(last > training->count)
+			last = training->count;
+
+		for(i=0; i<threads; ++i) {
+			share[i].training = training;
+			share[i].first = training->next+(last-training->next)*i/threads;
+			share[i].last = training->next+(last-training->next)*(i+1)/threads;
+			share[i].partial = NULL;
+		}
+		run_shares(split_lines, share, threads);
+
+		if(threads == 1)
+			learn(model, training->words[training->next]);
+		else
+			learn_lines(training, model, training->next, last, threads);
+		training->next = last;
+	}
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Learn_Lines
+ *
+ *	Purpose:	Learn some lines of a batch on several threads.  The
+ *			phrases are added to the model in the order of the file,
+ *			then each thread trains a tree of its own on a share of
+ *			them, and those are merged into the model's.  Since all
+ *			learning does is count, the model ends up exactly as if
+ *			learn() had been called on every line in turn.
+ */
+static void learn_lines(TRAINING *training, MODEL *model, int first, int last, int threads)
+{
+	TRAINSHARE share[MAX_GENERATORS];
+	SYMBOL *phrase;
+	int count = 0;
+	register int i;
+
+	Context;
+	for(i=first; i<last; ++i) {
+		phrase = add_phrase(model, training->words[i]);
+		if(phrase != NULL)
+			training->phrases[count++] = phrase;
+	}
+
+	for(i=0; i<threads; ++i) {
+		share[i].training = training;
+		share[i].first = count*i/threads;
+		share[i].last = count*(i+1)/threads;
+		share[i].partial = new_model(model->order);
+		if(share[i].partial == NULL)
+			break;
+	}
+	if(i < threads) {
+		/*
+		 *	Without the memory for the partial trees, train the
+		 *	model's own on the phrases one after the other.
+		 */
+		while(--i >= 0)
+			free_model(share[i].partial);
+		for(i=0; i<count; ++i)
+			learn_phrase(model, training->phrases[i]);
+		return;
+	}
+
+	run_shares(learn_phrases, share, threads);
+
+	for(i=0; i<threads; ++i) {
+		merge_tree(&model->pool, model->forward, share[i].partial->forward);
+		merge_tree(&model->pool, model->backward, share[i].partial->backward);
+		free_model(share[i].partial);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Stop_Training
+ *
+ *	Purpose:	Close the file being learnt and free the training.
+ */
+static void stop_training(TRAINING *training)
+{
+	register int i;
+
+	Context;
+	if(training == NULL)
+		return;
+
+	if(training->file != NULL)
+		fclose(training->file);
+	for(i=0; i<TRAIN_BATCH; ++i)
+		if(training->words[i] != NULL) {
+			free_words(training->words[i]);
+			free_dictionary(training->words[i]);
+			nfree(training->words[i]);
+		}
+	if(training->text != NULL)
+		nfree(training->text);
+	if(training->name != NULL)
+		nfree(training->name);
+	nfree(training);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Train_Threads
+ *
+ *	Purpose:	Decide how many threads to share a batch of lines out
+ *			between.  A thread isn't worth starting for less than a
+ *			few hundred lines.
+ */
+static int train_threads(int count)
+{
+	int threads = 1;
+
+#ifdef MEGAHAL_THREADS
+	threads = trainthreads;
+	if(threads > MAX_GENERATORS)
+		threads = MAX_GENERATORS;
+	if(threads > count/256)
+		threads = count/256;
+	if(threads < 1)
+		threads = 1;
+#endif
+	return threads;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Run_Shares
+ *
+ *	Purpose:	Do the work of each share on a thread of its own, the
+ *			first on the calling thread, and wait for them all.  A
+ *			share whose thread couldn't be started is done here too.
+ */
+static void run_shares(void *(*work)(void *), TRAINSHARE *share, int threads)
+{
+#ifdef MEGAHAL_THREADS
+	pthread_t helper[MAX_GENERATORS];
+	bool started[MAX_GENERATORS];
+	sigset_t all, old;
+	register int i;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for(i=1; i<threads; ++i) {
+		share[i].work = work;
+		share[i].trouble[0] = '\0';
+		started[i] = (pthread_create(&helper[i], NULL, run_share, &share[i]) == 0);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+	work(&share[0]);
+#ifdef MEGAHAL_THREADS
+	for(i=1; i<threads; ++i) {
+		if(started[i]) {
+			pthread_join(helper[i], NULL);
+			if(share[i].trouble[0] != '\0')
+				putlog(LOG_MISC, "*", "%s", share[i].trouble);
+		} else
+			work(&share[i]);
+	}
+#endif
+}
+
+#ifdef MEGAHAL_THREADS
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Run_Share
+ *
+ *	Purpose:	The body of a helper thread of run_shares(), which does
+ *			the work of its share without logging anything.
+ */
+static void *run_share(void *arg)
+{
+	TRAINSHARE *share = (TRAINSHARE *)arg;
+
+	helpershare = share;
+	share->work(share);
+	helpershare = NULL;
+
+	return NULL;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Split_Lines
+ *
+ *	Purpose:	Make a share of the lines of a step into words, the way
+ *			the user's input is.  A line that isn't text in this
+ *			locale is left without any.
+ */
+static void *split_lines(void *arg)
+{
+	TRAINSHARE *share = (TRAINSHARE *)arg;
+	TRAINING *training = share->training;
+	DICTIONARY *words;
+	wchar_t *wbuffer;
+	register int i;
+
+	Context;
+	for(i=share->first; i<share->last; ++i) {
+		words = training->words[i];
+		free_words(words);
+		free_dictionary(words);
+
+		wbuffer = locale_to_wchar(training->text+training->start[i]);
+		if(wbuffer == NULL)
+			continue; // not text in this locale
+		if(wcslen(wbuffer) > 0)
+			wbuffer[wcslen(wbuffer)-1] = L'\0';
+
+		upper(wbuffer);
+		make_words(wbuffer, words);
+		nfree(wbuffer);
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Learn_Phrases
+ *
+ *	Purpose:	Train the partial trees of a share on its phrases.
+ */
+static void *learn_phrases(void *arg)
+{
+	TRAINSHARE *share = (TRAINSHARE *)arg;
+	register int i;
+
+	Context;
+	for(i=share->first; i<share->last; ++i)
+		learn_phrase(share->partial, share->training->phrases[i]);
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Merge_Tree
+ *
+ *	Purpose:	Add the counts of a tree trained on its own to the same
+ *			branches of another, growing it where it hasn't got them.
+ *			A count stops at the most a symbol can hold, as it does
+ *			in add_symbol(), so the sums come out the same as if one
+ *			tree had learnt everything.
+ */
+static void merge_tree(NODEPOOL *pool, TREE *into, TREE *from)
+{
+	TREE **nodes = NULL, *node;
+	SYMBOL add;
+	int missing = 0, old;
+	register int i, j, k;
+
+	/*
+	 *	Both lists of children are sorted, so one pass over them finds
+	 *	the ones the tree hasn't got yet.  Make their nodes first, so
+	 *	that running out of memory leaves the tree as it was.
+	 */
+	for(i=j=0; i<from->branch; ++i) {
+		while(j < into->branch && SYMBOLS(into)[j] < SYMBOLS(from)[i])
+			++j;
+		if(j == into->branch || SYMBOLS(into)[j] != SYMBOLS(from)[i])
+			++missing;
+	}
+	if(missing > 0) {
+		nodes = (TREE **)nmalloc(sizeof(TREE *)*missing);
+		if(nodes == NULL) {
+			error("merge_tree", "Unable to allocate nodes.");
+			return;
+		}
+		for(i=0; i<missing; ++i)
+			if((nodes[i] = new_node(pool)) == NULL)
+				break;
+		old = into->branch;
+		into->branch += missing;
+		if(i < missing || realloc_tree(pool, into) == NULL) {
+			error("merge_tree", "Unable to reallocate subtree.");
+			into->branch = old;
+			while(--i >= 0)
+				free_tree(pool, nodes[i]);
+			nfree(nodes);
+			return;
+		}
+
+		/*
+		 *	Merge the new children in from the end, so that each of
+		 *	the old ones moves once at most.
+		 */
+		j = old-1;
+		k = into->branch-1;
+		for(i=from->branch-1; i>=0; --i) {
+			while(j >= 0 && SYMBOLS(into)[j] > SYMBOLS(from)[i]) {
+				into->tree[k] = into->tree[j];
+				SYMBOLS(into)[k] = SYMBOLS(into)[j];
+				COUNTS(into)[k--] = COUNTS(into)[j--];
+			}
+			if(j >= 0 && SYMBOLS(into)[j] == SYMBOLS(from)[i]) {
+				into->tree[k] = into->tree[j];
+				SYMBOLS(into)[k] = SYMBOLS(into)[j];
+				COUNTS(into)[k--] = COUNTS(into)[j--];
+				continue;
+			}
+			node = nodes[--missing];
+			node->symbol = SYMBOLS(from)[i];
+			into->tree[k] = node;
+			SYMBOLS(into)[k] = node->symbol;
+			COUNTS(into)[k--] = 0;
+		}
+		nfree(nodes);
+	}
+
+	/*
+	 *	Add the counts of the children, then do the same below them.
+	 */
+	for(i=j=0; i<from->branch; ++i) {
+		while(SYMBOLS(into)[j] != SYMBOLS(from)[i])
+			++j;
+		add = MIN(COUNTS(from)[i], SYMBOL_MAX-COUNTS(into)[j]);
+		COUNTS(into)[j] += add;
+		into->usage += add;
+		merge_tree(pool, into->tree[j], from->tree[i]);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Show_Dictionary
+ *
+ *	Purpose:	Display the dictionary for training purposes.
+ */
+static bool show_dictionary(DICTIONARY *dictionary)
+{
+	register int i;
+	register int k;
+	FILE *file;
+	char *ldict_word;
+	wchar_t *tmp;
+	char filename[PATH_SIZE], tempname[PATH_SIZE+8];
+
+	Context;
+	snprintf(filename, sizeof(filename), "%s%smegahal.dic", directory_cache, SEP);
+	file = begin_save(filename, tempname, sizeof(tempname), "w");
+	if(file == NULL) {
+		warn("show_dictionary", "Unable to open file");
+		return FALSE;
+	}
+
+	for(i=0; i<dictionary->size; ++i) {
+		tmp = (wchar_t *)nmalloc(sizeof(wchar_t)*(dictionary->entry[i].length+1));
+		for(k=0;k<dictionary->entry[i].length;k++)
+			tmp[k] = dictionary->entry[i].word[k];
+		tmp[dictionary->entry[i].length] = L'\0';
+		ldict_word = wchar_to_locale(tmp);
+		fputs(ldict_word, file);
+		nfree(tmp);
+		nfree(ldict_word);
+		fprintf(file, "\n");
+	}
+
+	return finish_save(file, tempname, filename, FALSE);
+}
+
+static bool save_phrases(MODEL *model)
+{
+	register int i, j;
+	DICTIONARY *phrase;
+	FILE *file;
+	char *phrase2;
+	char filename[PATH_SIZE], tempname[PATH_SIZE+8];
+
+	Context;
+	snprintf(filename, sizeof(filename), "%s%smegahal.phr", directory_cache, SEP);
+	file = begin_save(filename, tempname, sizeof(tempname), "w");
+	if(file == NULL) {
+		warn("save_phrases", "Unable to open file");
+		return FALSE;
+	}
+	phrase = new_dictionary();
+
+	for(i=0; i<model->phrasecount; ++i) {
+
+		phrase->size = PHRASE(model, i)[0]-1;
+		if(realloc_dictionary(phrase) == NULL) {
+			error("save_phrases", "Unable to reallocate dictionary");
+			free_dictionary(phrase);
+			nfree(phrase);
+			return finish_save(file, tempname, filename, TRUE);
+		}
+		for(j=0; j<phrase->size; ++j)
+			phrase->entry[j] = model->dictionary->entry[PHRASE(model, i)[j+1]];
+
+		phrase2 = wchar_to_locale(make_output(replycontext, phrase));
+		fputs(phrase2, file);
+		fprintf(file, "\n");
+		nfree(phrase2);
+	}
+
+	free_dictionary(phrase);
+	nfree(phrase);
+	return finish_save(file, tempname, filename, FALSE);
+}
+
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Model
+ *
+ *	Purpose:	Save the current state to a MegaHAL brain file.  The
+ *			cookie is followed by the format version, the width
+ *			of a symbol in bytes, the order and the width of a
+ *			character, and the token of the journal that carries on
+ *			from the brain.  Every symbol, count, branch and phrase
+ *			entry after that is written at the symbol width.  See
+ *			MAPPING for the sections that follow.  Returns FALSE if
+ *			any of the brain, dictionary or phrase files could not
+ *			be written, in which case that file is left as it was.
+ */
+static bool save_model(char *modelname, MODEL *model)
+{
+	BYTE1 version, width;
+	SAVEBUFFER buffer;
+	FILE *file;
+	bool saved;
+  char filename[PATH_SIZE], tempname[PATH_SIZE+8];
+
+	Context;
+
+	saved = show_dictionary(model->dictionary);
+	saved = save_phrases(model) && saved;
+
+	snprintf(filename, sizeof(filename), "%s%s%s", directory_cache, SEP, modelname);
+	file = begin_save(filename, tempname, sizeof(tempname), "wb");
+	if(file == NULL) {
+		warn("save_model", "Unable to open file `%s'", filename);
+		return FALSE;
+	}
+
+	/*
+	 *	Without a block to fill, everything goes straight to stdio.
+	 */
+	buffer.file = file;
+	buffer.used = 0;
+	buffer.offset = 0;
+	buffer.failed = FALSE;
+	buffer.data = (BYTE1 *)nmalloc(SAVE_BLOCK);
+	buffer.size = (buffer.data == NULL) ? 0 : SAVE_BLOCK;
+
+	save_bytes(&buffer, _T(COOKIE), sizeof(wchar_t)*wcslen(_T(COOKIE)));
+	version = BRAIN_VERSION;
+	save_bytes(&buffer, &version, sizeof(BYTE1));
+	width = sizeof(SYMBOL);
+	save_bytes(&buffer, &width, sizeof(BYTE1));
+	save_bytes(&buffer, &(model->order), sizeof(BYTE1));
+	width = sizeof(wchar_t);
+	save_bytes(&buffer, &width, sizeof(BYTE1));
+	save_padding(&buffer);
+	save_bytes(&buffer, &(model->journal), sizeof(BYTE8));
+	save_tree(&buffer, model->forward);
+	save_tree(&buffer, model->backward);
+	save_dictionary(&buffer, model->dictionary);
+
+	save_groups(&buffer, model);
+	flush_savebuffer(&buffer);
+	if(buffer.data != NULL)
+		nfree(buffer.data);
+	if(finish_save(file, tempname, filename, buffer.failed) == FALSE) {
+		warn("save_model", "Unable to write file `%s'", filename);
+		return FALSE;
+	}
+
+	return saved;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Begin_Save
+ *
+ *	Purpose:	Open a file to save into in place of the given one.  It
+ *			is named after the process, so that a save running in
+ *			the background never writes into the same file as one
+ *			in the foreground.
+ */
+static FILE *begin_save(char *filename, char *tempname, size_t size, const char *mode)
+{
+	snprintf(tempname, size, "%s.%d", filename, (int)getpid());
+	return fopen(tempname, mode);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Finish_Save
+ *
+ *	Purpose:	Close a file opened by begin_save(), and once it is
+ *			safely on disk rename it over the one it replaces, so
+ *			that a crash in the middle of a save never leaves a
+ *			half written file behind.  If anything went wrong the
+ *			file is removed instead.
+ */
+static bool finish_save(FILE *file, char *tempname, char *filename, bool failed)
+{
+	if(fflush(file) != 0 || fsync(fileno(file)) != 0)
+		failed = TRUE;
+	if(fclose(file) != 0)
+		failed = TRUE;
+	if(!failed && rename(tempname, filename) == 0)
+		return TRUE;
+
+	unlink(tempname);
+	return FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Bytes
+ *
+ *	Purpose:	Append bytes to the block being saved, writing the
+ *			block out first if they don't fit.  Anything larger
+ *			than the whole block is written directly.
+ */
+static void save_bytes(SAVEBUFFER *buffer, const void *bytes, size_t length)
+{
+	buffer->offset += length;
+	if(buffer->used+length > buffer->size) {
+		flush_savebuffer(buffer);
+		if(length > buffer->size) {
+			if(fwrite(bytes, 1, length, buffer->file) != length)
+				buffer->failed = TRUE;
+			return;
+		}
+	}
+	memcpy(buffer->data+buffer->used, bytes, length);
+	buffer->used += length;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Flush_SaveBuffer
+ *
+ *	Purpose:	Write out whatever the block being saved holds.
+ */
+static void flush_savebuffer(SAVEBUFFER *buffer)
+{
+	if(buffer->used == 0)
+		return;
+	if(fwrite(buffer->data, 1, buffer->used, buffer->file) != buffer->used)
+		buffer->failed = TRUE;
+	buffer->used = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Padding
+ *
+ *	Purpose:	Pad the file being saved with zeros up to the next
+ *			multiple of eight bytes, where the next section starts.
+ */
+static void save_padding(SAVEBUFFER *buffer)
+{
+	static const BYTE1 zeros[8] = {0};
+
+	if(buffer->offset%8 != 0)
+		save_bytes(buffer, zeros, 8-buffer->offset%8);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Groups
+ *
+ *	Purpose:	Save the phrases of a model, each one once however many
+ *			copies of it there are, in the order of their groups and
+ *			without their lengths and terminators, which the offsets
+ *			give back.  After them comes the number of copies and a
+ *			column with the phrase of each in the order they were
+ *			learnt, or no copies if every phrase is there once in
+ *			that order.
+ */
+static void save_groups(SAVEBUFFER *buffer, MODEL *model)
+{
+	PHRASEINDEX *index = &model->index;
+	BYTE4 header[2], *number, *kind, count = 0;
+	POSTINGS *copies;
+	register BYTE4 i, j;
+
+	number = (BYTE4 *)nmalloc(sizeof(BYTE4)*(index->groups+1));
+	kind = (BYTE4 *)nmalloc(sizeof(BYTE4)*(model->phrasecount+1));
+	if(number == NULL || kind == NULL) {
+		error("save_groups", "Unable to allocate phrase numbers");
+		buffer->failed = TRUE;
+		if(number != NULL)
+			nfree(number);
+		if(kind != NULL)
+			nfree(kind);
+		return;
+	}
+
+	header[0] = 0;
+	header[1] = 0;
+	for(i=0; i<index->groups; ++i) {
+		if(index->group[i].phrase == NULL)
+			continue;
+		number[i] = header[0]++;
+		header[1] += index->group[i].phrase[0];
+		copies = &index->group[i].copies;
+		for(j=copies->head; j<copies->size; ++j)
+			kind[phrase_place(model, POSTED(copies)[j])] = number[i];
+	}
+	save_bytes(buffer, header, sizeof(header));
+	header[1] = 0;
+	for(i=0; i<index->groups; ++i) {
+		if(index->group[i].phrase == NULL)
+			continue;
+		save_bytes(buffer, &header[1], sizeof(BYTE4));
+		header[1] += index->group[i].phrase[0];
+	}
+	save_bytes(buffer, &header[1], sizeof(BYTE4));
+	save_padding(buffer);
+	for(i=0; i<index->groups; ++i)
+		if(index->group[i].phrase != NULL)
+			save_bytes(buffer, index->group[i].phrase+1, sizeof(SYMBOL)*index->group[i].phrase[0]);
+	save_padding(buffer);
+
+	for(i=0; i<model->phrasecount; ++i)
+		if(kind[i] != i)
+			count = model->phrasecount;
+	save_bytes(buffer, &count, sizeof(BYTE4));
+	save_padding(buffer);
+	save_bytes(buffer, kind, sizeof(BYTE4)*count);
+	save_padding(buffer);
+	nfree(number);
+	nfree(kind);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Tree
+ *
+ *	Purpose:	Save a tree structure to the specified file: the number
+ *			of nodes, then a column for each field of the nodes in
+ *			preorder.  Knowing the number of nodes tells where every
+ *			column goes, so they are all filled in one walk.  The
+ *			padding between them is left as a hole in the file, which
+ *			reads back as zeros.
+ */
+static void save_tree(SAVEBUFFER *buffer, TREE *node)
+{
+	static const size_t width[4] = {sizeof(SYMBOL), sizeof(BYTE4), sizeof(SYMBOL), sizeof(SYMBOL)};
+	BYTE4 header[2];
+	SAVECOLUMN column[4];
+	off_t at;
+	register int i;
+
+	Context;
+	header[0] = recurse_tree(node);
+	header[1] = 0;
+	save_bytes(buffer, header, sizeof(header));
+	flush_savebuffer(buffer);
+
+	at = buffer->offset;
+	for(i=0; i<4; ++i) {
+		column[i].used = 0;
+		column[i].at = at;
+		at += ((size_t)header[0]*width[i]+7) & ~(size_t)7;
+	}
+	save_node(column, buffer, node, 0);
+	for(i=0; i<4; ++i)
+		flush_column(&column[i], buffer);
+
+	if(fseeko(buffer->file, column[3].at, SEEK_SET) != 0)
+		buffer->failed = TRUE;
+	buffer->offset = column[3].at;
+	save_padding(buffer);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Node
+ *
+ *	Purpose:	Add the fields of a node and then of all its children
+ *			to the columns.  The count of a node lives in its parent,
+ *			so it is passed in.
+ */
+static void save_node(SAVECOLUMN *column, SAVEBUFFER *buffer, TREE *node, SYMBOL count)
+{
+	register int i;
+
+	save_field(&column[0], buffer, &(node->symbol), sizeof(SYMBOL));
+	save_field(&column[1], buffer, &(node->usage), sizeof(BYTE4));
+	save_field(&column[2], buffer, &count, sizeof(SYMBOL));
+	save_field(&column[3], buffer, &(node->branch), sizeof(SYMBOL));
+
+	for(i=0; i<node->branch; ++i)
+		save_node(column, buffer, node->tree[i], COUNTS(node)[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Field
+ *
+ *	Purpose:	Add one field to a column, writing the column's block
+ *			out first if it is full.
+ */
+static void save_field(SAVECOLUMN *column, SAVEBUFFER *buffer, const void *field, size_t length)
+{
+	if(column->used+length > SAVE_COLUMN)
+		flush_column(column, buffer);
+	memcpy(column->data+column->used, field, length);
+	column->used += length;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Flush_Column
+ *
+ *	Purpose:	Write out whatever the block of a column holds, at the
+ *			place in the file where the column has got to.
+ */
+static void flush_column(SAVECOLUMN *column, SAVEBUFFER *buffer)
+{
+	if(column->used == 0)
+		return;
+	if(fseeko(buffer->file, column->at, SEEK_SET) != 0 ||
+	   fwrite(column->data, 1, column->used, buffer->file) != column->used)
+		buffer->failed = TRUE;
+	column->at += column->used;
+	column->used = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Symbol
+ *
+ *	Purpose:	Read one symbol-sized value that was saved with the given
+ *			width, widening it if the brain was saved with narrower
+ *			symbols than this build uses.
+ */
+static bool load_symbol(FILE *file, int width, SYMBOL *symbol)
+{
+	BYTE2 narrow;
+
+	if(width == sizeof(SYMBOL))
+		return fread(symbol, sizeof(SYMBOL), 1, file) == 1;
+
+	if(!fread(&narrow, sizeof(BYTE2), 1, file))
+		return FALSE;
+	*symbol = narrow;
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Tree
+ *
+ *	Purpose:	Load a tree structure from the specified file.  The
+ *			count of the node is stored where the caller asks,
+ *			since it lives in the parent's count array.
+ */
+static void load_tree(FILE *file, NODEPOOL *pool, TREE *node, SYMBOL *count, int width)
+{
+	static int level = 0;
+	register int i;
+
+	Context;
+	if ( load_symbol(file, width, &(node->symbol)) &&
+	     fread(&(node->usage), sizeof(BYTE4), 1, file) &&
+	     load_symbol(file, width, count) &&
+	     load_symbol(file, width, &(node->branch)) ) {
+
+		if(node->branch==0) {
+			return;
+		}
+
+		node->tree = new_array(pool, array_class(node->branch));
+		if(node->tree == NULL) {
+			error("load_tree", "Unable to allocate subtree");
+			node->branch = 0;
+			return;
+		}
+		node->capacity = 1<<array_class(node->branch);
+
+		for(i=0; i<node->branch; ++i) {
+			node->tree[i] = new_node(pool);
+			++level;
+			load_tree(file, pool, node->tree[i], &COUNTS(node)[i], width);
+			SYMBOLS(node)[i] = node->tree[i]->symbol;
+			--level;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Model
+ *
+ *	Purpose:	Load a model into memory.
+ */
+static bool load_model(char *filename, MODEL *model)
+{
+	register int i, j;
+	SYMBOL size, count, *phrase;
+	BYTE4 phrases;
+	BYTE1 version, width;
+	FILE *file;
+	wchar_t cookie[16];
+
+	Context;
+	if(filename == NULL)
+		return FALSE;
+
+	file = fopen(filename, "rb");
+	if(file == NULL) {
+		warn("load_model", "Unable to open file `%s'", filename);
+		return FALSE;
+	}
+
+	if (!fread(cookie, sizeof(wchar_t), wcslen(_T(COOKIE)), file)) {
+		warn("load_model", "File `%s' is not a MegaHAL brain", filename);
+		goto fail;
+	}
+
+	/*
+	 *	Brains from before the format was versioned always hold
+	 *	16 bit symbols.
+	 */
+	if(wcsncmp(cookie, _T(OLD_COOKIE), wcslen(_T(OLD_COOKIE))) == 0) {
+		version = 0;
+		width = sizeof(BYTE2);
+	} else if(wcsncmp(cookie, _T(COOKIE), wcslen(_T(COOKIE))) != 0 ||
+	    !fread(&version, sizeof(BYTE1), 1, file) ||
+	    !fread(&width, sizeof(BYTE1), 1, file)) {
+		warn("load_model", "File `%s' is not a MegaHAL brain", filename);
+		goto fail;
+	}
+
+	if(version > BRAIN_VERSION) {
+		warn("load_model", "File `%s' is from a newer MegaHAL (format %d)", filename, version);
+		goto fail;
+	}
+	if((width != sizeof(BYTE2)) && (width != sizeof(BYTE4))) {
+		warn("load_model", "File `%s' has an unknown symbol width", filename);
+		goto fail;
+	}
+	if(width > sizeof(SYMBOL)) {
+		warn("load_model", "File `%s' needs a module built with MEGAHAL_WIDE_SYMBOLS", filename);
+		goto fail;
+	}
+
+	if(!fread(&(model->order), sizeof(BYTE1), 1, file)) {
+		warn("load_model", "File `%s' is not a MegaHAL brain", filename);
+		goto fail;
+	}
+
+	order = model->order;
+	if(version >= 2) {
+		if(load_mapped(file, model, width, version) == FALSE) {
+			warn("load_model", "File `%s' is damaged", filename);
+			goto fail;
+		}
+		fclose(file);
+		return TRUE;
+	}
+
+	load_tree(file, &model->pool, model->forward, &count, width);
+	load_tree(file, &model->pool, model->backward, &count, width);
+	load_dictionary(file, model->dictionary);
+
+	if ( !fread(&phrases, sizeof(BYTE4), 1, file) ) {
+		warn("load_model", "File `%s' is damaged", filename);
+		goto fail;
+	}
+	for(i=0; i<phrases; ++i) {
+		if ( !load_symbol(file, width, &size) ||
+		     (phrase = append_phrase(model, size)) == NULL ) {
+			error("load_model", "Unable to load phrase");
+			goto fail;
+		}
+		for(j=0; j<size; ++j) {
+			if (!load_symbol(file, width, &phrase[j+1])) {
+				break;
+			}
+		}
+		if(index_phrase(model, model->phrasecount-1) == FALSE) {
+			model->phrasecount--;
+			error("load_model", "Unable to index phrase");
+			goto fail;
+		}
+	}
+
+	fclose(file);
+	return TRUE;
+fail:
+	fclose(file);
+
+	return FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Mapped
+ *
+ *	Purpose:	Load a brain saved in format 2 or later from a mapping
+ *			of the file, which is dropped again once the model is
+ *			built.  If the file can't be mapped it is read into
+ *			memory instead.  The header has been read up to the
+ *			order, which leaves the width of a character and, since
+ *			format 3, the journal token.  A brain that turns out to
+ *			be damaged, down to a symbol that isn't in its
+ *			dictionary, leaves the model empty.
+ */
+static bool load_mapped(FILE *file, MODEL *model, int width, int version)
+{
+	MAPPING map;
+	struct stat st;
+	BYTE1 *header;
+	BYTE8 *token;
+	SYMBOL forward, backward;
+	bool mapped = TRUE, loaded = FALSE;
+
+	Context;
+	if(fstat(fileno(file), &st) != 0 || st.st_size < 8)
+		return FALSE;
+	map.size = st.st_size;
+	map.at = 0;
+	map.base = mmap(NULL, map.size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if(map.base == MAP_FAILED) {
+		mapped = FALSE;
+		map.base = (BYTE1 *)nmalloc(map.size);
+		if(map.base == NULL) {
+			error("load_mapped", "Unable to allocate brain");
+			return FALSE;
+		}
+		rewind(file);
+		if(fread(map.base, 1, map.size, file) != map.size)
+			goto done;
+	}
+
+	header = map_section(&map, sizeof(wchar_t)*wcslen(_T(COOKIE))+4);
+	if(header == NULL || header[sizeof(wchar_t)*wcslen(_T(COOKIE))+3] != sizeof(wchar_t))
+		goto done;
+	if(version >= 3) {
+		if((token = map_section(&map, sizeof(BYTE8))) == NULL)
+			goto done;
+		model->journal = *token;
+	}
+
+	// the trees come before the dictionary, so their highest symbols are checked once it is loaded
+	if(load_mapped_tree(&map, &model->pool, model->forward, width, model->order, &forward) &&
+	   load_mapped_tree(&map, &model->pool, model->backward, width, model->order, &backward) &&
+	   load_mapped_dictionary(&map, model->dictionary) &&
+	   forward < model->dictionary->size && backward < model->dictionary->size &&
+	   load_mapped_phrases(&map, model, width, version))
+		loaded = TRUE;
+
+done:
+	if(mapped)
+		munmap(map.base, map.size);
+	else
+		nfree(map.base);
+
+	if(loaded == FALSE) {
+		free_pool(&model->pool);
+		model->forward = new_node(&model->pool);
+		model->backward = new_node(&model->pool);
+		free_index(&model->index);
+		free_phrases(&model->phrases);
+		model->phrasecount = 0;
+		free_words(model->dictionary);
+		free_dictionary(model->dictionary);
+		initialize_dictionary(model->dictionary);
+		model->journal = 0;
+	}
+
+	return loaded;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Map_Section
+ *
+ *	Purpose:	Return the next length bytes of a mapped brain and move
+ *			on to where the following section starts, or NULL if the
+ *			file is too short to hold them.
+ */
+static void *map_section(MAPPING *map, size_t length)
+{
+	void *section;
+
+	if(length > map->size-map->at)
+		return NULL;
+	section = map->base+map->at;
+	map->at += length;
+	map->at = (map->at+7) & ~(size_t)7;
+	if(map->at > map->size)
+		map->at = map->size;
+
+	return section;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Mapped_Tree
+ *
+ *	Purpose:	Build a tree from its columns in a mapped brain.  The
+ *			columns are walked once to make sure every branch count
+ *			is matched by the nodes that follow it and that the
+ *			children of each node are in order of their symbols, as
+ *			find_symbol() needs them, then again to build the nodes,
+ *			keeping the path from the root to the node being built
+ *			rather than recursing.  No node is deeper than the order
+ *			plus one, and the order is a byte.  The highest symbol
+ *			in the tree is returned in highest.
+ */
+static bool load_mapped_tree(MAPPING *map, NODEPOOL *pool, TREE *root, int width, int order, SYMBOL *highest)
+{
+	BYTE4 *header, *usage;
+	void *symbols, *counts, *branches;
+	TREE *path[258], *node;
+	int left[258], next[258];
+	long long previous[258];
+	SYMBOL symbol;
+	register BYTE4 i, nodes;
+	register int depth, k;
+
+	Context;
+	if((header = map_section(map, 2*sizeof(BYTE4))) == NULL)
+		return FALSE;
+	nodes = header[0];
+	if(nodes == 0 ||
+	   (symbols = map_section(map, (size_t)nodes*width)) == NULL ||
+	   (usage = map_section(map, (size_t)nodes*sizeof(BYTE4))) == NULL ||
+	   (counts = map_section(map, (size_t)nodes*width)) == NULL ||
+	   (branches = map_section(map, (size_t)nodes*width)) == NULL)
+		return FALSE;
+
+	depth = 0;
+	left[0] = MAPPED_SYMBOL(branches, width, 0);
+	previous[0] = -1;
+	*highest = MAPPED_SYMBOL(symbols, width, 0);
+	for(i=1; i<nodes; ++i) {
+		while(depth >= 0 && left[depth] == 0)
+			--depth;
+		if(depth < 0)
+			return FALSE;
+		--left[depth];
+		symbol = MAPPED_SYMBOL(symbols, width, i);
+		if((long long)symbol <= previous[depth])
+			return FALSE;
+		previous[depth] = symbol;
+		if(symbol > *highest)
+			*highest = symbol;
+		if(MAPPED_SYMBOL(branches, width, i) != 0) {
+			if(++depth > order+1)
+				return FALSE;
+			left[depth] = MAPPED_SYMBOL(branches, width, i);
+			previous[depth] = -1;
+		}
+	}
+	for(; depth >= 0; --depth)
+		if(left[depth] != 0)
+			return FALSE;
+
+	root->symbol = MAPPED_SYMBOL(symbols, width, 0);
+	root->usage = usage[0];
+	root->branch = MAPPED_SYMBOL(branches, width, 0);
+	path[0] = root;
+	next[0] = 0;
+	depth = 0;
+	for(i=0; i<nodes; ++i) {
+		if(i == 0) {
+			node = root;
+		} else {
+			while(next[depth] == path[depth]->branch)
+				--depth;
+			node = new_node(pool);
+			if(node == NULL)
+				goto fail;
+			node->symbol = MAPPED_SYMBOL(symbols, width, i);
+			node->usage = usage[i];
+			node->branch = MAPPED_SYMBOL(branches, width, i);
+			k = next[depth]++;
+			path[depth]->tree[k] = node;
+			SYMBOLS(path[depth])[k] = node->symbol;
+			COUNTS(path[depth])[k] = MAPPED_SYMBOL(counts, width, i);
+			path[++depth] = node;
+			next[depth] = 0;
+		}
+		if(node->branch == 0) {
+			if(i != 0)
+				--depth;
+			continue;
+		}
+		node->tree = new_array(pool, array_class(node->branch));
+		if(node->tree == NULL) {
+			node->branch = 0;
+			goto fail;
+		}
+		node->capacity = 1<<array_class(node->branch);
+	}
+
+	return TRUE;
+fail:
+	/*
+	 *	Cut the tree off where it stops, so that it can still be freed.
+	 */
+	error("load_mapped_tree", "Unable to allocate node");
+	for(; depth >= 0; --depth)
+		path[depth]->branch = next[depth];
+	return FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Mapped_Dictionary
+ *
+ *	Purpose:	Add the words of a mapped brain to a dictionary, in the
+ *			order they were saved in so that they keep their symbols.
+ */
+static bool load_mapped_dictionary(MAPPING *map, DICTIONARY *dictionary)
+{
+	BYTE4 *header, *start;
+	wchar_t *text;
+	STRING word;
+	register BYTE4 i;
+
+	Context;
+	if((header = map_section(map, 2*sizeof(BYTE4))) == NULL ||
+	   (start = map_section(map, ((size_t)header[0]+1)*sizeof(BYTE4))) == NULL ||
+	   (text = map_section(map, (size_t)header[1]*sizeof(wchar_t))) == NULL)
+		return FALSE;
+
+	for(i=0; i<header[0]; ++i) {
+		if(start[i+1] < start[i] || start[i+1] > header[1] || start[i+1]-start[i] > 255)
+			return FALSE;
+		word.length = start[i+1]-start[i];
+		word.word = text+start[i];
+		if(add_word(dictionary, word) != i)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Load_Mapped_Phrases
+ *
+ *	Purpose:	Copy the phrases of a mapped brain into the phrase store
+ *			of the model, with their lengths in front of them.  The
+ *			dictionary has been loaded already, and a phrase with a
+ *			symbol that isn't in it makes the brain damaged.
+ */
+static bool load_mapped_phrases(MAPPING *map, MODEL *model, int width, int version)
+{
+	BYTE4 *header, *start, *count, *copy = NULL, phrases, kind;
+	SYMBOL **loaded = NULL, *phrase;
+	void *symbols;
+	bool done = FALSE;
+	register BYTE4 i, j, size;
+
+	Context;
+	if((header = map_section(map, 2*sizeof(BYTE4))) == NULL ||
+	   (start = map_section(map, ((size_t)header[0]+1)*sizeof(BYTE4))) == NULL ||
+	   (symbols = map_section(map, (size_t)header[1]*width)) == NULL)
+		return FALSE;
+	// since format 4 the block only has each phrase once, and a column says which each copy is
+	phrases = header[0];
+	if(version >= 4 &&
+	   ((count = map_section(map, sizeof(BYTE4))) == NULL ||
+	    (copy = map_section(map, (size_t)*count*sizeof(BYTE4))) == NULL))
+		return FALSE;
+	if(version >= 4 && *count > 0)
+		phrases = *count;
+	else
+		copy = NULL;
+
+	if(phrases == 0)
+		return TRUE;
+	/*
+	 *	Before format 4 there is no telling which phrases are the same
+	 *	beforehand, so they go in chunks of the usual size as they turn
+	 *	out to be new; since then they all go into one chunk, which is
+	 *	the size of the block plus their lengths.
+	 */
+	if(reserve_phrases(model, phrases, version >= 4 ? (size_t)header[1]+header[0] : 0) == FALSE)
+		return FALSE;
+	if(copy != NULL) {
+		loaded = (SYMBOL **)nmalloc(sizeof(SYMBOL *)*(header[0]+1));
+		if(loaded == NULL) {
+			error("load_mapped_phrases", "Unable to allocate phrases");
+			return FALSE;
+		}
+		memset(loaded, 0, sizeof(SYMBOL *)*(header[0]+1));
+	}
+	for(i=0; i<phrases; ++i) {
+		kind = copy != NULL ? copy[i] : i;
+		if(kind >= header[0])
+			goto fail;
+		if(loaded != NULL && loaded[kind] != NULL) {
+			if(repeat_phrase(model, loaded[kind]) == NULL ||
+			   index_phrase(model, model->phrasecount-1) == FALSE)
+				goto fail;
+			continue;
+		}
+		size = start[kind+1]-start[kind];
+		if(start[kind+1] < start[kind] || start[kind+1] > header[1] || size > SYMBOL_MAX ||
+		   (phrase = append_phrase(model, size)) == NULL)
+			goto fail;
+		for(j=0; j<size; ++j)
+			if((phrase[j+1] = MAPPED_SYMBOL(symbols, width, start[kind]+j)) >= model->dictionary->size)
+				break;
+		if(j < size) {
+			// the copy was never committed, so it is simply given up
+			model->phrasecount--;
+			goto fail;
+		}
+		if(index_phrase(model, model->phrasecount-1) == FALSE)
+			goto fail;
+		if(loaded != NULL)
+			loaded[kind] = PHRASE(model, model->phrasecount-1);
+	}
+	done = TRUE;
+
+fail:
+	if(loaded != NULL)
+		nfree(loaded);
+	return done;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Journal_Name
+ *
+ *	Purpose:	Make the file name of the journal with the given token.
+ *			Token 0 is the journal of a brain just trained from
+ *			megahal.trn, which has never been saved.
+ */
+static void journal_name(char *filename, size_t size, BYTE8 token)
+{
+	snprintf(filename, size, "%s%smegahal-%016llx.jnl", directory_cache, SEP, (unsigned long long)token);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Create_Journal
+ *
+ *	Purpose:	Start the journal with the given token afresh, throwing
+ *			away anything a file of that name held before.
+ */
+static FILE *create_journal(BYTE8 token)
+{
+	JOURNALHEADER header;
+	FILE *file;
+	char filename[PATH_SIZE];
+
+	Context;
+	journal_name(filename, sizeof(filename), token);
+	file = fopen(filename, "w+b");
+	if(file == NULL) {
+		warn("create_journal", "Unable to open file `%s'", filename);
+		return NULL;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.cookie, JOURNAL_COOKIE, sizeof(header.cookie));
+	header.version = JOURNAL_VERSION;
+	header.charwidth = sizeof(wchar_t);
+	header.token = token;
+	if(fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0) {
+		warn("create_journal", "Unable to write file `%s'", filename);
+		fclose(file);
+		unlink(filename);
+		return NULL;
+	}
+
+	return file;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Write_Journal
+ *
+ *	Purpose:	Append a record to the live journal and hand it to the
+ *			system, so that it outlives the process.  sync_journal()
+ *			takes it the rest of the way to the disk.  If the journal
+ *			can't be written, journaling stops until the next save.
+ */
+static void write_journal(BYTE1 type, const void *data, BYTE4 length)
+{
+	Context;
+	if(journal == NULL)
+		return;
+	if(fputc(type, journal) == EOF ||
+	   fwrite(&length, sizeof(BYTE4), 1, journal) != 1 ||
+	   (length > 0 && fwrite(data, length, 1, journal) != 1) ||
+	   fflush(journal) != 0) {
+		warn("write_journal", "Unable to write the journal, nothing more is kept until the brain is saved");
+		fclose(journal);
+		journal = NULL;
+		return;
+	}
+	journaldirty = TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Journal_Words
+ *
+ *	Purpose:	Record a phrase just added to the model, as the number of
+ *			words followed by each word's length and characters.
+ *			Words rather than symbols are kept, since learning is
+ *			what gives the words their symbols.
+ */
+static void journal_words(DICTIONARY *words)
+{
+	register int i;
+	BYTE1 *record, *at;
+	BYTE4 length;
+
+	Context;
+	if(journal == NULL)
+		return;
+	length = sizeof(BYTE4);
+	for(i=0; i<words->size; ++i)
+		length += 1+words->entry[i].length*sizeof(wchar_t);
+	record = (BYTE1 *)nmalloc(length);
+	if(record == NULL) {
+		error("journal_words", "Unable to allocate record");
+		return;
+	}
+	memcpy(record, &words->size, sizeof(BYTE4));
+	at = record+sizeof(BYTE4);
+	for(i=0; i<words->size; ++i) {
+		*at++ = words->entry[i].length;
+		memcpy(at, words->entry[i].word, words->entry[i].length*sizeof(wchar_t));
+		at += words->entry[i].length*sizeof(wchar_t);
+	}
+	write_journal(JOURNAL_LEARN, record, length);
+	nfree(record);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Replay_Record
+ *
+ *	Purpose:	Apply one record of a journal to the global model, the
+ *			same way it was applied when it was written.  Returns
+ *			FALSE for a record that can't have come from a journal
+ *			of this model.
+ */
+static bool replay_record(BYTE1 type, BYTE1 *data, BYTE4 length, BYTE8 *next)
+{
+	DICTIONARY *learnt;
+	BYTE4 count, phrase;
+	register BYTE4 i;
+	BYTE1 *at, *end = data+length;
+	bool valid = TRUE;
+
+	Context;
+	switch(type) {
+	case JOURNAL_LEARN:
+		if(length < sizeof(BYTE4))
+			return FALSE;
+		memcpy(&count, data, sizeof(BYTE4));
+		// every word takes at least its length byte
+		if(count == 0 || count > length-sizeof(BYTE4) || (learnt = new_dictionary()) == NULL)
+			return FALSE;
+		learnt->size = count;
+		if(realloc_dictionary(learnt) == NULL) {
+			learnt->size = 0;
+			free_dictionary(learnt);
+			nfree(learnt);
+			return FALSE;
+		}
+		at = data+sizeof(BYTE4);
+		for(i=0; i<count; ++i) {
+			if(at >= end || (size_t)(end-at-1) < (*at)*sizeof(wchar_t)) {
+				learnt->size = i;
+				valid = FALSE;
+				break;
+			}
+			learnt->entry[i].length = *at++;
+			learnt->entry[i].word = (wchar_t *)nmalloc(sizeof(wchar_t)*(learnt->entry[i].length+1));
+			if(learnt->entry[i].word == NULL) {
+				learnt->size = i;
+				valid = FALSE;
+				break;
+			}
+			memcpy(learnt->entry[i].word, at, learnt->entry[i].length*sizeof(wchar_t));
+			at += learnt->entry[i].length*sizeof(wchar_t);
+			fold_word(&learnt->entry[i]);
+		}
+		if(valid && at == end)
+			learn(model, learnt);
+		else
+			valid = FALSE;
+		free_words(learnt);
+		free_dictionary(learnt);
+		nfree(learnt);
+		return valid;
+	case JOURNAL_FORGET:
+		if(length != sizeof(BYTE4))
+			return FALSE;
+		memcpy(&phrase, data, sizeof(BYTE4));
+		if(phrase >= model->phrasecount)
+			return FALSE;
+		del_phrase(phrase);
+		return TRUE;
+	case JOURNAL_OLDEST:
+		if(length != sizeof(BYTE4))
+			return FALSE;
+		memcpy(&count, data, sizeof(BYTE4));
+		if(count > model->phrasecount)
+			return FALSE;
+		del_oldest_phrases(count, 0);
+		return TRUE;
+	case JOURNAL_TRIM:
+		if(length != 0)
+			return FALSE;
+		trimdictionary();
+		return TRUE;
+	case JOURNAL_NEXT:
+		if(length != sizeof(BYTE8))
+			return FALSE;
+		memcpy(next, data, sizeof(BYTE8));
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Replay_Journals
+ *
+ *	Purpose:	Bring the global model, just loaded from the brain or
+ *			trained, up to date with what was learnt and forgotten
+ *			after that brain was saved.  This starts at the journal
+ *			the brain names and follows each journal on to the one
+ *			it was continued in.  The last one becomes the live
+ *			journal, cut back to its last whole record in case the
+ *			bot died while writing it.
+ */
+static void replay_journals(void)
+{
+	JOURNALHEADER header;
+	BYTE8 token, next;
+	BYTE1 type, *data = NULL;
+	BYTE4 length, size = 0;
+	off_t good;
+	FILE *file;
+	char filename[PATH_SIZE];
+	int records = 0;
+
+	Context;
+	token = journalbase = model->journal;
+	while(TRUE) {
+		journal_name(filename, sizeof(filename), token);
+		file = fopen(filename, "r+b");
+		if(file == NULL)
+			break;
+		if(fread(&header, sizeof(header), 1, file) != 1 ||
+		   memcmp(header.cookie, JOURNAL_COOKIE, sizeof(header.cookie)) != 0 ||
+		   header.version != JOURNAL_VERSION || header.charwidth != sizeof(wchar_t) ||
+		   header.token != token) {
+			warn("replay_journals", "Journal `%s' is damaged, starting it again", filename);
+			fclose(file);
+			break;
+		}
+
+		next = token;
+		good = sizeof(header);
+		while(fread(&type, sizeof(BYTE1), 1, file) == 1 &&
+		      fread(&length, sizeof(BYTE4), 1, file) == 1) {
+			if(length > size) {
+				BYTE1 *grown = (BYTE1 *)nrealloc(data, length);
+				if(grown == NULL)
+					break;
+				data = grown;
+				size = length;
+			}
+			if((length > 0 && fread(data, length, 1, file) != 1) ||
+			   replay_record(type, data, length, &next) == FALSE)
+				break;
+			good = ftello(file);
+			++records;
+		}
+
+		if(next == token) {
+			// the last journal is the live one: append after its last whole record
+			if(ftruncate(fileno(file), good) != 0 || fseeko(file, good, SEEK_SET) != 0) {
+				warn("replay_journals", "Unable to repair journal `%s'", filename);
+				fclose(file);
+				file = NULL;
+			}
+			journal = file;
+			model->journal = token;
+			break;
+		}
+		fclose(file);
+		token = next;
+	}
+
+	if(data != NULL)
+		nfree(data);
+	if(records > 0)
+		putlog(LOG_MISC, "*", "Replayed %d changes from the journal", records);
+	if(journal == NULL) {
+		journal = create_journal(token);
+		model->journal = token;
+	}
+	journaldirty = FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Rotate_Journal
+ *
+ *	Purpose:	Start a new journal for the global model, to be named
+ *			in the brain about to be saved.  The old one ends with
+ *			a record pointing at the new one, so that if the save
+ *			never makes it to the disk both are replayed.
+ */
+static void rotate_journal(void)
+{
+	static BYTE8 counter = 0;
+	BYTE8 token;
+
+	Context;
+	// splitmix64 over the time, the process and a counter, so that tokens never repeat in practice
+	do {
+		token = (BYTE8)usec_now() ^ ((BYTE8)getpid()<<40) ^ (++counter*0x9E3779B97F4A7C15ULL);
+		token = (token^(token>>30))*0xBF58476D1CE4E5B9ULL;
+		token = (token^(token>>27))*0x94D049BB133111EBULL;
+		token ^= token>>31;
+	} while(token == 0 || token == model->journal);
+
+	if(journal != NULL) {
+		write_journal(JOURNAL_NEXT, &token, sizeof(BYTE8));
+		close_journal();
+	}
+	journal = create_journal(token);
+	journaldirty = FALSE;
+	model->journal = token;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Prune_Journals
+ *
+ *	Purpose:	Delete the journals that a brain saved with the given
+ *			token has folded in, following them on from the one the
+ *			previous brain on disk named.
+ */
+static void prune_journals(BYTE8 saved)
+{
+	JOURNALHEADER header;
+	BYTE8 token, next;
+	BYTE1 type;
+	BYTE4 length;
+	FILE *file;
+	char filename[PATH_SIZE];
+
+	Context;
+	token = journalbase;
+	while(token != saved) {
+		journal_name(filename, sizeof(filename), token);
+		file = fopen(filename, "rb");
+		if(file == NULL)
+			break;
+		next = token;
+		if(fread(&header, sizeof(header), 1, file) == 1) {
+			while(fread(&type, sizeof(BYTE1), 1, file) == 1 &&
+			      fread(&length, sizeof(BYTE4), 1, file) == 1) {
+				if(type == JOURNAL_NEXT && length == sizeof(BYTE8)) {
+					if(fread(&next, sizeof(BYTE8), 1, file) != 1)
+						next = token;
+					break;
+				}
+				if(fseeko(file, length, SEEK_CUR) != 0)
+					break;
+			}
+		}
+		fclose(file);
+		unlink(filename);
+		if(next == token)
+			break;
+		token = next;
+	}
+	journalbase = saved;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Sync_Journal
+ *
+ *	Purpose:	Make sure the records written since the last call are
+ *			on the disk.
+ */
+static void sync_journal(void)
+{
+	if(journal == NULL || !journaldirty)
+		return;
+	if(fflush(journal) != 0 || fsync(fileno(journal)) != 0)
+		warn("sync_journal", "Unable to sync the journal");
+	journaldirty = FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Close_Journal
+ *
+ *	Purpose:	Stop journaling, for good or until the next save, with
+ *			everything written so far on the disk.
+ */
+static void close_journal(void)
+{
+	if(journal == NULL)
+		return;
+	sync_journal();
+	fclose(journal);
+	journal = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Save_Brain
+ *
+ *	Purpose:	Fold the journal into a new megahal.brn: the journal is
+ *			rotated first, and the ones the brain takes in are only
+ *			deleted once it is safely saved.
+ */
+static bool save_brain(void)
+{
+	Context;
+	rotate_journal();
+	if(save_model("megahal.brn", model) == FALSE)
+		return FALSE;
+	prune_journals(model->journal);
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Make_Words
+ *
+ *	Purpose:	Break a string into an array of words.
+ */
+static void make_words(wchar_t *pinput, DICTIONARY *words)
+{
+	size_t offset = 0, tmp = 0;
+	register int i;
+	wchar_t iinput[512] = L"";
+	wchar_t *input = iinput;
+
+	Context;
+	/*
+	 *	Clear the entries in the dictionary
+	 */
+	free_words(words);
+	free_dictionary(words);
+	wcsncpy(iinput, pinput, 511);
+	iinput[511] = L'\0';
+	strip_codes(input);
+	/*
+	 *	If the string is empty then do nothing, for it contains no words.
+	 */
+	if(wcslen(input) == 0)
+		return;
+	/*
+	 *	Loop forever.
+	 */
+	while(1) {
+
+		/*
+		 *	If the current character is of the same type as the previous
+		 *	character, then include it in the word.  Otherwise, terminate
+		 *	the current word.
+		 */
+		while(input[0] == L' ')
+			input++;
+		if(!input[0])
+			break;
+		if((boundary(input, offset) || (input[offset] == L' '))) {
+
+			/*
+			 *	Add the word to the dictionary
+			 */
+			words->size += 1;
+			if(realloc_dictionary(words) == NULL) {
+				error("make_words", "Unable to reallocate dictionary");
+				return;
+			}
+			if((words->size>1) && ((input-1)[0] != L' '))
+				tmp = 1;
+			words->entry[words->size-1].length = offset+tmp;
+			words->entry[words->size-1].word = (wchar_t *)nmalloc(sizeof(wchar_t)*(offset+tmp));
+			if(tmp)
+				words->entry[words->size-1].word[0]=(wchar_t)31;
+			for(i=0; i<offset; i++)
+				words->entry[words->size-1].word[i+tmp]=input[i];
+			fold_word(&words->entry[words->size-1]);
+			if(offset == wcslen(input))
+				break;
+			input += offset;
+			offset = tmp = 0;
+		} else {
+			++offset;
+		}
+	}
+	/*
+	 *	If the last word isn't punctuation, then replace it with a
+	 *	full-stop character.
+	 */
+	if (words->size == 0) {
+		return;
+	}
+
+	if(iswalnum(words->entry[words->size-1].word[0]) || (words->entry[words->size-1].word[0]==(wchar_t)31 && iswalnum(words->entry[words->size-1].word[1])) ) {
+		words->size += 1;
+		if(realloc_dictionary(words) == NULL) {
+			error("make_words", "Unable to reallocate dictionary");
+			return;
+		}
+
+		words->entry[words->size-1].word = (wchar_t *)nmalloc(sizeof(wchar_t)*(2));
+		words->entry[words->size-1].length = 2;
+		words->entry[words->size-1].word[0] = (wchar_t)31;
+		words->entry[words->size-1].word[1] = L'.';
+		fold_word(&words->entry[words->size-1]);
+	} else if(wcschr(L"!.?", words->entry[words->size-1].word[words->entry[words->size-1].length-1]) == NULL) {
+		words->entry[words->size-1].word = (wchar_t *)nrealloc(words->entry[words->size-1].word, sizeof(wchar_t)*(2));
+		words->entry[words->size-1].length = 2;
+		words->entry[words->size-1].word[0] = (wchar_t)31;
+		words->entry[words->size-1].word[1] = L'.';
+		fold_word(&words->entry[words->size-1]);
+	}
+	return;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ *	Function:	Boundary
+ *
+ *	Purpose:	Return whether or not a word boundary exists in a string
+ *			at the specified location.
+ */
+static bool boundary(wchar_t *string, int position)
+{
+
+	Context;
+	if(position == 0)
+		return FALSE;
+
+	if(position == (int)wcslen(string))
+		return TRUE;
+
+	if(
+		((string[position] == L'\'')) &&
+		(iswalnum(string[position-1]) != 0) &&
+		(iswalnum(string[position+1]) != 0)
+	)
+		return FALSE;
+
+	if(
+		(position > 1) &&
+		((string[position-1] == L'\'')) &&
+		(iswalnum(string[position-2]) !=0) &&
+		(iswalnum(string[position]) != 0)
+	)
+		return FALSE;
+
+	if(
+		((string[position] == L'-')) &&
+		(iswalnum(string[position-1]) != 0) &&
+		(iswalnum(string[position+1]) != 0)
+	)
+		return FALSE;
+
+	if(
+		(position > 1) &&
+		((string[position-1] == L'-')) &&
+		(iswalnum(string[position-2]) != 0) &&
+		(iswalnum(string[position]) != 0)
+	)
+		return FALSE;
+
+	if(
+		(iswalnum(string[position]) != 0) &&
+		(iswalnum(string[position-1]) == 0)
+	)
+		return TRUE;
+
+	if(
+		(iswalnum(string[position]) == 0) &&
+		(iswalnum(string[position-1]) != 0)
+	)
+		return TRUE;
+
+/*	if(isdigit(string[position])!=isdigit(string[position-1]))
+		return(TRUE);
+*/
+	return FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ *	Function:	Generate_Reply
+ *
+ *	Purpose:	Take a string of user input and return a string of output
+ *			which may vaguely be construed as containing a reply to
+ *			whatever is in the input string.  Candidate replies are
+ *			generated for the given budget in microseconds, or until
+ *			replycandidates have been tried or one scores replyscore.
+ *			The output belongs to the reply context, and is good until
+ *			the context is used again.
+ */
+static wchar_t *generate_reply(MODEL *model, REPLYCONTEXT *ctx, DICTIONARY *words, int budget)
+{
+	static BITSET nokeys = {0, NULL};
+	DICTIONARY *replywords;
+	GENCONTEXT *best = NULL;
+	wchar_t *output;
+	long long basetime;
+	int threads = 1;
+	register int i;
+#ifdef MEGAHAL_THREADS
+	pthread_t helper[MAX_GENERATORS];
+	bool started[MAX_GENERATORS];
+	sigset_t all, old;
+#endif
+
+	Context;
+	/*
+	 *	Make sure some sort of reply exists
+	 */
+	output = set_message(ctx, L"I don't know enough to answer you yet!");
+#ifdef MEGAHAL_THREADS
+	threads = replythreads;
+	if(threads < 1)
+		threads = 1;
+	if(threads > MAX_GENERATORS)
+		threads = MAX_GENERATORS;
+#endif
+	if(make_generators(ctx, model, threads) == FALSE) {
+		error("generate_reply", "Unable to allocate generators");
+		return output;
+	}
+
+	/*
+	 *	Create an array of keywords from the words in the user's input
+	 */
+	make_keywords(model, ctx, words);
+
+	for(i=0; i<threads; ++i)
+		ctx->gen[i].trouble = NULL;
+	basetime = usec_now();
+	replywords = reply(model, &ctx->gen[0], ctx->dummy, &nokeys);
+	while(replywords != NULL && ((maxreplywords && replywords->size>maxreplywords) || dissimilar(words, replywords)==FALSE || isrepeating(replywords) || isinprevs(replywords)) && (usec_now()-basetime)<budget )
+		replywords = reply(model, &ctx->gen[0], ctx->dummy, &nokeys);
+	if(replywords != NULL)
+		output = make_output(ctx, replywords);
+	/*
+	 *	Loop for the specified budget, generating and evaluating
+	 *	replies, on as many threads as we have been asked to use
+	 */
+	ctx->model = model;
+	ctx->words = words;
+	ctx->basetime = usec_now();
+	ctx->budget = budget;
+	ctx->candidates = (replycandidates > 0) ? (replycandidates+threads-1)/threads : 0;
+	atomic_store(&ctx->done, FALSE);
+#ifdef MEGAHAL_THREADS
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for(i=1; i<threads; ++i)
+		started[i] = (pthread_create(&helper[i], NULL, search_replies, &ctx->gen[i]) == 0);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+	search_replies(&ctx->gen[0]);
+#ifdef MEGAHAL_THREADS
+	for(i=1; i<threads; ++i) {
+		if(started[i])
+			pthread_join(helper[i], NULL);
+		else
+			ctx->gen[i].max_surprise = (float)-1.0;
+	}
+#endif
+
+	/*
+	 *	Only now, on the calling thread, say what went wrong in the
+	 *	generators, then return the best answer we generated
+	 */
+	for(i=0; i<threads; ++i)
+		if(ctx->gen[i].trouble != NULL)
+			putlog(LOG_MISC, "*", "%s", ctx->gen[i].trouble);
+	for(i=0; i<threads; ++i)
+		if(ctx->gen[i].max_surprise > (float)-1.0 && (best == NULL || ctx->gen[i].max_surprise > best->max_surprise))
+			best = &ctx->gen[i];
+	if(best != NULL)
+		output = make_output(ctx, best->best);
+	updateprevs(output);
+
+	return output;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ *	Function:	Search_Replies
+ *
+ *	Purpose:	Generate and evaluate candidate replies with one
+ *			generator until the search runs out of time or
+ *			candidates, keeping the most surprising one.  This is
+ *			the body of each thread of a parallel search.
+ */
+static void *search_replies(void *arg)
+{
+	GENCONTEXT *gen = (GENCONTEXT *)arg;
+	REPLYCONTEXT *ctx = gen->owner;
+	DICTIONARY *replywords;
+	float surprise;
+	int candidates = 0;
+
+	Context;
+	gen->max_surprise = (float)-1.0;
+	do {
+		replywords = reply(ctx->model, gen, ctx->keys, &ctx->keyset);
+		if(replywords == NULL)
+			break;
+		++candidates;
+		if ((maxreplywords && replywords->size>maxreplywords) || dissimilar(ctx->words, replywords)==FALSE ||
+		    isrepeating(replywords) || isinprevs(replywords))
+			continue;
+		surprise = evaluate_reply(ctx->model, gen, &ctx->keyset, replywords);
+		if(surprise > gen->max_surprise) {
+			gen->max_surprise = surprise;
+			// keep the reply by swapping buffers, reply() will refill the other one
+			gen->replies = gen->best;
+			gen->best = replywords;
+			if(replyscore > 0 && surprise >= replyscore) {
+				atomic_store(&ctx->done, TRUE);
+				break;
+			}
+		}
+	} while(!atomic_load(&ctx->done) && (usec_now()-ctx->basetime) < ctx->budget &&
+		(ctx->candidates <= 0 || candidates < ctx->candidates));
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ *	Function:	New_ReplyContext
+ *
+ *	Purpose:	Allocate a reply context with no generators yet.
+ */
+static REPLYCONTEXT *new_replycontext(void)
+{
+	REPLYCONTEXT *ctx;
+
+	Context;
+	ctx = (REPLYCONTEXT *)nmalloc(sizeof(REPLYCONTEXT));
+	if(ctx == NULL) {
+		error("new_replycontext", "Unable to allocate reply context");
+		return NULL;
+	}
+	ctx->keys = new_dictionary();
+	ctx->dummy = new_dictionary();
+	ctx->keyset.size = ctx->auxset.size = ctx->banset.size = 0;
+	ctx->keyset.bits = ctx->auxset.bits = ctx->banset.bits = NULL;
+	ctx->output = NULL;
+	ctx->message[0] = L'\0';
+	ctx->model = NULL;
+	ctx->words = NULL;
+	atomic_init(&ctx->done, FALSE);
+	ctx->size = 0;
+	ctx->gen = NULL;
+
+	return ctx;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ *	Function:	Make_Generators
+ *
+ *	Purpose:	Make sure the reply context has at least count
+ *			generators, each with a context array large enough for
+ *			the model.  Every generator has its own random number
+ *			state, so threads never share one.
+ */
+static bool make_generators(REPLYCONTEXT *ctx, MODEL *model, int count)
+{
+	GENCONTEXT *gen;
+	TREE **halcontext;
+	long base;
+	register int i;
+
+	Context;
+	if(count > ctx->size) {
+		// a replyseed makes the replies repeatable, otherwise the clock seeds them
+		base = replyseed ? replyseed : (long)time(NULL);
+		if(ctx->gen == NULL)
+			gen = (GENCONTEXT *)nmalloc(sizeof(GENCONTEXT)*count);
+		else
+			gen = (GENCONTEXT *)nrealloc(ctx->gen, sizeof(GENCONTEXT)*count);
+		if(gen == NULL)
+			return FALSE;
+		ctx->gen = gen;
+		for(i=ctx->size; i<count; ++i) {
+			gen = &ctx->gen[i];
+			gen->halcontext = NULL;
+			gen->order = 0;
+			// the same state srand48() would give, with a different seed for each generator
+			gen->seed[0] = 0x330E;
+			gen->seed[1] = (unsigned short)(base+i);
+			gen->seed[2] = (unsigned short)((base+i)>>16);
+			gen->replies = new_dictionary();
+			gen->best = new_dictionary();
+			gen->usedset.size = 0;
+			gen->usedset.bits = NULL;
+			gen->used_key = FALSE;
+			gen->owner = ctx;
+			gen->max_surprise = (float)-1.0;
+			if(gen->replies == NULL || gen->best == NULL)
+				return FALSE;
+			++ctx->size;
+		}
+	}
+
+	for(i=0; i<count; ++i) {
+		gen = &ctx->gen[i];
+		if(gen->halcontext != NULL && gen->order >= model->order)
+			continue;
+		if(gen->halcontext == NULL)
+			halcontext = (TREE **)nmalloc(sizeof(TREE *)*(model->order+2));
+		else
+			halcontext = (TREE **)nrealloc(gen->halcontext, sizeof(TREE *)*(model->order+2));
+		if(halcontext == NULL)
+			return FALSE;
+		gen->halcontext = halcontext;
+		gen->order = model->order;
+	}
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void free_replycontext(REPLYCONTEXT *ctx)
+{
+	register int i;
+
+	Context;
+	if(ctx == NULL)
+		return;
+	for(i=0; i<ctx->size; ++i) {
+		if(ctx->gen[i].halcontext != NULL)
+			nfree(ctx->gen[i].halcontext);
+		free_dictionary(ctx->gen[i].replies);
+		nfree(ctx->gen[i].replies);
+		free_dictionary(ctx->gen[i].best);
+		nfree(ctx->gen[i].best);
+		free_bitset(&ctx->gen[i].usedset);
+	}
+	if(ctx->gen != NULL)
+		nfree(ctx->gen);
+	free_words(ctx->keys);
+	free_dictionary(ctx->keys);
+	nfree(ctx->keys);
+	free_dictionary(ctx->dummy);
+	nfree(ctx->dummy);
+	free_bitset(&ctx->keyset);
+	free_bitset(&ctx->auxset);
+	free_bitset(&ctx->banset);
+	if(ctx->output != NULL)
+		nfree(ctx->output);
+	nfree(ctx);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// puts one of the canned replies in the context's message buffer
+static wchar_t *set_message(REPLYCONTEXT *ctx, const wchar_t *message)
+{
+	wcsncpy(ctx->message, message, 63);
+	ctx->message[63] = L'\0';
+	return ctx->message;
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*
+ *	Function:	Usec_Now
+ *
+ *	Purpose:	Return the time in microseconds on a clock which is not
+ *			affected by changes to the system time, for timing the
+ *			reply search.
+ */
+static long long usec_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec*1000000+now.tv_nsec/1000;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Dissimilar
+ *
+ *	Purpose:	Return TRUE or FALSE depending on whether the dictionaries
+ *			are the same or not.
+ */
+static bool dissimilar(DICTIONARY *words1, DICTIONARY *words2)
+{
+	register int i;
+
+	Context;
+	if(words1->size != words2->size)
+		return TRUE;
+	for(i=0; i<words1->size; ++i)
+		if(wordcmp(words1->entry[i], words2->entry[i])!=0)
+			return TRUE;
+	return FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Make_Keywords
+ *
+ *	Purpose:	Put all the interesting words from the user's input into
+ *			a keywords dictionary, which will be used when generating
+ *			a reply.  The symbols of the keywords, and of the words in
+ *			the aux and ban lists, are also put into the keyset, auxset
+ *			and banset bitsets of the reply context, so that babble()
+ *			and friends can check a symbol without looking its word up.
+ */
+static DICTIONARY *make_keywords(MODEL *model, REPLYCONTEXT *ctx, DICTIONARY *words)
+{
+	DICTIONARY *keys = ctx->keys;
+	register int i;
+	register int j;
+	int c;
+
+	Context;
+	free_words(keys);
+	free_dictionary(keys);
+
+	/*
+	 *	The dictionary may have grown or been trimmed since the last
+	 *	time, so the aux and ban symbols are found again.
+	 */
+	make_symbolset(model, &ctx->auxset, aux);
+	make_symbolset(model, &ctx->banset, ban);
+
+	for(i=0; i<words->size; ++i) {
+		/*
+		 *		Find the symbol ID of the word.  If it doesn't exist in
+		 *		the model, or if it begins with a non-alphanumeric
+		 *		wchar_tacter, or if it is in the exclusion array, then
+		 *		skip over it.
+		 */
+		c = 0;
+		for(j=0; j<swp->size; ++j)
+			if(wordcmp(swp->from[j], words->entry[i]) == 0) {
+				add_key(model, ctx, swp->to[j]);
+				++c;
+			}
+		if(c == 0)
+			add_key(model, ctx, words->entry[i]);
+	}
+
+	if(keys->size>0)
+		for(i=0; i<words->size; ++i) {
+			c=0;
+			for(j=0; j<swp->size; ++j)
+				if(wordcmp(swp->from[j], words->entry[i]) == 0) {
+					add_aux(model, ctx, swp->to[j]);
+					++c;
+				}
+			if(c == 0)
+				add_aux(model, ctx, words->entry[i]);
+		}
+
+	make_symbolset(model, &ctx->keyset, keys);
+
+	return keys;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Make_Symbolset
+ *
+ *	Purpose:	Fill a bitset with the symbols of the words in the given
+ *			list which are in the model dictionary.
+ */
+static void make_symbolset(MODEL *model, BITSET *set, DICTIONARY *list)
+{
+	register int i;
+	int symbol;
+
+	Context;
+	if(resize_bitset(set, model->dictionary->size) == FALSE) {
+		error("make_symbolset", "Unable to allocate bitset");
+		return;
+	}
+	for(i=0; i<list->size; ++i) {
+		symbol = find_word(model->dictionary, list->entry[i]);
+		if(symbol != 0)
+			SET_BIT(set, symbol);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Resize_Bitset
+ *
+ *	Purpose:	Make a bitset hold the given number of symbols, and clear
+ *			all of them.
+ */
+static bool resize_bitset(BITSET *set, BYTE4 size)
+{
+	BYTE4 words = (size+31)/32, *bits;
+
+	if(words > (set->size+31)/32 || set->bits == NULL) {
+		bits = (BYTE4 *)nrealloc(set->bits, sizeof(BYTE4)*(words ? words : 1));
+		if(bits == NULL) {
+			set->size = 0;
+			return FALSE;
+		}
+		set->bits = bits;
+	}
+	memset(set->bits, 0, sizeof(BYTE4)*words);
+	set->size = size;
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void free_bitset(BITSET *set)
+{
+	Context;
+	if(set->bits != NULL)
+		nfree(set->bits);
+	set->bits = NULL;
+	set->size = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Add_Key
+ *
+ *	Purpose:	Add a word to the keyword dictionary.
+ */
+static void add_key(MODEL *model, REPLYCONTEXT *ctx, STRING word)
+{
+	int symbol;
+
+	Context;
+	symbol = find_word(model->dictionary, word);
+	if(symbol == 0)
+		return;
+	if((word.word[0]!=(wchar_t)31 && iswalnum(word.word[0])==0) || (word.word[0]==(wchar_t)31 && iswalnum(word.word[1])==0))
+		return;
+	if(TEST_BIT(&ctx->banset, symbol))
+		return;
+	if(TEST_BIT(&ctx->auxset, symbol))
+		return;
+
+	add_word(ctx->keys, word);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Add_Aux
+ *
+ *	Purpose:	Add an auxilliary keyword to the keyword dictionary.
+ */
+static void add_aux(MODEL *model, REPLYCONTEXT *ctx, STRING word)
+{
+	int symbol;
+
+	Context;
+	symbol = find_word(model->dictionary, word);
+	if(symbol == 0)
+		return;
+	if(iswalnum(word.word[0]) == 0)
+		return;
+	if(!TEST_BIT(&ctx->auxset, symbol))
+		return;
+
+	add_word(ctx->keys, word);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Reply
+ *
+ *	Purpose:	Generate a dictionary of reply words appropriate to the
+ *			given dictionary of keywords, using the context, random
+ *			numbers and reply buffer of the given generator.
+ */
+static DICTIONARY *reply(MODEL *model, GENCONTEXT *gen, DICTIONARY *keys, BITSET *keyset)
+{
+	DICTIONARY *replies = gen->replies;
+	register int i;
+	int symbol;
+	bool start = TRUE;
+	long long basetime;
+
+	Context;
+	free_dictionary(replies);
+	if(resize_bitset(&gen->usedset, model->dictionary->size) == FALSE) {
+		gen->trouble = "reply: Unable to allocate bitset";
+		return NULL;
+	}
+
+	/*
+	 *	Start off by making sure that the model's context is empty.
+	 */
+	initialize_context(model, gen->halcontext);
+	gen->halcontext[0] = model->forward;
+	gen->used_key = FALSE;
+
+	/*
+	 *	Generate the reply in the forward direction.
+	 */
+	/* This used to be while(TRUE) and while it should never get stuck in an infinite loop in theory, this was changed just in case to timeout cause it can grab ram like crazy until it sigterms */
+	basetime = usec_now();
+	while((usec_now()-basetime) < REPLY_GUARD) {
+		/*
+		 *	Get a random symbol from the current context.
+		 */
+		if(start == TRUE)
+			symbol = seed(model, gen, keys);
+		else
+			symbol = babble(model, gen, keyset);
+		if((symbol==0) || (symbol==1))
+			break;
+		start = FALSE;
+
+		/*
+		 *	Append the symbol to the reply dictionary.
+		 */
+		replies->size += 1;
+		if(realloc_dictionary(replies) == NULL) {
+			replies->size = 0;
+			gen->trouble = "reply: Unable to reallocate dictionary";
+			return NULL;
+		}
+
+		replies->entry[replies->size-1] = model->dictionary->entry[symbol];
+		SET_BIT(&gen->usedset, symbol);
+
+		/*
+		 *	Extend the current context of the model with the current symbol.
+		 */
+		update_context(model, gen->halcontext, symbol);
+	}
+	if((usec_now()-basetime) >= REPLY_GUARD)
+		gen->trouble = "TIMEOUT1!";
+
+
+	/*
+	 *	Start off by making sure that the model's context is empty.
+	 */
+	initialize_context(model, gen->halcontext);
+	gen->halcontext[0] = model->backward;
+
+	/*
+	 *	Re-create the context of the model from the current reply
+	 *	dictionary so that we can generate backwards to reach the
+	 *	beginning of the string.
+	 */
+	if(replies->size > 0)
+		for(i=MIN(replies->size-1, model->order); i>=0; --i) {
+			symbol = find_word(model->dictionary, replies->entry[i]);
+			update_context(model, gen->halcontext, symbol);
+		}
+
+	/*
+	 *	Generate the reply in the backward direction.
+	 */
+	basetime = usec_now();
+	while((usec_now()-basetime) < REPLY_GUARD) {
+		/*
+		 *	Get a random symbol from the current context.
+		 */
+		symbol = babble(model, gen, keyset);
+		if((symbol==0) || (symbol==1))
+			break;
+
+		/*
+		 *	Prepend the symbol to the reply dictionary.
+		 */
+		replies->size += 1;
+		if(realloc_dictionary(replies) == NULL) {
+			replies->size = 0;
+			gen->trouble = "reply: Unable to reallocate dictionary";
+			return NULL;
+		}
+
+		/*
+		 *	Shuffle everything up for the prepend.
+		 */
+		for(i=replies->size-1; i>0; --i)
+			replies->entry[i] = replies->entry[i-1];
+
+		replies->entry[0] = model->dictionary->entry[symbol];
+		SET_BIT(&gen->usedset, symbol);
+
+		/*
+		 *	Extend the current context of the model with the current symbol.
+		 */
+		update_context(model, gen->halcontext, symbol);
+	}
+	if((usec_now()-basetime) >= REPLY_GUARD)
+		gen->trouble = "TIMEOUT2!";
+
+	return replies;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Evaluate_Reply
+ *
+ *	Purpose:	Measure the average surprise of keywords relative to the
+ *			language model, using the context of the given generator.
+ */
+static float evaluate_reply(MODEL *model, GENCONTEXT *gen, BITSET *keyset, DICTIONARY *words)
+{
+	register int i;
+	register int j;
+	int symbol;
+	float probability;
+	int count;
+	float entropy = (float)0.0;
+	int position;
+	int num = 0;
+	bool fnd2;
+
+	Context;
+	if(words->size <= 0)
+		return (float)0.0;
+	initialize_context(model, gen->halcontext);
+	gen->halcontext[0] = model->forward;
+	for(i=0; i<words->size; ++i) {
+		symbol = find_word(model->dictionary, words->entry[i]);
+
+		// only calculate values for words in the reply that are also keywords in the original sentence
+		if(TEST_BIT(keyset, symbol)) {
+			probability = (float)0.0;
+			count = 0;
+			++num;
+			for(j=0; j<model->order; ++j)
+				if(gen->halcontext[j] != NULL) {
+					position = search_node(gen->halcontext[j], symbol, &fnd2);
+					if(!fnd2)
+						continue;
+					// the less that this word is used in this context, the higher the score
+					// this is because we are dividing the amount of times the word is used in this context by the usage counter of the parent context
+					if (surprise)
+						probability += (float)(COUNTS(gen->halcontext[j])[position])/(float)(gen->halcontext[j]->usage);
+					else
+						probability += (float)((float)1.0-((COUNTS(gen->halcontext[j])[position])/(float)(gen->halcontext[j]->usage)));
+					++count;
+				}
+
+			// log of <1 numbers are negative which is why we do -=
+			// this will weigh the result according to the size of the context i think
+			// in other words, the bigger the context, the higher the result value becomes
+			if(count > 0.0)
+				entropy -= (float)log(probability/(float)count);
+		}
+
+		update_context(model, gen->halcontext, symbol);
+	}
+
+	initialize_context(model, gen->halcontext);
+	gen->halcontext[0] = model->backward;
+	for(i=words->size-1; i>=0; --i) {
+		symbol = find_word(model->dictionary, words->entry[i]);
+
+		if(TEST_BIT(keyset, symbol)) {
+			probability = (float)0.0;
+			count = 0;
+			++num;
+			for(j=0; j<model->order; ++j)
+				if(gen->halcontext[j] != NULL) {
+					position = search_node(gen->halcontext[j], symbol, &fnd2);
+					if(!fnd2)
+						continue;
+					if (surprise)
+						probability += (float)(COUNTS(gen->halcontext[j])[position])/(float)(gen->halcontext[j]->usage);
+					else
+						probability += (float)((float)1.0-((COUNTS(gen->halcontext[j])[position])/(float)(gen->halcontext[j]->usage)));
+					++count;
+				}
+
+			if(count > 0.0)
+				entropy -= (float)log(probability/(float)count);
+		}
+
+		update_context(model, gen->halcontext, symbol);
+	}
+
+	// hmm this looks like it helps to average out all sentences including long sentences with many keywords so that they are all comparable?
+	if(num >= 8)
+		entropy /= (float)sqrt(num-1);
+	if(num >= 16)
+		entropy /= (float)num;
+
+	return entropy;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Make_Output
+ *
+ *	Purpose:	Generate a string from the dictionary of reply words.
+ */
+static wchar_t *make_output(REPLYCONTEXT *ctx, DICTIONARY *words)
+{
+	wchar_t *output;
+	register int i;
+	register int j;
+	int length, tmp = 0;
+
+	Context;
+	if(words->size == 0)
+		return set_message(ctx, L"I am utterly speechless!");
+
+	length = 1;
+	for(i=0; i<words->size; ++i)
+		length += (words->entry[i].length+1);
+
+	if(ctx->output == NULL)
+		output = (wchar_t *)nmalloc(sizeof(wchar_t)*length);
+	else
+		output = (wchar_t *)nrealloc(ctx->output, sizeof(wchar_t)*length);
+	if(output == NULL) {
+		error("make_output", "Unable to reallocate output.");
+		return set_message(ctx, L"I forgot what I was going to say!");
+	}
+	ctx->output = output;
+
+	length = 0;
+	for(i=0; i<words->size; ++i) {
+		if (words->entry[i].word[0] == (wchar_t)31)
+			tmp = 1;
+		else tmp = 0;
+		if (i>0 && (words->entry[i].word[0] != (wchar_t)31))
+			output[length++]=L' ';
+		for(j=0; j<words->entry[i].length-tmp; ++j)
+			output[length++]=words->entry[i].word[j+tmp];
+	}
+
+	output[length]=L'\0';
+
+	return output;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Babble
+ *
+ *	Purpose:	Return a random symbol from the current context, or a
+ *			zero symbol identifier if we've reached either the
+ *			start or end of the sentence.  Select the symbol based
+ *			on probabilities, favouring keywords.  In all cases,
+ *			use the longest available context to choose the symbol.
+ */
+static int babble(MODEL *model, GENCONTEXT *gen, BITSET *keyset)
+{
+	TREE *node = NULL;
+	register int i;
+	int count;
+	int symbol = 0;
+
+	Context;
+	/*
+	 *	Select the longest available context.
+	 */
+	for(i=0; i<=model->order; ++i)
+		if(gen->halcontext[i] != NULL)
+			node=gen->halcontext[i];
+
+	if(node->branch == 0)
+		return 0;
+
+	/*
+	 *	Choose a symbol at random from this context.
+	 */
+	i = rnd(gen, node->branch);
+	count = rnd(gen, node->usage);
+	while(count >= 0) {
+		/*
+		 *	If the symbol occurs as a keyword, then use it.  Only use an
+		 *	auxilliary keyword if a normal keyword has already been used.
+		 */
+		symbol = SYMBOLS(node)[i];
+
+		if(TEST_BIT(keyset, symbol) && ((gen->used_key==TRUE) || !TEST_BIT(&gen->owner->auxset, symbol)) && !TEST_BIT(&gen->usedset, symbol)) {
+			gen->used_key = TRUE;
+			break;
+		}
+		count -= COUNTS(node)[i];
+		i = (i >= (node->branch-1)) ? 0 : i+1;
+	}
+
+	return symbol;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Seed
+ *
+ *	Purpose:	Seed the reply by guaranteeing that it contains a
+ *			keyword, if one exists.
+ */
+static int seed(MODEL *model, GENCONTEXT *gen, DICTIONARY *keys)
+{
+	register int i;
+	int symbol;
+	int stop;
+	int key;
+
+	Context;
+	/*
+	 *	Fix, thanks to Mark Tarrabain
+	 */
+	if(gen->halcontext[0]->branch == 0)
+		symbol = 0;
+	else
+		symbol = SYMBOLS(gen->halcontext[0])[rnd(gen, gen->halcontext[0]->branch)];
+
+	if(keys->size>0) {
+		i = rnd(gen, keys->size);
+		stop = i;
+		while(TRUE) {
+			key = find_word(model->dictionary, keys->entry[i]);
+			if((key!=0) && !TEST_BIT(&gen->owner->auxset, key))
+				return key;
+			++i;
+			if(i == keys->size)
+				i=0;
+			if(i == stop)
+				return symbol;
+		}
+	}
+
+	return symbol;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	New_Swap
+ *
+ *	Purpose:	Allocate a new swap structure.
+ */
+static SWAP *new_swap(void)
+{
+	SWAP *list;
+
+	Context;
+	list = (SWAP *)nmalloc(sizeof(SWAP));
+	if(list == NULL) {
+		error("new_swap", "Unable to allocate swap");
+		return NULL;
+	}
+	list->size = 0;
+	list->from = NULL;
+	list->to = NULL;
+
+	return list;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Add_Swap
+ *
+ *	Purpose:	Add a new entry to the swap structure.
+ */
+static void add_swap(SWAP *list, wchar_t *s, wchar_t *d)
+{
+	Context;
+	list->size += 1;
+
+	if(list->from == NULL) {
+		list->from = (STRING *)nmalloc(sizeof(STRING));
+		if(list->from == NULL) {
+			error("add_swap", "Unable to allocate list->from");
+			return;
+		}
+	}
+
+	if(list->to == NULL) {
+		list->to = (STRING *)nmalloc(sizeof(STRING));
+		if(list->to == NULL) {
+			error("add_swap", "Unable to allocate list->to");
+			return;
+		}
+	}
+
+	list->from = (STRING *)nrealloc(list->from, sizeof(STRING)*(list->size));
+	if(list->from == NULL) {
+		error("add_swap", "Unable to reallocate from");
+		return;
+	}
+
+	list->to = (STRING *)realloc(list->to, sizeof(STRING)*(list->size));
+	if(list->to == NULL) {
+		error("add_swap", "Unable to reallocate to");
+		return;
+	}
+
+	list->from[list->size-1].length = wcslen(s);
+	list->from[list->size-1].word = mystrdup(s);
+	fold_word(&list->from[list->size-1]);
+	list->to[list->size-1].length = wcslen(d);
+	list->to[list->size-1].word = mystrdup(d);
+	fold_word(&list->to[list->size-1]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Initialize_Swap
+ *
+ *	Purpose:	Read a swap structure from a file.
+ */
+static SWAP *initialize_swap(char *filename)
+{
+	SWAP *list;
+	FILE *file = NULL;
+	char buffer[1024];
+	char *from;
+	char *to;
+
+	Context;
+	setlocale(LC_ALL, "");
+	list = new_swap();
+
+	if(filename == NULL)
+		return list;
+
+	file = fopen(filename, "r");
+	if(file == NULL)
+		return list;
+
+	while(!feof(file)) {
+		if(fgets(buffer, 1024, file)==NULL)
+			break;
+		if(buffer[0]=='#')
+			continue;
+		from = strtok(buffer, "\t ");
+		to = strtok(NULL, "\t \n#");
+		if (from && to) {
+			// add_swap() keeps copies of its own
+			wchar_t * wfrom = locale_to_wchar(from);
+			wchar_t * wto = locale_to_wchar(to);
+			if(wfrom != NULL && wto != NULL)
+				add_swap(list, wfrom , wto);
+			if(wfrom != NULL)
+				nfree(wfrom);
+			if(wto != NULL)
+				nfree(wto);
+		}
+	}
+
+	fclose(file);
+	return list;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void free_swap(SWAP *swap)
+{
+	register int i;
+
+	Context;
+	if(swap == NULL)
+		return;
+
+	for(i=0; i<swap->size; ++i) {
+		free_word(swap->from[i]);
+		free_word(swap->to[i]);
+	}
+	nfree(swap->from);
+	nfree(swap->to);
+	nfree(swap);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Initialize_List
+ *
+ *	Purpose:	Read a dictionary from a file.
+ */
+static DICTIONARY *initialize_list(char *filename)
+{
+	DICTIONARY *list;
+	FILE *file = NULL;
+	STRING word = {0,0,NULL};
+	char *string = NULL;
+	wchar_t *wstring = NULL;
+	char buffer[1024];
+
+	Context;
+	setlocale(LC_ALL, "");
+	list = new_dictionary();
+
+	if(filename == NULL)
+		return list;
+
+	file = fopen(filename, "r");
+	if(file == NULL)
+		return list;
+
+	while(!feof(file)) {
+
+		if(fgets(buffer, 1024, file) == NULL)
+			break;
+		if(buffer[0] == '#')
+			continue;
+		string = strtok(buffer, "\t \n#");
+		if((string!=NULL) && (strlen(string)>0)) {
+			wstring = locale_to_wchar(string);
+			word.word = locale_to_wchar(buffer);
+			// a line that isn't text in this locale is skipped
+			if(wstring != NULL && word.word != NULL) {
+				word.length = wcslen(wstring);
+				add_word(list, word);
+			}
+			if(word.word != NULL)
+				nfree(word.word);
+			if(wstring != NULL)
+				nfree(wstring);
+		}
+	}
+
+	fclose(file);
+	return list;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Function:	Rnd
+ *
+ *	Purpose:	Return a random integer between 0 and range-1, from the
+ *			random number state of the given generator.
+ */
+static int rnd(GENCONTEXT *gen, int range)
+{
+	Context;
+	return floor(erand48(gen->seed)*(double)(range));
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void load_personality(MODEL **model)
+{
+	FILE *file;
+	char filename[PATH_SIZE];
+	char filename_train[PATH_SIZE];
+	bool btrain = FALSE;
+
+	Context;
+	setlocale(LC_ALL, "");
+
+	/*
+	 *	Check to see if the brain exists
+	 */
+	snprintf(filename, sizeof(filename), "%s%smegahal.brn", directory_cache, SEP);
+	snprintf(filename_train, sizeof(filename_train), "%s%smegahal.trn", directory_resources, SEP);
+	file = fopen(filename, "r");
+	if(file == NULL) {
+		file = fopen(filename_train, "r");
+		btrain = TRUE;
+		if(file == NULL) {
+			error("load_personality", "Unable to allocate directory");
+		}
+	}
+
+	if(!file) {
+		error("load_personality", "Unable to find brain");
+		return;
+	}
+	fclose(file);
+	putlog(LOG_MISC, "*", "Changing to MegaHAL personality brains = \"%s\", train = \"%s\".\n", directory_cache, directory_resources);
+
+	/*
+	 *	Free the current personality
+	 */
+	close_journal();
+	free_model(*model);
+	free_words(ban);
+	free_dictionary(ban);
+	free_words(aux);
+	free_dictionary(aux);
+	free_swap(swp);
+
+	/*
+	 *	Create a language model
+	 */
+	*model = new_model(order);
+
+	/*
+	 *	Train the model on a text if one exists
+	 */
+	if(btrain || load_model(filename, *model) == FALSE) {
+		train(*model, filename_train);
+	}
+
+	/*
+	 *	Catch up on what was learnt after the brain was saved
+	 */
+	replay_journals();
+
+	/*
+	 *	Read a dictionary containing banned keywords, auxiliary keywords,
+	 *	greeting keywords and swap keywords
+	 */
+	snprintf(filename, sizeof(filename), "%s%smegahal.ban", directory_resources, SEP);
+	ban = initialize_list(filename);
+	snprintf(filename, sizeof(filename), "%s%smegahal.aux", directory_resources, SEP);
+	aux = initialize_list(filename);
+	snprintf(filename, sizeof(filename), "%s%smegahal.swp", directory_resources, SEP);
+	swp = initialize_swap(filename);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void change_personality(MODEL **model, const char * _directory_resources, const char * _directory_cache)
+{
+	if (_directory_resources) {
+		snprintf(directory_resources, sizeof(directory_resources), "%s", _directory_resources);
+	}
+
+	if (_directory_cache) {
+		snprintf(directory_cache, sizeof(directory_cache), "%s", _directory_cache);
+	} else if (_directory_resources) {
+		if(snprintf(directory_cache, sizeof(directory_cache), "%s%s%s", directory_resources, SEP, DIR_DEFAULT_CACHE) >= (int)sizeof(directory_cache))
+			warn("change_personality", "Directory `%s' is too long for its brains", directory_resources);
+	}
+
+	load_personality(model);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void free_words(DICTIONARY *words)
+{
+	register int i;
+
+	Context;
+	if(words == NULL)
+		return;
+
+	if(words->entry != NULL)
+		for(i=0; i<words->size; ++i)
+			free_word(words->entry[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void free_word(STRING word)
+{
+	Context;
+	nfree(word.word);
+}
@@ -0,0 +1,246 @@
+/*
+ *	halbench.c -- benchmarks the MegaHAL engine through libmegahal and
+ *	prints the results as JSON, so runs can be compared across versions.
+ *
+ *	Everything it feeds the engine comes from a seeded generator, so two
+ *	runs with the same seed do the same work: megahal.trn is learnt into
+ *	an empty brain, then a synthetic IRC corpus on top of it, replies are
+ *	timed at fixed candidate budgets, the brain is saved and loaded again,
+ *	and finally it is trimmed down in steps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <locale.h>
+#include <langinfo.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "libmegahal.h"
+
+#define VOCABULARY 20000
+#define NICKS 64
+#define COUNT(array) ((int)(sizeof(array)/sizeof((array)[0])))
+
+static unsigned long long state;
+static char *vocabulary[VOCABULARY];
+static char *nicks[NICKS];
+
+// xorshift64*, so the corpus doesn't depend on the libc
+static unsigned long long next(void)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+static double uniform(void)
+{
+	return (next() >> 11) * (1.0/9007199254740992.0);
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static char *make_name(int syllables)
+{
+	static const char *consonants = "bcdfghjklmnprstvwz";
+	static const char *vowels = "aeiou";
+	char *name = malloc(syllables*2+1);
+	int i;
+
+	for(i=0; i<syllables; ++i) {
+		name[i*2] = consonants[next()%strlen(consonants)];
+		name[i*2+1] = vowels[next()%strlen(vowels)];
+	}
+	name[syllables*2] = '\0';
+	return name;
+}
+
+// one line of chatter: words drawn with a heavy bias towards the common ones, sometimes addressed to someone
+static void make_line(char *line, size_t size)
+{
+	static const char *ends[] = {"", "", ".", "?", "!", " :)"};
+	int words = 1 + next()%14, i;
+	size_t len = 0;
+
+	line[0] = '\0';
+	if(next()%4 == 0)
+		len += snprintf(line+len, size-len, "%s: ", nicks[next()%NICKS]);
+	for(i=0; i<words && len<size; ++i)
+		len += snprintf(line+len, size-len, "%s%s%s", i ? " " : "", vocabulary[(int)(VOCABULARY*pow(uniform(), 3.0))], (i<words-1 && next()%10 == 0) ? "," : "");
+	if(len < size)
+		snprintf(line+len, size-len, "%s", ends[next()%6]);
+}
+
+static int count_lines(const char *filename)
+{
+	FILE *file;
+	int c, lines = 0;
+
+	if((file = fopen(filename, "r")) == NULL)
+		return 0;
+	while((c = fgetc(file)) != EOF)
+		if(c == '\n')
+			++lines;
+	fclose(file);
+	return lines;
+}
+
+static int compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int count, int p)
+{
+	int rank = (count*p + 99)/100;
+
+	return sorted[rank > 0 ? rank-1 : 0];
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-r resources] [-w dir] [-s seed] [-l lines] [-n replies] [-j threads]\n", name);
+	fprintf(stderr, "  -r dir     resources holding megahal.trn, default copy_to_eggdrop_wd/megahal.data/default\n");
+	fprintf(stderr, "  -w dir     scratch directory for the brain, default bench.tmp\n");
+	fprintf(stderr, "  -s seed    seed for the corpus and the replies, default 1\n");
+	fprintf(stderr, "  -l lines   lines of synthetic chatter to learn, default 50000 (counts stop at 65535 without MEGAHAL_WIDE_SYMBOLS, which trimming can't undo)\n");
+	fprintf(stderr, "  -n replies replies to time at each candidate budget, default 200\n");
+	fprintf(stderr, "  -j threads threads searching for replies, default 1\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const int budgets[] = {1, 10, 100, 1000};
+	static const int steps[] = {75, 50, 25, 10};
+	char *resources = "copy_to_eggdrop_wd/megahal.data/default", *work = "bench.tmp", *reply;
+	char filename[1024], line[512];
+	int seed = 1, lines = 50000, replies = 200, threads = 1, c, i, b, nodes, target;
+	double t, total, *times;
+	struct stat st;
+
+	// the training files are UTF-8, which the C locale can't read, and the engine takes its locale from the environment
+	setlocale(LC_ALL, "");
+	if(strcmp(nl_langinfo(CODESET), "UTF-8")) {
+		setenv("LC_ALL", "C.UTF-8", 1);
+		setlocale(LC_ALL, "");
+	}
+	while((c = getopt(argc, argv, "r:w:s:l:n:j:")) != -1) {
+		switch(c) {
+		case 'r': resources = optarg; break;
+		case 'w': work = optarg; break;
+		case 's': seed = atoi(optarg); break;
+		case 'l': lines = atoi(optarg); break;
+		case 'n': replies = atoi(optarg); break;
+		case 'j': threads = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind < argc || seed == 0 || replies < 1)
+		usage(argv[0]);
+
+	mkdir(work, 0755);
+	snprintf(filename, sizeof(filename), "%s/megahal.brn", work);
+	unlink(filename);
+	// and the journal of a run that never got as far as saving, which would be replayed on top of the training
+	snprintf(filename, sizeof(filename), "%s/megahal-0000000000000000.jnl", work);
+	unlink(filename);
+	state = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)seed;
+	for(i=0; i<VOCABULARY; ++i)
+		vocabulary[i] = make_name(1 + next()%4);
+	for(i=0; i<NICKS; ++i)
+		nicks[i] = make_name(2 + next()%3);
+	hal_option("logging", 0);
+	hal_option("replyseed", seed);
+	hal_option("replythreads", threads);
+	hal_option("trainthreads", threads);
+
+	printf("{\n  \"seed\": %d,\n  \"threads\": %d,\n", seed, threads);
+
+	// with no brain in the scratch directory, opening learns megahal.trn
+	t = seconds();
+	if(!hal_open(resources, work)) {
+		fprintf(stderr, "%s: unable to load %s/megahal.trn\n", argv[0], resources);
+		return 1;
+	}
+	t = seconds()-t;
+	snprintf(filename, sizeof(filename), "%s/megahal.trn", resources);
+	c = count_lines(filename);
+	printf("  \"learn_trn\": {\"lines\": %d, \"seconds\": %.6f, \"lines_per_second\": %.1f, \"nodes\": %d, \"words\": %d},\n", c, t, t > 0 ? c/t : 0.0, hal_nodes(), hal_words());
+
+	total = 0;
+	for(i=0; i<lines; ++i) {
+		make_line(line, sizeof(line));
+		t = seconds();
+		hal_learn(line);
+		total += seconds()-t;
+	}
+	printf("  \"learn_synthetic\": {\"lines\": %d, \"seconds\": %.6f, \"lines_per_second\": %.1f, \"nodes\": %d, \"words\": %d},\n", lines, total, total > 0 ? lines/total : 0.0, hal_nodes(), hal_words());
+
+	// the candidate budgets bound the search, the time budget is only there so nothing runs away
+	times = malloc(sizeof(double)*replies);
+	printf("  \"reply\": [\n");
+	for(b=0; b<COUNT(budgets); ++b) {
+		hal_option("replycandidates", budgets[b]);
+		total = 0;
+		for(i=0; i<replies; ++i) {
+			make_line(line, sizeof(line));
+			t = seconds();
+			reply = hal_reply(line, 0, 10000000);
+			times[i] = (seconds()-t)*1e6;
+			total += times[i];
+			free(reply);
+		}
+		qsort(times, replies, sizeof(double), compare);
+		printf("    {\"candidates\": %d, \"replies\": %d, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}%s\n", budgets[b], replies, total/replies, percentile(times, replies, 50), percentile(times, replies, 90), percentile(times, replies, 99), times[replies-1], b < COUNT(budgets)-1 ? "," : "");
+	}
+	printf("  ],\n");
+	free(times);
+
+	t = seconds();
+	hal_save();
+	t = seconds()-t;
+	snprintf(filename, sizeof(filename), "%s/megahal.brn", work);
+	printf("  \"save\": {\"seconds\": %.6f, \"bytes\": %lld},\n", t, stat(filename, &st) ? -1LL : (long long)st.st_size);
+
+	hal_close(0);
+	t = seconds();
+	if(!hal_open(resources, work)) {
+		fprintf(stderr, "%s: unable to load the saved brain\n", argv[0]);
+		return 1;
+	}
+	t = seconds()-t;
+	printf("  \"load\": {\"seconds\": %.6f, \"nodes\": %d, \"words\": %d},\n", t, hal_nodes(), hal_words());
+
+	nodes = hal_nodes();
+	printf("  \"trim\": [\n");
+	for(b=0; b<COUNT(steps); ++b) {
+		target = (int)((long long)nodes*steps[b]/100);
+		c = hal_nodes();
+		t = seconds();
+		hal_trim(target);
+		t = seconds()-t;
+		printf("    {\"percent\": %d, \"from_nodes\": %d, \"target\": %d, \"to_nodes\": %d, \"seconds\": %.6f}%s\n", steps[b], c, target, hal_nodes(), t, b < COUNT(steps)-1 ? "," : "");
+	}
+	printf("  ]\n}\n");
+
+	hal_close(0);
+	for(i=0; i<VOCABULARY; ++i)
+		free(vocabulary[i]);
+	for(i=0; i<NICKS; ++i)
+		free(nicks[i]);
+	return 0;
+}
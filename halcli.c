@@ -0,0 +1,78 @@
+/*
+ *	halcli.c -- talk to a MegaHAL brain from the shell through libmegahal.
+ *
+ *	Every line read from stdin is learned and answered on stdout, so a
+ *	brain can be trained, tried out or benchmarked without a bot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <unistd.h>
+#include "libmegahal.h"
+
+static void usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-r resources] [-c cache] [-u usec] [-j threads] [-f file] [-t nodes] [-n] [-q]\n", name);
+	fprintf(stderr, "  -r dir     resources (megahal.trn, .ban, .aux, .swp), default megahal.data/default\n");
+	fprintf(stderr, "  -c dir     where megahal.brn is kept, default brains\n");
+	fprintf(stderr, "  -u usec    time to spend on each reply, default 1000000\n");
+	fprintf(stderr, "  -j threads threads searching for replies and learning files, default 1\n");
+	fprintf(stderr, "  -f file    learn a file before reading stdin\n");
+	fprintf(stderr, "  -t nodes   trim the brain to this many nodes before reading stdin\n");
+	fprintf(stderr, "  -n         reply without learning\n");
+	fprintf(stderr, "  -q         keep the engine quiet\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *resources = NULL, *cache = NULL, *file = NULL, *reply;
+	char line[1024];
+	int budget = 1000000, trim = 0, learnit = 1, c;
+	size_t len;
+
+	setlocale(LC_ALL, "");
+	while((c = getopt(argc, argv, "r:c:u:j:f:t:nq")) != -1) {
+		switch(c) {
+		case 'r': resources = optarg; break;
+		case 'c': cache = optarg; break;
+		case 'u': budget = atoi(optarg); break;
+		case 'j':
+			hal_option("replythreads", atoi(optarg));
+			hal_option("trainthreads", atoi(optarg));
+			break;
+		case 'f': file = optarg; break;
+		case 't': trim = atoi(optarg); break;
+		case 'n': learnit = 0; break;
+		case 'q': hal_option("logging", 0); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind < argc)
+		usage(argv[0]);
+
+	if(!hal_open(resources, cache)) {
+		fprintf(stderr, "%s: unable to load a brain\n", argv[0]);
+		return 1;
+	}
+	if(file)
+		hal_train(file);
+	if(trim)
+		hal_trim(trim);
+
+	while(fgets(line, sizeof(line), stdin)) {
+		len = strlen(line);
+		while(len && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+		if((reply = hal_reply(line, learnit, budget)) == NULL)
+			continue;
+		printf("%s\n", reply);
+		fflush(stdout);
+		free(reply);
+	}
+
+	hal_close(1);
+	return 0;
+}
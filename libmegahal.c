@@ -0,0 +1,202 @@
+/*
+ *	libmegahal.c -- builds engine.c on its own, with the small API in
+ *	libmegahal.h in place of the eggdrop module glue in megahal.c.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <locale.h>
+#include <wctype.h>
+#define __USE_UNIX98
+#include <wchar.h>
+#ifdef MEGAHAL_THREADS
+#include <pthread.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "megahal.h"
+#include "standalone.h"
+#include "libmegahal.h"
+
+#include "engine.c"
+
+static int logging = 1;
+
+// engine messages go to stderr, where the bot would have logged them
+static void putlog(int type, const char *chan, const char *fmt, ...)
+{
+	va_list argp;
+	size_t len = strlen(fmt);
+
+	if(!logging)
+		return;
+	va_start(argp, fmt);
+	vfprintf(stderr, fmt, argp);
+	va_end(argp);
+	if(!len || fmt[len-1] != '\n')
+		fputc('\n', stderr);
+}
+
+int hal_open(const char *resources, const char *cache)
+{
+	Context;
+	words=new_dictionary();
+	prev1=new_dictionary();
+	prev2=new_dictionary();
+	prev3=new_dictionary();
+	prev4=new_dictionary();
+	prev5=new_dictionary();
+	replycontext=new_replycontext();
+	change_personality(&model, resources, cache);
+	if(model == NULL) {
+		hal_close(0);
+		return 0;
+	}
+	return 1;
+}
+
+void hal_close(int save)
+{
+	Context;
+	if(save && model != NULL)
+		save_brain();
+	close_journal();
+	free_model(model);
+	model = NULL;
+	free_words(ban);
+	free_dictionary(ban);
+	nfree(ban);
+	ban = NULL;
+	free_words(aux);
+	free_dictionary(aux);
+	nfree(aux);
+	aux = NULL;
+	free_swap(swp);
+	swp = NULL;
+	free_replycontext(replycontext);
+	replycontext = NULL;
+	free_words(words);
+	free_dictionary(words);
+	nfree(words);
+	free_words(prev1);
+	free_dictionary(prev1);
+	nfree(prev1);
+	free_words(prev2);
+	free_dictionary(prev2);
+	nfree(prev2);
+	free_words(prev3);
+	free_dictionary(prev3);
+	nfree(prev3);
+	free_words(prev4);
+	free_dictionary(prev4);
+	nfree(prev4);
+	free_words(prev5);
+	free_dictionary(prev5);
+	nfree(prev5);
+	words = prev1 = prev2 = prev3 = prev4 = prev5 = NULL;
+}
+
+// the same knobs the module has as tcl variables; order only counts for the next brain that gets made
+int hal_option(const char *name, int value)
+{
+	if(!strcmp(name, "order"))
+		order = value;
+	else if(!strcmp(name, "maxreplywords"))
+		maxreplywords = value;
+	else if(!strcmp(name, "surprise"))
+		surprise = value;
+	else if(!strcmp(name, "replycandidates"))
+		replycandidates = value;
+	else if(!strcmp(name, "replyscore"))
+		replyscore = value;
+	else if(!strcmp(name, "replythreads"))
+		replythreads = value;
+	else if(!strcmp(name, "trainthreads"))
+		trainthreads = value;
+	else if(!strcmp(name, "replyseed"))
+		replyseed = value;
+	else if(!strcmp(name, "logging"))
+		logging = value;
+	else
+		return 0;
+	return 1;
+}
+
+void hal_learn(const char *text)
+{
+	wchar_t *wtext;
+
+	Context;
+	if((wtext = locale_to_wchar((char *)text)) == NULL)
+		return;
+	upper(wtext);
+	make_words(wtext, words);
+	learn(model, words);
+	nfree(wtext);
+}
+
+// returns NULL when there is nothing to reply to
+char *hal_reply(const char *text, int learnit, int budget)
+{
+	wchar_t *wtext, *output;
+
+	Context;
+	if(!text[0] || (wtext = locale_to_wchar((char *)text)) == NULL)
+		return NULL;
+	upper(wtext);
+	make_words(wtext, words);
+	if(learnit)
+		learn(model, words);
+	output = generate_reply(model, replycontext, words, budget);
+	nfree(wtext);
+	capitalize(output);
+	return wchar_to_locale(output);
+}
+
+void hal_train(const char *filename)
+{
+	Context;
+	train(model, (char *)filename);
+}
+
+void hal_trim(int size)
+{
+	Context;
+	trimbrain(size);
+}
+
+void hal_save(void)
+{
+	Context;
+	save_brain();
+}
+
+int hal_nodes(void)
+{
+	Context;
+	return model->pool.nodes;
+}
+
+int hal_words(void)
+{
+	Context;
+	return model->dictionary->size;
+}
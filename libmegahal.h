@@ -0,0 +1,33 @@
+/*
+ *	libmegahal.h -- the MegaHAL engine without eggdrop.
+ *
+ *	The engine keeps a single brain per process, so these calls all work on
+ *	the brain opened by hal_open().  Strings are in the current locale, so
+ *	call setlocale() before anything else.
+ */
+
+#ifndef LIBMEGAHAL_H
+#define LIBMEGAHAL_H
+
+// loads the brain from cache (or trains it from resources), NULL for the defaults; returns 0 on failure
+int hal_open(const char *resources, const char *cache);
+// frees everything, saving the brain first if save is set
+void hal_close(int save);
+// sets one of the engine variables (order, maxreplywords, surprise, replycandidates, replyscore, replythreads, trainthreads, replyseed, logging); returns 0 if there is no such variable
+int hal_option(const char *name, int value);
+// learns a line of text
+void hal_learn(const char *text);
+// replies to a line of text within budget microseconds, learning it first if learnit is set; the reply must be free()d
+char *hal_reply(const char *text, int learnit, int budget);
+// learns every line of a file
+void hal_train(const char *filename);
+// deletes the oldest phrases until the brain has no more than size nodes
+void hal_trim(int size);
+// saves the brain to the cache directory
+void hal_save(void);
+// the number of nodes in both trees
+int hal_nodes(void);
+// the number of words in the dictionary
+int hal_words(void);
+
+#endif
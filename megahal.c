@@ -36,6 +36,76 @@
  *
  * (all old comments were moved to the end of this file)
  *
+ * Ver 3.8
+ *  - Tree nodes and child arrays are allocated from a per-model slab pool with free lists,
+ *    so freeing a whole brain no longer walks every node
+ *  - Child arrays keep a capacity that doubles as they grow and halves when they are mostly empty
+ *  - The symbols and counts of a node's children are stored in dense arrays next to the child
+ *    pointers, so search_node() and babble() no longer dereference every child
+ *  - search_node() narrows wide nodes with a binary search and scans the last 32 symbols (and
+ *    every narrower node) without branching, eight or sixteen at a time with SSE2/AVX2
+ *  - Building with MEGAHAL_WIDE_SYMBOLS uses 32-bit symbols and counts, lifting the 65535 word
+ *    limit; add_word() now refuses words once the dictionary is full instead of wrapping
+ *  - Brain files carry a format version and the symbol width after the new MegaHAL84 cookie;
+ *    MegaHAL83 brains still load
+ *  - Dictionaries find words through an open addressing hash table instead of a sorted index,
+ *    so add_word() no longer shifts the index and find_word() no longer binary searches
+ *  - Words are folded to upper case once when they are made and carry a cached hash, so
+ *    wordcmp() is an integer compare for words that differ instead of towupper() per character
+ *  - make_keywords() builds symbol bitsets for the keywords and the aux and ban lists, and reply()
+ *    keeps one for the symbols already used, so babble(), seed() and evaluate_reply() test bits
+ *    instead of searching dictionaries
+ *  - Building with MEGAHAL_THREADS generates replies on a worker thread; finished replies wake the
+ *    main loop through a pipe and are sent at once, and chatter heard while a reply is being made
+ *    is learnt afterwards; commands that need the model then answer that they are busy, or are put
+ *    off until it is free.
+ *    That build allocates from libc instead of eggdrop, and only the main loop calls putlog
+ *  - The reply search is timed in microseconds on the monotonic clock instead of whole seconds
+ *    with time(NULL), and can also stop after a number of candidates or once one scores well
+ *    enough (replyusec, dccreplyusec, replycandidates and replyscore)
+ *  - Replies are generated with generators that each own a context array, random number state,
+ *    reply buffer and used-word bitset instead of sharing the model's; with MEGAHAL_THREADS the
+ *    search runs replythreads of them in parallel and keeps the best reply any of them found
+ *  - The keywords, symbol sets, output buffer and generators of a reply live in a REPLYCONTEXT
+ *    passed to generate_reply(), make_keywords() and make_output() instead of in statics and
+ *    globals, and viewbranch builds its text in its own buffer, so the engine is reentrant
+ *  - The engine moved to engine.c, which megahal.c includes after the eggdrop headers; built with
+ *    "make standalone" it becomes libmegahal and the megahal-cli program without any eggdrop code
+ *  - megahal-bench ("make bench") times learning, replies, saving, loading and trimming on seeded
+ *    workloads and reports them as JSON; replyseed makes the reply generators repeatable
+ *  - save_model() fills a 1MB block and writes it out when full instead of calling fwrite() for
+ *    every field, word character and phrase symbol; the brain file comes out byte for byte the same
+ *  - Brain format 2 stores each tree as columns of symbols, usages, counts and branches in preorder
+ *    and the dictionary and phrases as offsets into flat blocks, all aligned; load_model() maps the
+ *    file and builds the trees in one loop without recursion or a read per field, and leaves the
+ *    model empty if the file is damaged.  Format 1 and MegaHAL83 brains still load
+ *  - savebrain forks and writes the brain from the child, which has the model as it stood while
+ *    the bot carries on; the hook reaps it and logs the result.  Every file is written to a
+ *    temporary name, fsync()ed and renamed into place.  "savebrain wait" saves in the foreground
+ *  - learn(), del_phrase() and trimdictionary() append a record to a journal that is synced every
+ *    second and replayed on top of megahal.brn when it is loaded; brain format 3 names the journal
+ *    that follows it, each save starts a new one, and journalsize saves once the journal is big
+ *  - make_words() no longer reads before the start of its buffer on the first word
+ *  - setmaxcontext rebuilds the trees straight from the symbols of the phrases in memory with
+ *    rebuild_model(), keeping the dictionary, instead of learning megahal.phr from the last save
+ *  - Files are learnt a batch of lines at a time; with MEGAHAL_THREADS, trainthreads threads make
+ *    the lines into words and train trees of their own that are merged into the model's.
+ *    learnfile runs from the secondly hook, logs its progress and stops with "learnfile cancel"
+ *  - The node pool counts the nodes in use and the bytes it holds as they change, so trimbrain,
+ *    the report, expmem and hal_nodes() no longer walk both trees; trimbrain checks after each phrase
+ *  - trimbrain takes the oldest phrases out of the trees and then off the phrase table in one move,
+ *    journalled as one record, and trimdictionary() renumbers the trees and phrases in one walk
+ *    through an old to new symbol table instead of counting the deleted words below every symbol
+ *  - Phrases are packed into 64K-symbol chunks behind a power-of-two ring of pointers instead of
+ *    one allocation each in an array grown by one on every phrase; adding a phrase and dropping the
+ *    oldest are O(1), and a loaded brain's phrases come in as one chunk
+ *  - The phrases are indexed by the symbols in them and by their contents, and the index is kept
+ *    up to date as phrases are learnt and deleted, so forget and forgetword look only at phrases
+ *    that share a word with the text, and deleting copies of a phrase no longer compares them all
+ *  - A phrase learnt again is stored once, with its copies pointing at the same symbols and
+ *    counted in its group; brain format 4 saves each phrase once and a column of which phrase
+ *    each copy is.  The trees are still trained and untrained once for every copy
+ *
  * Additions and changes by Nexor:
  *
  * Ver 3.7 Nov 2010
@@ -197,26 +267,41 @@
 
 #define MAKING_MEGAHAL
 #define MODULE_NAME "MegaHAL"
-#define VER "3.7"
+#define VER "3.8"
 #define VER1 3
-#define VER2 7
-#define COOKIE "MegaHAL83"
+#define VER2 8
 #include <stdlib.h>
 /* megahal preproc directives */
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <signal.h>
 #include <math.h>
 #include <time.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 #include <locale.h>
 #include <wctype.h>
 #define __USE_UNIX98
 #include <wchar.h>
+#ifdef MEGAHAL_THREADS
+#include <pthread.h>
+#include <fcntl.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "megahal.h"
 /* End megahal preproc directives */
 #include "../module.h"
@@ -225,36 +310,145 @@
 
 #undef global
 
-/* predefinitions for megahal*/
+/*
+ *	With MEGAHAL_THREADS, replies are generated by a worker thread while the
+ *	main loop carries on.  The worker holds model_lock for the whole time it
+ *	uses the engine, so everything else that touches the model takes it too.
+ *	The main loop never waits for it: learning from chatter is put aside until
+ *	the model is free, trimbrain and savebrain are put off to the next second
+ *	the model is free, and the other commands say they are busy.  The
+ *	worker writes a byte down wakepipe for each reply it finishes, and the
+ *	read end is one of eggdrop's sockets, so the main loop sends the reply
+ *	as soon as it is ready instead of on the next second.
+ *
+ *	eggdrop's allocator and its log aren't safe to call from any thread but
+ *	the main loop's, and the worker, the reply generators and the helpers
+ *	learning a file all allocate and may log.  So the threaded build takes
+ *	all of its memory from libc, and what the other threads log waits on
+ *	the messages queue for the main loop to pass on.
+ */
+#ifdef MEGAHAL_THREADS
+static pthread_t worker;
+static bool worker_running = FALSE;
+static bool worker_quit = FALSE;
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static REPLYJOB *pending = NULL;
+static REPLYJOB *finished = NULL;
+static LEARNJOB *deferred = NULL;
+static LOGJOB *messages = NULL;
+static pthread_t mainthread;
+static int wakepipe[2] = {-1, -1};
+static int wakeidx = -1;
+static struct dcc_table DCC_MEGAHAL = {
+  "MEGAHAL",
+  0,
+  wakepipe_eof,
+  wakepipe_activity,
+  NULL,
+  NULL,
+  wakepipe_display
+};
+#define LOCK_MODEL() pthread_mutex_lock(&model_lock)
+#define UNLOCK_MODEL() pthread_mutex_unlock(&model_lock)
+#define TRY_MODEL() (pthread_mutex_trylock(&model_lock) == 0)
+#else
+#define LOCK_MODEL()
+#define UNLOCK_MODEL()
+#define TRY_MODEL() TRUE
+#endif
+#define BUSY_TEXT "I am busy thinking, try again in a moment."
+
+// trimbrain and savebrain asked for while a reply had the model, done by megahal_secondly()
+static int trimwanted = -1;
+static bool savewanted = FALSE;
+// a background save restart_journal() started failed, so megahal_secondly() saves again in the foreground
+static bool restartwanted = FALSE;
+// what megahal_expmem() last counted, for when a reply has the model
+static int lastexpmem = 0;
+
+/*
+ *	savebrain writes the brain from a forked copy of the bot, which sees
+ *	the model exactly as it was when the command ran while the bot itself
+ *	goes on learning.  megahal_secondly() reaps it and reports how it went.
+ *	What is learnt meanwhile goes to the journal the new brain names, and
+ *	the journals before that one are deleted once the save has worked.
+ */
+static pid_t saver = 0;
+static BYTE8 savedjournal = 0;
+static bool restartsave = FALSE;
 
-static int rnd(int);
-static int order = 2;
-static int timeout = 1;
-static DICTIONARY *ban = NULL;
-static DICTIONARY *aux = NULL;
-static SWAP *swp = NULL;
-static bool used_key;
-static char directory_cache[513] = DIR_DEFAULT_CACHE;
-static char directory_resources[513] = DIR_DEFAULT_RESOURCES;
+/*
+ *	learnfile learns its file a few lines at a time from
+ *	megahal_secondly(), for up to TRAIN_SLICE microseconds a second, so a
+ *	big file doesn't stop the bot.  "learnfile cancel" gives up on it and
+ *	keeps what has been learnt so far.
+ */
+static TRAINING *learning = NULL;
+static time_t learnlogged = 0;
 
 /* predefinitions for eggdrop port */
 
 static Function *global = NULL;
 static Function *irc_funcs = NULL, *server_funcs = NULL;
-static DICTIONARY *words = NULL;
-static MODEL *model = NULL;
+
+#ifdef MEGAHAL_THREADS
+#undef nmalloc
+#undef nrealloc
+#undef nfree
+#define nmalloc(x) malloc(x)
+#define nrealloc(x, y) realloc((x), (y))
+#define nfree(x) free(x)
+
+// logs from the main loop, and puts what the other threads log on the messages queue for it
+static void thread_putlog(int type, const char *chan, const char *format, ...)
+{
+	LOGJOB *job, **last;
+	va_list argp;
+	char text[1024];
+
+	va_start(argp, format);
+	vsnprintf(text, sizeof(text), format, argp);
+	va_end(argp);
+	if(pthread_equal(pthread_self(), mainthread)) {
+		putlog(type, (char *)chan, "%s", text);
+		return;
+	}
+	if((job = (LOGJOB *)malloc(sizeof(LOGJOB))) == NULL)
+		return;
+	job->type = type;
+	job->chan = strdup(chan);
+	job->text = strdup(text);
+	if(job->chan == NULL || job->text == NULL) {
+		free(job->chan);
+		free(job->text);
+		free(job);
+		return;
+	}
+	job->next = NULL;
+	pthread_mutex_lock(&queue_lock);
+	for(last=&messages; *last; last=&(*last)->next)
+		;
+	*last = job;
+	pthread_mutex_unlock(&queue_lock);
+}
+#undef putlog
+#define putlog thread_putlog
+#endif
+
+/* the engine itself, which libmegahal builds on its own too */
+#include "engine.c"
+
 static int talkfrequency = 40;
 static int learnfrequency = 40;
 static bool learningmode = TRUE;
-static wchar_t glob_str[15000];
-static wchar_t glob_buffer[513];
 static wchar_t mbotnick[32] = _T(BOTNICK);
 static int maxlines = 10, maxtime = 60, curlines = 0, curtime = 0;
 static char texcludechans[513] = "", rexcludechans[513] = "", responsekeywords[513] = "";
 static int maxsize = 100000;
-static int maxreplywords = 0;
-static int surprise = 1;
-static DICTIONARY *prev1, *prev2, *prev3, *prev4, *prev5;
+static int replyusec = 1000000, dccreplyusec = 2000000;
+static int journalsize = 16384;
 
 static cmd_t mega_dcc[] =
 {
@@ -309,6 +503,13 @@ static tcl_ints my_tcl_ints[] =
   {"maxsize", &maxsize, 0},
   {"maxreplywords", &maxreplywords, 0},
   {"surprise", &surprise, 0},
+  {"replyusec", &replyusec, 0},
+  {"dccreplyusec", &dccreplyusec, 0},
+  {"replycandidates", &replycandidates, 0},
+  {"replyscore", &replyscore, 0},
+  {"replythreads", &replythreads, 0},
+  {"trainthreads", &trainthreads, 0},
+  {"journalsize", &journalsize, 0},
   {0, 0, 0}
 };
 
@@ -338,99 +539,20 @@ static Function megahal_table[] =
 
 /* end predefinitions */
 
-static wchar_t *locale_to_wchar(char *str)
-{
-	wchar_t *ptr;
-	size_t s;
-
-	Context;
-	/* first arg == NULL means 'calculate needed space' */
-	s = mbstowcs(NULL, str, 0);
-
-	/* a size of -1 is triggered by an error in encoding; never
-	   happen in ISO-8859-* locales, but possible in UTF-8 */
-	if(s == -1)
-		return NULL;
-
-	/* malloc the necessary space */
-	if((ptr = (wchar_t *)nmalloc((s+1)*sizeof(wchar_t))) == NULL)
-		return NULL;
-
-	/* really do it */
-	mbstowcs(ptr, str, s);
-
-	/* ensure NULL-termination */
-	ptr[s] = L'\0';
-
-	/* remember to free() ptr when done */
-	return ptr;
-}
-
-static char *wchar_to_locale(wchar_t *str)
-{
-	char *ptr;
-	size_t s;
-
-	Context;
-	/* first arg == NULL means 'calculate needed space' */
-	s = wcstombs(NULL, str, 0);
-
-	/* a size of -1 means there are characters that could not
-	   be converted to current locale */
-	if(s == -1)
-		return NULL;
-
-	/* malloc the necessary space */
-	if((ptr = (char *)nmalloc(s+1)) == NULL)
-		return NULL;
-
-	/* really do it */
-	wcstombs(ptr, str, s);
-
-	/* ensure NULL-termination */
-	ptr[s] = '\0';
-
-	/* remember to free() ptr when done */
-	return ptr;
-}
-
-static wchar_t *mynewsplit(wchar_t **rest)
-{
-	register wchar_t *o, *r;
-
-	Context;
-	if(!rest)
-		return *rest = L"";
-	o = *rest;
-	while(*o == L' ')
-		o++;
-	r = o;
-	while(*o && (*o != L' '))
-		o++;
-	if(*o)
-		*o++ = 0;
-	*rest = o;
-	return r;
-}
-
 // rough estimate here - if you want precise numbers do it yourself :-p
 static int megahal_expmem()
 {
 	register int i;
-	int size = 0, tmp;
+	int size = 0;
 
 	Context;
+	if(!TRY_MODEL())
+		return lastexpmem;
 	size += sizeof(MODEL);
-	tmp = recurse_tree(model->forward);
-	size += tmp*sizeof(TREE);
-	size += tmp*sizeof(TREE *);
-	tmp = recurse_tree(model->backward);
-	size += tmp*sizeof(TREE);
-	size += tmp*sizeof(TREE *);
+	size += model->pool.bytes;
 
-	for(i=0; i<model->phrasecount; i++)
-		size += model->phrase[i][0]+1*sizeof(BYTE2);
-	size += model->phrasecount*sizeof(BYTE2 *);
+	size += model->phrases.bytes;
+	size += model->index.bytes;
 
 	size += dictionary_expmem(model->dictionary);
 	size += dictionary_expmem(ban);
@@ -444,6 +566,14 @@ static int megahal_expmem()
 	}
 	size += swp->size*sizeof(STRING)*2;
 
+	size += sizeof(REPLYCONTEXT)+dictionary_expmem(replycontext->keys)+dictionary_expmem(replycontext->dummy);
+	size += (replycontext->keyset.size+replycontext->auxset.size+replycontext->banset.size)/8;
+	size += replycontext->size*sizeof(GENCONTEXT);
+	for(i=0; i<replycontext->size; ++i)
+		size += sizeof(TREE *)*(replycontext->gen[i].order+2)+replycontext->gen[i].usedset.size/8+dictionary_expmem(replycontext->gen[i].replies)+dictionary_expmem(replycontext->gen[i].best);
+	UNLOCK_MODEL();
+
+	lastexpmem = size;
 	return size;
 }
 
@@ -457,7 +587,7 @@ static int dictionary_expmem(DICTIONARY *dictionary)
 	for (i=0; i<dictionary->size; i++)
 		size += dictionary->entry[i].length*sizeof(wchar_t);
 	size += dictionary->size*sizeof(STRING);
-	size += dictionary->size*sizeof(BYTE2);
+	size += dictionary->buckets*sizeof(SYMBOL);
 
 	return size;
 }
@@ -468,7 +598,15 @@ static wchar_t *megahal_close()
 	p_tcl_bind_list H_temp;
 
 	Context;
-	save_model("megahal.brn", model);
+#ifdef MEGAHAL_THREADS
+	stop_worker();
+#endif
+	del_hook(HOOK_SECONDLY, (Function) megahal_secondly);
+	stop_training(learning);
+	learning = NULL;
+	wait_for_saver();
+	save_brain();
+	close_journal();
 	rem_builtins(H_dcc, mega_dcc);
 	rem_builtins(H_pubm, mega_pubm);
 	rem_builtins(H_ctcp, mega_ctcp);
@@ -485,6 +623,8 @@ static wchar_t *megahal_close()
 	free_words(aux);
 	free_dictionary(aux);
 	free_swap(swp);
+	free_replycontext(replycontext);
+	replycontext = NULL;
 	free_words(words);
 	free_dictionary(words);
 	free_words(prev1);
@@ -506,6 +646,9 @@ char *megahal_start(Function * global_funcs)
 	global = global_funcs;
 
 	Context;
+#ifdef MEGAHAL_THREADS
+	mainthread = pthread_self();
+#endif
 	module_register(MODULE_NAME, megahal_table, VER1, VER2);
 	if(!(irc_funcs = module_depend(MODULE_NAME, "irc", 1, 0)))
 		return "You need the irc module to use the megahal module.";
@@ -526,10 +669,15 @@ char *megahal_start(Function * global_funcs)
 	prev3=new_dictionary();
 	prev4=new_dictionary();
 	prev5=new_dictionary();
+	replycontext=new_replycontext();
 	/*
 	 *	Load the default personality.
 	 */
 	change_personality(&model, NULL, NULL);
+#ifdef MEGAHAL_THREADS
+	start_worker();
+#endif
+	add_hook(HOOK_SECONDLY, (Function) megahal_secondly);
 	putlog(LOG_MISC, "*", "MegaHAL v%s by z0rc loaded.", VER);
 
 	return NULL;
@@ -541,22 +689,48 @@ static void megahal_report(int idx, int details)
 	Context;
 	if(details) {
 		dprintf(idx, "     by z0rc, Zev ^Baron^ Toledano and Jason Hutchens\n");
-		dprintf(idx, "     words: %d, nodes: %d\n", model->forward->branch, (recurse_tree(model->backward) + recurse_tree(model->forward)));
+		if(TRY_MODEL()) {
+			dprintf(idx, "     words: %d, nodes: %d\n", model->forward->branch, model->pool.nodes);
+			UNLOCK_MODEL();
+		} else
+			dprintf(idx, "     busy making a reply\n");
 		dprintf(idx, "     using %d bytes\n", megahal_expmem());
 	}
 }
 
-// Next, a hacked attempt at strdup(), since I can't use malloc() anywhere.
-static wchar_t *mystrdup(const wchar_t *s)
+static bool floodcheck()
 {
-	wchar_t *mytmp = nmalloc((wcslen(s)+1)*sizeof(wchar_t));
-
 	Context;
-	if(mytmp == NULL)
-		return NULL;
-	else wcscpy(mytmp, s);
+	if(!maxlines || !maxtime)
+		return TRUE;
+	if((now - curtime) > maxtime) {
+		curtime = now;
+		curlines = 0;
+	}
+	curlines++;
+	if(curlines > maxlines)
+		return FALSE;
+	return TRUE;
+}
+
+
+static wchar_t *mynewsplit(wchar_t **rest)
+{
+	register wchar_t *o, *r;
 
-	return mytmp;
+	Context;
+	if(!rest)
+		return *rest = L"";
+	o = *rest;
+	while(*o == L' ')
+		o++;
+	r = o;
+	while(*o && (*o != L' '))
+		o++;
+	if(*o)
+		*o++ = 0;
+	*rest = o;
+	return r;
 }
 
 static void mystrlwr(wchar_t *string)
@@ -590,26 +764,32 @@ static const wchar_t *mystrstr(const wchar_t *s, const wchar_t *sub)
 	return NULL;
 }
 
-static bool floodcheck()
+// compares a folded word with a plain string, like wordcmp() does two words
+static int wordcmp2(STRING word1, wchar_t *word2)
 {
-	Context;
-	if(!maxlines || !maxtime)
-		return TRUE;
-	if((now - curtime) > maxtime) {
-		curtime = now;
-		curlines = 0;
-	}
-	curlines++;
-	if(curlines > maxlines)
-		return FALSE;
-	return TRUE;
-}
+	register int i;
+	int bound, length2;
+
+	length2 = wcslen(word2);
+	bound = MIN(word1.length,length2);
+
+	for(i=0; i<bound; ++i)
+		if(word1.word[i]!=towupper(word2[i]))
+			return (int)(word1.word[i]-towupper(word2[i]));
+
+	if(word1.length<length2)
+		return -1;
+	if(word1.length>length2)
+		return 1;
 
+	return 0;
+}
 
 static char *istextinlist(char *text, char *list)
 {
 	wchar_t *wtext, *wlist;
 	wchar_t *ch, *pbuf;
+	wchar_t lowered[513];
 
 	Context;
 	setlocale(LC_ALL, "");
@@ -617,10 +797,10 @@ static char *istextinlist(char *text, char *list)
 	wlist = locale_to_wchar(list);
 	wchar_t buf[wcslen(wlist)+1];
 	wcscpy(buf, wlist);
-	wcsncpy(glob_buffer, wtext, 512);
-	glob_buffer[512] = L'\0';
+	wcsncpy(lowered, wtext, 512);
+	lowered[512] = L'\0';
 	mystrlwr(buf);
-	mystrlwr(glob_buffer);
+	mystrlwr(lowered);
 
 	nfree(wtext);
 	nfree(wlist);
@@ -628,8 +808,8 @@ static char *istextinlist(char *text, char *list)
 	while(wcslen(pbuf) > 0)
 	{
 		ch = mynewsplit(&pbuf);
-		if(!wcscmp(glob_buffer, ch))
-			return wchar_to_locale(glob_buffer);
+		if(!wcscmp(lowered, ch))
+			return wchar_to_locale(lowered);
 	}
 	return NULL;
 }
@@ -637,24 +817,25 @@ static char *istextinlist(char *text, char *list)
 static char *istextinlist2(STRING text, char *list)
 {
 	wchar_t *ch, *pbuf, *wlist;
+	wchar_t lowered[256];
 
 	Context;
 	setlocale(LC_ALL, "");
 	wlist = locale_to_wchar(list);
 	wchar_t buf[wcslen(wlist)+1];
 	wcscpy(buf, wlist);
-	wcsncpy(glob_buffer, text.word, text.length);
-	glob_buffer[text.length] = L'\0'; // length = byte
+	wcsncpy(lowered, text.word, text.length);
+	lowered[text.length] = L'\0'; // length = byte
 	mystrlwr(buf);
-	mystrlwr(glob_buffer);
+	mystrlwr(lowered);
 
 	nfree(wlist);
 	pbuf = buf;
 	while(wcslen(pbuf) > 0)
 	{
 		ch = mynewsplit(&pbuf);
-		if(!wcscmp(glob_buffer, ch))
-			 return wchar_to_locale(glob_buffer);
+		if(!wcscmp(lowered, ch))
+			 return wchar_to_locale(lowered);
 	}
 	return NULL;
 }
@@ -687,10 +868,10 @@ static int getchannum(char *chan)
 	return c;
 }
 
-static void do_megahal(int idx, char *prefix, char *text, bool learnit, char *nick, char *chan)
+static void do_megahal(int idx, char *prefix, char *text, bool learnit, char *nick, char *chan, int budget)
 {
-	char stuff[strlen(prefix) + 50], *lhalreply, *lmbotnick;
-	wchar_t *halreply, *wtext;
+	char stuff[strlen(prefix) + 50];
+	wchar_t *wtext;
 
 	Context;
 	/* Is there anything to parse? */
@@ -710,8 +891,27 @@ static void do_megahal(int idx, char *prefix, char *text, bool learnit, char *ni
 	make_words(wtext, words);
 	Context;
 	if(learningmode && learnit)
-		learn(model, words);
-	halreply = generate_reply(model, words);
+		learn_words(words);
+#ifdef MEGAHAL_THREADS
+	if(worker_running)
+		queue_reply(idx, prefix, wtext, nick, chan, budget);
+	else {
+		// without the worker the reply is made here, as it is in the unthreaded build
+		LOCK_MODEL();
+		send_reply(idx, prefix, generate_reply(model, replycontext, words, budget), nick, chan);
+		UNLOCK_MODEL();
+	}
+#else
+	send_reply(idx, prefix, generate_reply(model, replycontext, words, budget), nick, chan);
+#endif
+	nfree(wtext);
+}
+
+// capitalizes a reply, sends it where it was asked for and logs it
+static void send_reply(int idx, char *prefix, wchar_t *halreply, char *nick, char *chan)
+{
+	char *lhalreply, *lmbotnick;
+
 	Context;
 	capitalize(halreply);
 	lhalreply = wchar_to_locale(halreply);
@@ -723,3360 +923,1407 @@ static void do_megahal(int idx, char *prefix, char *text, bool learnit, char *ni
 		putlog(LOG_PUBLIC, chan, "<%s> %s", lmbotnick, lhalreply);
 	nfree(lmbotnick);
 	nfree(lhalreply);
-	nfree(wtext);
 }
 
-static int pub_megahal(char *nick, char *host, char *hand, char *channel, char *text)
+// learns from the words of a message, or keeps a copy of them for later if a reply is using the model
+static void learn_words(DICTIONARY *words)
 {
-	char prefix[strlen(channel) + strlen(nick) + 13];
-	struct chanset_t *chan = findchan(channel);
+#ifdef MEGAHAL_THREADS
+	LEARNJOB *job, **last;
+	register int i;
 
 	Context;
-	if(!floodcheck())
-		return 0;
-	if(istextinlist(channel, rexcludechans))
-		return 0;
-	if(chan != NULL) {
-		sprintf(prefix, "PRIVMSG %s :%s: ", channel, nick);
-		char *lmbotnick=wchar_to_locale(mbotnick);
-		putlog(LOG_PUBLIC, channel, "<%s> %s: %s", nick, lmbotnick, text);
-		nfree(lmbotnick);
-		do_megahal(DP_HELP, prefix, text, TRUE, nick, channel);
+	pthread_mutex_lock(&queue_lock);
+	if(deferred == NULL && pthread_mutex_trylock(&model_lock) == 0) {
+		pthread_mutex_unlock(&queue_lock);
+		learn(model, words);
+		UNLOCK_MODEL();
+		return;
 	}
-	return 0;
-}
 
-static int pub_action(char *nick, char *host, char *hand, char *channel, char *key, char *text)
-{
-	pub_megahal2(nick, host, hand, channel, text);
-	return 0;
+	job = (LEARNJOB *)nmalloc(sizeof(LEARNJOB));
+	job->words = new_dictionary();
+	job->words->size = words->size;
+	realloc_dictionary(job->words);
+	for(i=0; i<words->size; ++i) {
+		job->words->entry[i] = words->entry[i];
+		job->words->entry[i].word = (wchar_t *)nmalloc(sizeof(wchar_t)*words->entry[i].length);
+		wmemcpy(job->words->entry[i].word, words->entry[i].word, words->entry[i].length);
+	}
+	job->next = NULL;
+	for(last=&deferred; *last; last=&(*last)->next)
+		;
+	*last = job;
+	pthread_mutex_unlock(&queue_lock);
+#else
+	Context;
+	learn(model, words);
+#endif
 }
 
-static int pub_megahal2(char *nick, char *host, char *hand, char *channel, char *text)
+#ifdef MEGAHAL_THREADS
+// learns everything that was put aside while the model was busy - the caller holds the model
+static void drain_learning(void)
 {
-	// counters per channel for chatter/learning
-	static int *count = NULL, *learncount = NULL;
-	static int chancount = 0, learnchancount = 0;
+	LEARNJOB *job;
 
-	char prefix[strlen(channel) + strlen(nick) + 13], *keyword = NULL;
-	wchar_t buffer[512] = L"";
-	wchar_t *wtext;
+	Context;
+	while(TRUE) {
+		pthread_mutex_lock(&queue_lock);
+		job = deferred;
+		if(job != NULL)
+			deferred = job->next;
+		pthread_mutex_unlock(&queue_lock);
+		if(job == NULL)
+			break;
+		learn(model, job->words);
+		free_words(job->words);
+		free_dictionary(job->words);
+		nfree(job->words);
+		nfree(job);
+	}
+}
 
-	int i, pos;
-	struct chanset_t *chan = findchan(channel);
-	bool learnit = FALSE, flg = TRUE;
+// logs what the other threads have left on the messages queue - only ever called from the main loop
+static void log_messages(void)
+{
+	LOGJOB *job, *next;
 
 	Context;
-	setlocale(LC_ALL, "");
-	wtext = locale_to_wchar(text);
-	wcscpy(buffer,wtext);
-	nfree(wtext);
-	mystrlwr(buffer);
-	if(mystrstr(buffer, L"http") != NULL) {
-		return 0;
+	pthread_mutex_lock(&queue_lock);
+	job = messages;
+	messages = NULL;
+	pthread_mutex_unlock(&queue_lock);
+	while(job != NULL) {
+		next = job->next;
+		putlog(job->type, job->chan, "%s", job->text);
+		free(job->chan);
+		free(job->text);
+		free(job);
+		job = next;
 	}
+}
 
-	// handle and respond to phrases with the botnick or keywords in it immediately and then exit
-	make_words(buffer, words); // dont make upper or it will mess things like mystrstr
-	if(words->size == 0) { // might have stripped all codes and returned empty
-		return 0;
-	}
-	if(words->size > 1) {
-		if((wordcmp2(words->entry[0], mbotnick)==0) && ((words->entry[1].word[1] == L':') || (words->entry[1].word[1] == L','))) { // let this be handled by pub_megahal otherwise we respond twice
-			return 0;
-		}
+// hands a reply over to the worker thread, remembering where it has to go
+static void queue_reply(int idx, char *prefix, wchar_t *text, char *nick, char *chan, int budget)
+{
+	REPLYJOB *job, **last;
+
+	Context;
+	job = (REPLYJOB *)nmalloc(sizeof(REPLYJOB));
+	job->idx = idx;
+	job->sock = (idx >= 0 && idx < dcc_total) ? dcc[idx].sock : -1;
+	job->prefix = (char *)nmalloc(strlen(prefix)+1);
+	strcpy(job->prefix, prefix);
+	job->nick = NULL;
+	if(nick) {
+		job->nick = (char *)nmalloc(strlen(nick)+1);
+		strcpy(job->nick, nick);
 	}
-	if((words->entry[0].word[0] == L'.') || (words->entry[0].word[0] == L'!')) { // pub command - ignore
-		return 0;
+	job->chan = NULL;
+	if(chan) {
+		job->chan = (char *)nmalloc(strlen(chan)+1);
+		strcpy(job->chan, chan);
 	}
+	job->text = mystrdup(text);
+	job->budget = budget;
+	job->output = NULL;
+	job->next = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	for(last=&pending; *last; last=&(*last)->next)
+		;
+	*last = job;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+static void free_replyjob(REPLYJOB *job)
+{
 	Context;
-	flg = (istextinlist(channel, rexcludechans)!=NULL); // dont respond/chat in channels that are excluded but learnfrequency is still enabled for now...
-	for (i=0; i<words->size; i++) // find whether one of the response keywords is in the text - find first only
-		if((keyword = istextinlist2(words->entry[i], responsekeywords)))
+	nfree(job->prefix);
+	if(job->nick)
+		nfree(job->nick);
+	if(job->chan)
+		nfree(job->chan);
+	nfree(job->text);
+	if(job->output)
+		nfree(job->output);
+	nfree(job);
+}
+
+// the worker thread: takes replies off the pending queue, generates them and puts them on the finished queue
+static void *reply_worker(void *arg)
+{
+	DICTIONARY *jobwords = new_dictionary();
+	REPLYJOB *job, **last;
+
+	while(TRUE) {
+		pthread_mutex_lock(&queue_lock);
+		while(pending == NULL && !worker_quit)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if(worker_quit) {
+			pthread_mutex_unlock(&queue_lock);
 			break;
-	if(chan != NULL && (mystrstr(buffer, mbotnick) || keyword) && !flg) { // either botnick or keyword said - respond immediately and exit
-		Context;
-		if(!floodcheck()) {
-			return 0;
-		}
-		if(!keyword)
-			keyword = wchar_to_locale(mbotnick);
-		// if keyword used in beginning or end of phrase, learn it
-		if(wordcmp2(words->entry[0], locale_to_wchar(keyword))==0 || wordcmp2(words->entry[(words->size)-2], locale_to_wchar(keyword))==0) { // -2 to exclude the period
-			learnit = TRUE;
-			sprintf(prefix, "PRIVMSG %s :%s: ", channel, nick);
-		} else {
-			sprintf(prefix, "PRIVMSG %s :%s, ", channel, nick);
-		}
-		// remove the botnick from the text
-		if(mystrstr(buffer, locale_to_wchar(keyword))) {
-			pos = (int)(mystrstr(buffer, locale_to_wchar(keyword)) - buffer);
-			for(i=pos; i<(wcslen(buffer)-wcslen(locale_to_wchar(keyword))); i++)
-				buffer[i] = buffer[i+wcslen(locale_to_wchar(keyword))];
-			buffer[i]=L'\0';
 		}
-		char *lbuffer=wchar_to_locale(buffer);
-		do_megahal(DP_HELP, prefix, lbuffer, learnit, nick, channel);
-		nfree(lbuffer);
-		return 0;
-	}
+		job = pending;
+		pending = job->next;
+		pthread_mutex_unlock(&queue_lock);
+
+		LOCK_MODEL();
+		drain_learning();
+		make_words(job->text, jobwords);
+		job->output = mystrdup(generate_reply(model, replycontext, jobwords, job->budget));
+		UNLOCK_MODEL();
+
+		pthread_mutex_lock(&queue_lock);
+		job->next = NULL;
+		for(last=&finished; *last; last=&(*last)->next)
+			;
+		*last = job;
+		pthread_mutex_unlock(&queue_lock);
+		// a full pipe already has the main loop on its way
+		while(wakepipe[1] >= 0 && write(wakepipe[1], "!", 1) < 0 && errno == EINTR)
+			;
+	}
+
+	free_words(jobwords);
+	free_dictionary(jobwords);
+	nfree(jobwords);
+	return NULL;
+}
 
-	// Learn this phrase?
-	if(learningmode && learnfrequency>0) {
-		// initialize the count array - one int per chan (first time only)
-		Context;
-		if(countchans() && learncount == NULL) {
-			learncount = (int *)nmalloc(sizeof(int)*countchans());
-			for (i=0; i<countchans(); i++)
-				learncount[i] = 0;
-			learnchancount = countchans();
-		}
-		// if number of chans changed, realloc the array
-		if(countchans() && learnchancount != countchans()) {
-			learncount = (int *)nrealloc((int *)(learncount), sizeof(int)*countchans());
-			learnchancount = countchans();
-		}
+// logs what the other threads have to say and sends the replies the worker has finished - only ever called from the main loop
+static void send_finished(void)
+{
+	REPLYJOB *job;
 
-		// increment appropriate counter
-		if(learncount[getchannum(channel)] < learnfrequency) {
-			learncount[getchannum(channel)]++;
-		} else {
-			upper(buffer);
-			make_words(buffer, words);
-			if(words->size > (model->order)) { // only learn phrases with minimum amount of words
-				learn(model, words);
-				learncount[getchannum(channel)] = 0;
-			}
-		}
-	}
-
-	// From here, chatter stuff only
-	// check if chatter is turned off or if this chan is in the exclude list
 	Context;
-	if(istextinlist(channel, texcludechans) || talkfrequency == 0)
-		return 0;
-
-	// initialize the count array - one int per chan (first time only)
-	if(countchans() && count == NULL) {
-		count = (int *)nmalloc(sizeof(int)*countchans());
-		for (i=0; i<countchans(); i++)
-			count[i] = 0;
-		chancount = countchans();
-	}
-	// if number of chans changed, realloc the array
-	if(countchans() && chancount != countchans()) {
-		count = (int *)nrealloc((int *)(count), sizeof(int)*countchans());
-		chancount = countchans();
+	log_messages();
+	while(TRUE) {
+		pthread_mutex_lock(&queue_lock);
+		job = finished;
+		if(job != NULL)
+			finished = job->next;
+		pthread_mutex_unlock(&queue_lock);
+		if(job == NULL)
+			break;
+		// a dcc user may have left (and their idx been reused) while the reply was being made
+		if(job->sock == -1 || (job->idx < dcc_total && dcc[job->idx].sock == job->sock))
+			send_reply(job->idx, job->prefix, job->output, job->nick, job->chan);
+		free_replyjob(job);
 	}
+}
 
-	// increment appropriate counter
-	if(count[getchannum(channel)] < talkfrequency) {
-		count[getchannum(channel)]++;
-		return 0;
-	} else {
-		if (!floodcheck())
-			return 0;
-		count[getchannum(channel)] = 0;
+// the worker's end of the pipe doesn't block, and eggdrop reads the other with the bot's sockets
+static void start_wakepipe(void)
+{
+	Context;
+	if(pipe(wakepipe) < 0) {
+		wakepipe[0] = wakepipe[1] = -1;
+		return;
 	}
-
-	if(chan != NULL) {
-		sprintf(prefix, "PRIVMSG %s :", channel);
-		do_megahal(DP_HELP, prefix, text, FALSE, NULL, channel);
+	fcntl(wakepipe[1], F_SETFL, O_NONBLOCK);
+	if((wakeidx = new_dcc(&DCC_MEGAHAL, 0)) < 0) {
+		close(wakepipe[0]);
+		close(wakepipe[1]);
+		wakepipe[0] = wakepipe[1] = -1;
+		return;
 	}
-	if(keyword)
-		nfree(keyword);
-	return 0;
+	dcc[wakeidx].sock = wakepipe[0];
+	strcpy(dcc[wakeidx].nick, "megahal");
+	strcpy(dcc[wakeidx].host, "wakepipe");
+	setsock(wakepipe[0], SOCK_BINARY | SOCK_NONSOCK);
 }
 
-static int dcc_megahal(struct userrec *u, int idx, char *par)
+// called once the worker has stopped, so nothing writes to the pipe any more
+static void stop_wakepipe(void)
 {
 	Context;
-	if(!floodcheck())
-		return 0;
-	do_megahal(idx, "", par, TRUE, NULL, NULL);
-	return 0;
+	if(wakeidx >= 0) {
+		killsock(dcc[wakeidx].sock);
+		lostdcc(wakeidx);
+		wakeidx = -1;
+	} else if(wakepipe[0] >= 0)
+		close(wakepipe[0]);
+	if(wakepipe[1] >= 0)
+		close(wakepipe[1]);
+	wakepipe[0] = wakepipe[1] = -1;
 }
 
-
-
-static int dcc_forget(struct userrec *u, int idx, char *text)
+// the worker finished a reply; eggdrop has already read the bytes that said so
+static void wakepipe_activity(int idx, char *buf, int len)
 {
-	register int j;
-	int phrase;
-	bool fnd;
-	DICTIONARY *words;
-	wchar_t *output, *wtext;
-
 	Context;
-	setlocale(LC_ALL, "");
-	if(!text[0])
-		return 0;
-
-	words = new_dictionary();
-	wtext = locale_to_wchar(text);
-	phrase = find_phrase(wtext, &fnd);
-	if(fnd) {
-		words->size=model->phrase[phrase][0]-1;
-		if(realloc_dictionary(words)==NULL) {
-			error("dcc_forget", "Unable to reallocate dictionary");
-			return 0;
-		}
-		for(j=0; j<words->size; j++)
-			words->entry[j] = model->dictionary->entry[model->phrase[phrase][j+1]];
+	send_finished();
+}
 
-		output = make_output(words);
-		capitalize(output);
-		char *loutput=wchar_to_locale(output);
-		dprintf(idx, "You mean \"%s\"? OK, I'll try...\n", loutput);
-		nfree(loutput);
-		del_all_phrases(phrase);
-		trimdictionary();
-	} else {
-		dprintf(idx, "There is no way that I am going to forget about that, sorry.\n");
-	}
+// never happens while the worker's end is open, but if it does, the secondly hook still sends the replies
+static void wakepipe_eof(int idx)
+{
+	Context;
+	killsock(dcc[idx].sock);
+	lostdcc(idx);
+	wakeidx = -1;
+	wakepipe[0] = -1;
+}
 
-	nfree(wtext);
-	return 0;
+static void wakepipe_display(int idx, char *buf)
+{
+	strcpy(buf, "megahal replies");
 }
 
-static int pub_forget(char *nick, char *host, char *hand, char *channel, char *text)
+static void start_worker(void)
 {
-	register int j;
-	int phrase;
-	bool fnd;
-	DICTIONARY *words;
-	wchar_t *output, *wtext;
+	sigset_t all, old;
 
 	Context;
-	setlocale(LC_ALL, "");
-	putlog(LOG_MISC, "*", "forget  %s  by %s", text, hand);
-	if(!text[0])
-		return 0;
-
-	words = new_dictionary();
-	wtext = locale_to_wchar(text);
-	phrase = find_phrase(wtext, &fnd);
-	if(fnd) {
-		words->size=model->phrase[phrase][0]-1;
-		if(realloc_dictionary(words)==NULL) {
-			error("pub_forget", "Unable to reallocate dictionary");
-			return 0;
-		}
-		for(j=0; j<words->size; j++)
-			words->entry[j] = model->dictionary->entry[model->phrase[phrase][j+1]];
-
-		output = make_output(words);
-		capitalize(output);
-		char *loutput=wchar_to_locale(output);
-		dprintf(DP_HELP, "PRIVMSG %s :You mean \"%s\"? OK, I'll try...\n", channel, loutput);
-		nfree(loutput);
-		del_all_phrases(phrase);
-		trimdictionary();
-	} else {
-		dprintf(DP_HELP, "PRIVMSG %s :There is no way that I am going to forget about that, sorry.\n", channel);
+	start_wakepipe();
+	worker_quit = FALSE;
+	// the worker must never be the one to catch the bot's signals
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	worker_running = (pthread_create(&worker, NULL, reply_worker, NULL) == 0);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(!worker_running) {
+		stop_wakepipe();
+		putlog(LOG_MISC, "*", "MegaHAL: unable to start the reply thread, replies will be made on the main loop");
 	}
-
-	nfree(wtext);
-	return 0;
 }
 
-// finds the closest matching phrase in the model to some text if (possible)
-static int find_phrase(wchar_t *text, bool *found)
+// stops the worker once it is done with the reply in hand, then learns and drops whatever is left over
+static void stop_worker(void)
 {
-	register int i, j, k;
-	int maxSize = 500;
-	BYTE2 symbols[maxSize];
-	BYTE2 symbol;
-	int size = 0, highmatch = 0, count = 0, phrase = 0;
-	bool flag = TRUE;
+	REPLYJOB *job;
 
 	Context;
-	upper(text);
-	make_words(text, words);
-	if(words->size == 0)
-		return 0;
-
-	// create an array of unique symbols
-	// make sure the words exist in the main dictionary already and that they arent repeated
-	// we compress repeated symbols for two reasons: 1. so that we dont find repeated matches later
-	// 2. in case some parts of the phrase were repeated by the bot and the user tries to make it forget that
-
-	for(i=0; i<words->size; i++) {
-		if(!(symbol = find_word(model->dictionary, words->entry[i])))
-			continue;
-		// minimum 2 letters in each word
-		if(model->dictionary->entry[symbol].length < 2)
-			continue;
-		flag = TRUE;
-		for(j=0; j<size; j++)
-			if(symbols[j] == symbol)
-				flag = FALSE;
-		if(size >= maxSize)
-			flag = FALSE;
-		if(flag)
-			symbols[size++] = symbol;
+	if(worker_running) {
+		pthread_mutex_lock(&queue_lock);
+		worker_quit = TRUE;
+		pthread_cond_signal(&queue_cond);
+		pthread_mutex_unlock(&queue_lock);
+		pthread_join(worker, NULL);
+		worker_running = FALSE;
+		stop_wakepipe();
 	}
+	drain_learning();
+	while((job = pending) != NULL) {
+		pending = job->next;
+		free_replyjob(job);
+	}
+	while((job = finished) != NULL) {
+		finished = job->next;
+		free_replyjob(job);
+	}
+	log_messages();
+}
 
-	// now we try to find the closest match in our existing phrases
-	for(i=0; i<model->phrasecount; i++) {
-
-		// check that its at least a third of the size of the phrase or else even tiny phrases can match many repeated symbols in a long one
-		if(size < ((model->phrase[i][0]-1)/3))
-			continue;
+#endif
 
-		count = 0;
-		for(j=1; j<model->phrase[i][0]-1; j++)
-			for(k=0; k<size; k++)
-				if(symbols[k] == model->phrase[i][j])
-					count++;
-		// check minimum length
-		if(count < model->order)
-			continue;
-		// check that it matches at least a third of the phrase
-		if(count < ((model->phrase[i][0]-1)/3))
-			continue;
+// called every second from the main loop: reaps a finished background save, sends the finished replies and learns what was put aside
+static void megahal_secondly()
+{
+	int status;
+	pid_t pid;
 
-		// compare to previous matches
-		if(count > highmatch) {
-			highmatch = count;
-			phrase = i;
+	Context;
+	if(saver > 0) {
+		pid = waitpid(saver, &status, WNOHANG);
+		if(pid == saver) {
+			saver_done(status);
+		} else if(pid < 0 && errno != EINTR) {
+			// something else in the bot reaped it first, so all we can tell is that it is done
+			saver = 0;
+			restartsave = FALSE;
+			putlog(LOG_MISC, "*", "Brain save finished");
 		}
 	}
 
-	if(highmatch == 0)  {
-		*found = FALSE;
-		return 0;
-	} else {
-		*found = TRUE;
-		return phrase;
+#ifdef MEGAHAL_THREADS
+	send_finished();
+	if(pthread_mutex_trylock(&model_lock) == 0) {
+		drain_learning();
+		do_wanted();
+		learn_slice();
+		sync_journal();
+		compact_journal();
+		UNLOCK_MODEL();
 	}
+#else
+	do_wanted();
+	learn_slice();
+	sync_journal();
+	compact_journal();
+#endif
 }
 
-static int pub_forgetword(char *nick, char *host, char *hand, char *channel, char *text)
+// does the trimbrain and savebrain that were asked for while a reply had the model, and saves again for a restart_journal() whose save failed - the caller holds the model
+static void do_wanted()
 {
-	register int i, j;
-	BYTE2 symbol;
-	int num=0;
-	bool flag;
-	DICTIONARY *words=NULL;
-	wchar_t *wtext=NULL;
-
-	if(!text[0])
-		return 0;
-
 	Context;
-	setlocale(LC_ALL, "");
-	wtext=locale_to_wchar(text);
-	putlog(LOG_MISC, "*", "forget %s by %s", text, hand);
-	words=new_dictionary();
-	upper(wtext);
-	make_words(wtext, words);
-	if(!(symbol = find_word(model->dictionary, words->entry[0]))) {
-		dprintf(DP_HELP, "PRIVMSG %s :I am not familiar with that word.\n", channel);
-		nfree(wtext);
-		return 0;
+	if(restartwanted && saver <= 0) {
+		restartwanted = FALSE;
+		putlog(LOG_MISC, "*", "Saving brain again, the journal has nothing on disk to follow on from...");
+		restart_now();
 	}
-
-	for(i=model->phrasecount-1; i>=0; i--) {
-		flag = FALSE;
-		for(j=1; j<=model->phrase[i][0]; j++)
-			if(model->phrase[i][j] == symbol)
-				flag = TRUE;
-		if(flag) {
-			del_phrase(i);
-			num++;
-		}
+	if(trimwanted >= 0) {
+		trimbrain(trimwanted);
+		trimwanted = -1;
+		putlog(LOG_MISC, "*", "Brain trimmed");
+	}
+	if(savewanted && saver <= 0) {
+		savewanted = FALSE;
+		save_now(FALSE);
 	}
-	trimdictionary();
-	capitalize(wtext);
-	char *lwtext=wchar_to_locale(wtext);
-	dprintf(DP_HELP, "PRIVMSG %s :%s has been mentioned to me %d times in the past. But it's all forgotten now.\n", channel, lwtext, num);
-	nfree(lwtext);
-	free_dictionary(words);
-	nfree(wtext);
-	return 0;
 }
 
-// deletes all phrases that are identical to the specified one (phrases can be entered twice, upping the counters)
-static void del_all_phrases(int phrase)
+// learns batches of the file learnfile is on until the slice of time is up, and logs how far it has got - the caller holds the model
+static void learn_slice()
 {
-	register int i, j;
-	bool flag;
+	long long deadline;
 
 	Context;
-	for(i=model->phrasecount-1; i>=0; i--) {
-		if(model->phrase[i][0] != model->phrase[phrase][0])
-			continue;
-		if(i == phrase)
-			continue;
-		flag = TRUE;
-		for(j=1; j<=model->phrase[i][0]; j++)
-			if(model->phrase[i][j] != model->phrase[phrase][j])
-				flag = FALSE;
-		if(flag) {
-			del_phrase(i);
-			if(i<phrase)
-				phrase--;
+	if(learning == NULL)
+		return;
+	// a batch the last slice ran out of time on is finished before the next is read
+	deadline = usec_now()+TRAIN_SLICE;
+	while(learn_batch(learning, model, deadline) && usec_now() < deadline) {
+		if(read_batch(learning) == 0) {
+			putlog(LOG_MISC, "*", "Learned file: %s (%ld lines)", learning->name, learning->lines);
+			stop_training(learning);
+			learning = NULL;
+			return;
 		}
 	}
-	del_phrase(phrase);
+	if(now-learnlogged >= 30) {
+		learnlogged = now;
+		putlog(LOG_MISC, "*", "Learning file: %s, %d%% (%ld lines)", learning->name, learn_percent(), learning->lines);
+	}
 }
 
-
-static int dcc_megaver(struct userrec *u, int idx, char *text)
+// how much of the file learnfile is on has been read
+static int learn_percent()
 {
-	Context;
-	if(!floodcheck())
-		return 0;
-	dprintf(idx, "MegaHAL module v%s by z0rc, Zev ^Baron^ Toledano and Jason Hutchens\n", VER);
-	return 0;
+	if(learning == NULL || learning->length <= 0)
+		return 100;
+	return (int)(learning->done*100/learning->length);
 }
 
-static int pub_megaver(char *nick, char *host, char *hand, char *channel, char *text)
+// once the journal has grown past journalsize KB, folds it into a new brain in the background - the caller holds the model
+static void compact_journal()
 {
 	Context;
-	if(!floodcheck())
-		return 0;
-	dprintf(DP_HELP, "PRIVMSG %s :MegaHAL module v%s by z0rc, Zev ^Baron^ Toledano and Jason Hutchens\n", channel, VER);
-	return 0;
+	if(saver > 0 || journalsize <= 0 || journal == NULL || ftello(journal) < (off_t)journalsize*1024)
+		return;
+	putlog(LOG_MISC, "*", "Journal passed %d KB, saving brain...", journalsize);
+	if(!save_in_background() && !save_brain())
+		putlog(LOG_MISC, "*", "Brain save failed, the previous files were kept");
 }
 
-
-// returns the amount of nodes/leaves in a tree by recursing through all its branches
-static int recurse_tree(TREE *node)
+// forks a copy of the bot to write the brain; called with the model locked, so the copy is consistent
+static bool save_in_background()
 {
-	int size = 0;
-	register int i;
+	pid_t pid;
 
 	Context;
-	size++;
-	for(i=0; i<node->branch; ++i)
-		size += recurse_tree(node->tree[i]);
-
-	return size;
+	rotate_journal();
+	pid = fork();
+	if(pid == 0) {
+		// the child shares the bot's sockets and logs, so it keeps quiet and leaves without eggdrop's exit handlers
+		quiet = TRUE;
+		_exit(save_model("megahal.brn", model) ? 0 : 1);
+	}
+	if(pid < 0)
+		return FALSE;
+	saver = pid;
+	savedjournal = model->journal;
+	return TRUE;
 }
 
-
-// returns the amount of branches and nodes in a tree
-// if branch is specified it goes to a subbranch of the main 2 TREES
-// forward and backward can be specified too
-static int tcl_treesize STDVAR
+// saves the brain, in the background unless told to wait - the caller holds the model
+static void save_now(bool wait)
 {
-	char s[50];
-	int branch = -1;
-	int backward = 0;
-
 	Context;
-	if(argv[1])
-		branch = atoi(argv[1]);
-	if(argv[2])
-		backward = atoi(argv[2]);
-
-	if(backward) {
-		if((branch < model->backward->branch) && (branch > -1))
-			sprintf(s, "%d %d %d %d", model->backward->tree[branch]->branch, recurse_tree(model->backward->tree[branch]), model->backward->tree[branch]->count, model->backward->tree[branch]->usage);
-		else
-			sprintf(s, "%d %d %d %d", model->backward->branch, recurse_tree(model->backward), model->backward->count, model->backward->usage);
-	} else {
-		if((branch < model->forward->branch) && (branch > -1))
-			sprintf(s, "%d %d %d %d", model->forward->tree[branch]->branch, recurse_tree(model->forward->tree[branch]), model->forward->tree[branch]->count, model->forward->tree[branch]->usage);
+	if(wait || !save_in_background()) {
+		if(save_brain())
+			putlog(LOG_MISC, "*", "Brain saved");
 		else
-			sprintf(s, "%d %d %d %d", model->forward->branch, recurse_tree(model->forward), model->forward->count, model->forward->usage);
+			putlog(LOG_MISC, "*", "Brain save failed, the previous files were kept");
 	}
-
-	Tcl_AppendResult(irp, s, NULL);
-	return TCL_OK;
 }
 
-
-/* The following two functions are just for playing around in the brain and to view branches
-   They're a tad messy but can be used to learn about the brain, debug, etc */
-
-static void recurse_branch(TREE *node)
+// saves a model the journal can't lead to from the brain on disk, such as a rebuilt one, so that learning is journalled again - the caller holds the model
+static void restart_journal()
 {
-	static int level=0;
-	register int i, j, k;
-	int tmp=0;
-	static wchar_t s[10], ss[50] = L"";
-	static bool newl = TRUE;
-	static int length[3];
-
-	Context;
-	if(model->dictionary && (node->symbol < model->dictionary->size)) {
-		if(glob_str[wcslen(glob_str)-1] == L'\n')
-			wcscat(glob_str, ss);
-		wcscat(glob_str, L" ");
-		swprintf(s, 512, L"[%d]", node->symbol);
-		wcscat(glob_str, s);
-		if((int)model->dictionary->entry[node->symbol].word[0] == 31)
-			tmp = 1;
-		else
-			tmp = 0;
-		wcsncat(glob_str, model->dictionary->entry[node->symbol].word+tmp, model->dictionary->entry[node->symbol].length-tmp);
-		swprintf(s, 512, L"(%ld)", node->usage);
-		wcscat(glob_str, s);
-		length[level] = model->dictionary->entry[node->symbol].length+1+wcslen(s);
-	}
-
-	for(i=0; i<node->branch; ++i) {
-		++level;
-		newl = TRUE;
-		recurse_branch(node->tree[i]);
-		--level;
-		if(newl)
-			wcscat(glob_str, L"\n");
-		ss[0] = L'\0';
-		for (j=0; j<=level; j++)
-			for (k=0; k<length[j]; k++)
-				wcscat(ss, L" ");
-		newl = FALSE;
-	}
-}
-
-static int tcl_viewbranch STDVAR
-{
-	int branch = -1;
-	int backward = 0;
-
-	Context;
-	setlocale(LC_ALL, "");
-	if(argv[1])
-		branch = atoi(argv[1]);
-	if(argv[2])
-		backward = atoi(argv[2]);
-	glob_str[0]=L'\0';
-
-	if(backward) {
-		if ((branch > -1) && (branch < model->backward->branch)) {
-			if(model->backward->tree[branch]->branch > 200)
-				swprintf(glob_str, 512, L"Branch is too big");
-			else
-				recurse_branch(model->backward->tree[branch]);
-		} else {
-			if(model->backward->branch > 200)
-				swprintf(glob_str, 512, L"Branch out of range or too big");
-			else
-				recurse_branch(model->backward);
-		}
-	} else {
-		if ((branch > -1) && (branch < model->forward->branch)) {
-			if(model->forward->tree[branch]->branch > 200)
-				swprintf(glob_str, 512, L"Branch is too big");
-			else
-				recurse_branch(model->forward->tree[branch]);
-		} else {
-			if(model->forward->branch > 200)
-				swprintf(glob_str, 512, L"Branch out of range or too big");
-			else
-				recurse_branch(model->forward);
-		}
-	}
-
-	char *lglob = wchar_to_locale(glob_str);
-	Tcl_AppendResult(irp, lglob, NULL);
-	nfree(lglob);
-	return TCL_OK;
-}
-
-
-// reloads and relearns the brain with a new order size
-static int tcl_setmaxcontext STDVAR
-{
-	int neworder;
-
-	Context;
-	neworder = order;
-	if(argv[1])
-		neworder = atoi(argv[1]);
-	if(neworder < 1 || neworder > 5 || neworder == order)
-		return 0;
-
-	order=neworder;
-	reloadphrases();
-	putlog(LOG_MISC, "*", "Brain transferred (order: %d)", order);
-	return TCL_OK;
-}
-
-static int tcl_reloadphrases STDVAR
-{
-	Context;
-	reloadphrases();
-	putlog(LOG_MISC, "*", "Phrases reloaded");
-	return TCL_OK;
-}
-
-static void reloadphrases()
-{
-  char filename[512];
-	Context;
-
-	free_model(model);
-	model = new_model(order);
-
-	snprintf(filename, sizeof(filename), "%s%smegahal.phr", directory_cache, SEP);
-	train(model, filename);
-
-}
-
-static int tcl_learnfile STDVAR
-{
-	char filename[512];
-
-	Context;
-	BADARGS(2, 2, " <filename>");
-
-	snprintf(filename, sizeof(filename), "%s%s%s", directory_resources, SEP, argv[1]);
-	train(model, filename);
-
-	putlog(LOG_MISC, "*", "Learned file: %s", filename);
-	return TCL_OK;
-}
-
-
-/* Note: These are personal notes on the various ways I tried to trim the brain (^Baron^). This will not be of interest to many.
- *
- * To trim a brain one cannot just trim branches at random or older branches because:
- * 1. Branches are usually snippets of phrases and you will be left with nonsensical pieces in the end - but this is not as important as:
- * 2. You could delete all possible endings of a phrase and so the AI gets stuck in a loop trying to find the end! This is pretty straightforward but the next is very tricky:
- * 3. The way the halcontext is used, it is filled up with the other branches that are actually continuations of the
- *    current branch (if any) under another 'context' and since it usually has to use the longest context in order to generate a normal looking reply, it will get
- *    stuck since it can't find the next nearest longest context that will end or continue the sentence (study the reply&babble functions to understand this).
- *    I tried forcing it to use smaller contexts but that just caused tons of gibberish.
- *
- * I also tried trimming by changing the format of the brain so that sentences are always stored with a <BEGIN> marker as the first word in every sentence.
- * This way I knew how to find FULL sentences at least by going to the branch that starts with <BEGIN> and going on from there.
- * Then I used full contexts searches to hop from one branch to the next in order to create a real phrase just as if we were creating a reply to the user.
- * Some branches are hopped onto by random and therefore the sentence will often not be the same as the original that was learned by megahal,
- * but at least we dont leave behind scraps of sentences or incomplete contexts.
- *
- * This wasn't enough however because of a very tricky case: There are sentences that repeat themselves in the middle and therefore we may
- * branch off to the latter part of the sentence while trying to create a sentence and then leave the middle snippets behind and cause other
- * unexpected bugs and problems. For example, an even worse case scenario is that we will REPEAT the same snippet twice because we find
- * ourselves back in the same context a few times. This will even cause null pointer exceptions, etc.
- *
- * So in the end I changed the brain again so that it keeps track of phrases as soon as it learns them and stores them together with the model.
- * We can't go wrong like this if we delete the EXACT original sentence.
- */
-
-static int tcl_trimbrain STDVAR
-{
-	int newsize;
-	register int i;
-
-	Context;
-	putlog(LOG_MISC, "*", "Trimming brain...");
-	newsize = maxsize;
-	// get the size we are aiming for
-	if(argv[1])
-		newsize = atoi(argv[1]);
-
-	while(newsize < (recurse_tree(model->backward) + recurse_tree(model->forward)) && (model->phrasecount > 0)) {
-		// do 25 a time so we dont have too many loops and size checks going on
-		for (i=0; i<25; i++) {
-			if(model->phrasecount < 1)
-				break;
-			del_phrase(0);
-		}
-	}
-
-	trimdictionary();
-	putlog(LOG_MISC, "*", "Brain trimmed");
-	return TCL_OK;
-}
-
-
-// deletes a phrase from the model using all its contexts, decrementing counters or deleting branches where necessary
-static void del_phrase(int phrase)
-{
-	bool fnd = FALSE;
-	register int j, k;
-	BYTE2 size;
-
-	Context;
-	if (phrase >= model->phrasecount) return;
-	size = model->phrase[phrase][0];
-
-	// go through the words/symbols and start trimming sets of context branches one symbol at a time
-	for (j=1; j<=size; j++) {
-		initialize_context(model);
-
-		// build the context using the next batch of symbols
-		model->halcontext[0] = model->forward->tree[search_node(model->forward, model->phrase[phrase][j], &fnd)];
-		for (k=1; k<=model->order; k++) {
-			if ((k+j) > size)
-				break;
-			model->halcontext[k] = model->halcontext[k-1]->tree[search_node(model->halcontext[k-1], model->phrase[phrase][j+k], &fnd)];
-		}
-
-		// now decrement the usage and delete unused branches - must go backwards in case branches are erased
-		for (k=model->order; k>0; k--)
-			decrement_tree(model->halcontext[k], model->halcontext[k-1]);
-		decrement_tree(model->halcontext[0], model->forward);
-	}
-
-
-	// start the trimming in the backwards tree
-	// first move the <FIN> symbol to the other side because we are going backwards now
-	for (j=size; j>1; j--)
-		model->phrase[phrase][j] = model->phrase[phrase][j-1];
-	model->phrase[phrase][1] = 1;
-
-	for (j=size; j>0; j--) {
-		initialize_context(model);
-
-		model->halcontext[0] = model->backward->tree[search_node(model->backward, model->phrase[phrase][j], &fnd)];
-		for (k=1; k<=model->order; k++) {
-			if (k>j-1) break;
-			model->halcontext[k] = model->halcontext[k-1]->tree[search_node(model->halcontext[k-1], model->phrase[phrase][j-k], &fnd)];
-		}
-
-		for (k=model->order; k>0; k--)
-			decrement_tree(model->halcontext[k], model->halcontext[k-1]);
-		decrement_tree(model->halcontext[0], model->backward);
-	}
-
-/*	// move the symbol back again
-	for (j=1; j<size; j++)
-		model->phrase[phrase][j] = model->phrase[phrase][j+1];
-	model->phrase[phrase][size] = 1;
-*/
-	// remove the phrase from the model
-	nfree(model->phrase[phrase]);
-	for(j=phrase; j<model->phrasecount; j++)
-		model->phrase[j] = model->phrase[j+1];
-	model->phrasecount--;
-	if(realloc_phrase(model) == NULL) {
-		error("del_phrase", "Unable to reallocate phrase");
-		return;
-	}
-
-}
-
-// this decrements the usage and count counters in a branch and deletes branches that arent used anymore
-static void decrement_tree(TREE *node, TREE *parent)
-{
-	register int i;
-	int position;
-	bool fnd;
-
-	Context;
-	if(node == NULL || parent == NULL)
-		return;
-
-	position = search_node(parent, node->symbol, &fnd);
-	--parent->usage;
-	if(--node->count < 1) {
-		free_tree(node);
-		for(i=position; i<parent->branch-1; i++)
-			parent->tree[i] = parent->tree[i+1];
-		--parent->branch;
-		realloc_tree(parent);
-	}
-}
-
-// tries to find words in the main dictionary that arent being used in the model anymore and deletes them and updates everything thats necessary
-static void trimdictionary()
-{
-	register int i, j, k;
-	int tmp = 0, tmp2 = 0, smallest = model->dictionary->size;
-	int *syms = NULL;
-
-	Context;
-	/* First find words that arent being used in the dictionary, mark them with NULL
-	   but dont remove them yet because the symbols will shift down and we wont be able to search properly for the rest!
-	   Also mark the references in the dictionary index to these words with a unique high number but dont remove yet because the order is different there
-	   we need a separate loop to remove them */
-	syms = (int *)nmalloc(sizeof(int)*1);
-	for(i=0; i<model->dictionary->size; ++i) { // must iterate over index
-		if (model->dictionary->index[i]==0 || model->dictionary->index[i]==1)
-			continue; // skip default words created when dic init?
-		if ((find_symbol(model->forward, model->dictionary->index[i]) == NULL) && (find_symbol(model->backward, model->dictionary->index[i]) == NULL)) { // symbol
-			free_word(model->dictionary->entry[model->dictionary->index[i]]);  // symbol
-			model->dictionary->entry[model->dictionary->index[i]].word = NULL; // symbol
-			if(tmp>0)
-				syms = (int *)nrealloc((int *)(syms), sizeof(int)*(tmp+1));
-			syms[tmp] = model->dictionary->index[i];
-			smallest = MIN(model->dictionary->index[i], smallest);
-			model->dictionary->index[i] = model->dictionary->size; // index!
-			tmp++;
-		}
-	}
-
-	// only if there is anything to trim:
-	if(tmp) {
-		/* change all references to words/symbols that were located above the deleted entries
-		   this includes the model branches and the index and the phrases!
-		   Do this according to the smallest entry and decreasing anything above it by the amount of entries */
-		recurse_tree_and_decrement_symbols(model->forward, smallest, tmp, syms);
-		recurse_tree_and_decrement_symbols(model->backward, smallest, tmp, syms);
-
-		for(j=0; j<model->dictionary->size; ++j) //  // iterate over index
-			if ((model->dictionary->index[j] > smallest) && (model->dictionary->index[j] != model->dictionary->size))
-				model->dictionary->index[j] -= amount_bigger_than(syms, tmp, model->dictionary->index[j]);
-
-		for(j=0; j<model->phrasecount; ++j)
-			for(k=1; k<=model->phrase[j][0]; ++k)
-				if(model->phrase[j][k] > smallest)
-					model->phrase[j][k] -= amount_bigger_than(syms, tmp, model->phrase[j][k]);
-
-		// now is a safe time to actually remove the dictionary entries as well (shift them all down)
-		tmp2 = 0;
-		for(i=0; i<model->dictionary->size; ++i) {
-			if(model->dictionary->entry[i].word == NULL) {
-				tmp2++;
-				continue;
-			}
-			if(tmp2 == 0) continue;
-			model->dictionary->entry[i-tmp2] = model->dictionary->entry[i];
-		}
-
-		// next, shift all the index entries down to replace the empty ones
-		tmp2 = 0;
-		for(i=0; i<model->dictionary->size; ++i) {
-			if(model->dictionary->index[i] == model->dictionary->size) {
-				tmp2++;
-				continue;
-			}
-			if(tmp2 == 0) continue;
-			model->dictionary->index[i-tmp2] = model->dictionary->index[i];
-		}
-
-		// resize the dictionary and reallocate the mem
-		model->dictionary->size -= tmp;
-		if(realloc_dictionary(model->dictionary) == NULL) {
-			error("trimdictionary", "Unable to reallocate dictionary.");
-			nfree(syms);
-			return;
-		}
-	}
-	nfree(syms);
-}
-
-static int amount_bigger_than(int *syms, int size, int sym)
-{
-	register int i, j=0;
-
-	Context;
-	for(i=0; i<size; i++)
-		if(sym > syms[i])
-			j++;
-
-	return j;
-}
-
-/* This recurses through the model and decrements the symbols that are above the specified symbol
-   used when an entry in the dictionary is deleted and everything is shifted down for example. */
-static void recurse_tree_and_decrement_symbols(TREE *node, int smallestsymbol, int amount, int *syms)
-{
-	register int i;
-
-	Context;
-	if (node->symbol > smallestsymbol) {
-		node->symbol -= amount_bigger_than(syms, amount, node->symbol);
-}
-	for(i=0; i<node->branch; ++i)
-		recurse_tree_and_decrement_symbols(node->tree[i], smallestsymbol, amount, syms);
-}
-
-static int tcl_savebrain STDVAR
-{
-	Context;
-	putlog(LOG_MISC, "*", "Saving brain...");
-	save_model("megahal.brn", model);
-	return TCL_OK;
-}
-
-static int tcl_reloadbrain STDVAR
-{
-	Context;
-	setlocale(LC_ALL, "");
-	char *resources = argc >= 2 ? argv[1] : NULL;
-	char *cache = argc >= 3 ? argv[2] : NULL;
-	change_personality(&model, resources, cache);
-	putlog(LOG_MISC, "*", "Brain reloaded");
-	return TCL_OK;
-}
-
-static int tcl_setmegabotnick STDVAR
-{
-	Context;
-	setlocale(LC_ALL, "");
-	BADARGS(2, 2, " <botnick>");
-	wcscpy(mbotnick,locale_to_wchar(argv[1]));
-	mystrlwr(mbotnick);
-	return TCL_OK;
-}
-
-static int tcl_learningmode STDVAR
-{
-	Context;
-	BADARGS(2, 2, " on/off");
-	if (!strcasecmp(argv[1], "off")) {
-		learningmode = FALSE;
-		putlog(LOG_MISC, "*", "Brain learning mode set to off");
-	} else {
-		learningmode = TRUE;
-		putlog(LOG_MISC, "*", "Brain learning mode set to on");
-	}
-	return TCL_OK;
-}
-
-static int tcl_talkfrequency STDVAR
-{
-	Context;
-	BADARGS(2, 2, " <#oflines>");
-	if (argv[1]) {
-		talkfrequency = atoi(argv[1]);
-		putlog(LOG_MISC, "*", "Talk frequency set to %d", atoi(argv[1]));
-	}
-	return 0;
-}
-
-static DICTIONARY *realloc_dictionary(DICTIONARY *dictionary)
-{
-	Context;
-	if(dictionary->index == NULL)
-		dictionary->index = (BYTE2 *)nmalloc(sizeof(BYTE2)*(dictionary->size));
-	else
-		dictionary->index = (BYTE2 *)nrealloc((BYTE2 *)(dictionary->index),sizeof(BYTE2)*(dictionary->size));
-
-	if(dictionary->index == NULL)
-		return NULL;
-
-	if(dictionary->entry == NULL)
-		dictionary->entry = (STRING *)nmalloc(sizeof(STRING)*(dictionary->size));
-	else
-		dictionary->entry = (STRING *)nrealloc((STRING *)(dictionary->entry),sizeof(STRING)*(dictionary->size));
-	if(dictionary->entry == NULL)
-		return NULL;
-
-	return dictionary;
-}
-
-static TREE *realloc_tree(TREE *tree)
-{
-	Context;
-	if(tree->branch == 0 && tree->tree != NULL) {
-		nfree(tree->tree);
-		tree->tree = NULL;
-	} else if(tree->tree == NULL)
-		tree->tree = (TREE **)nmalloc(sizeof(TREE *)*(tree->branch));
-	else
-		tree->tree = (TREE **)nrealloc((TREE **)(tree->tree),sizeof(TREE *)*(tree->branch));
-
-	if(tree->tree == NULL)
-		return NULL;
-
-	return tree;
-}
-
-static BYTE2 **realloc_phrase(MODEL *model)
-{
-	Context;
-	if(model->phrasecount == 0 && model->phrase != NULL) {
-		nfree(model->phrase);
-		model->phrase = NULL;
-	} else if(model->phrase == NULL) {
-		model->phrase = (BYTE2 **)nmalloc(sizeof(BYTE2 *)*(model->phrasecount));
-	} else {
-		model->phrase = (BYTE2 **)nrealloc((BYTE2 **)(model->phrase),sizeof(BYTE2 *)*(model->phrasecount));
-	}
-
-	if(model->phrase == NULL) {
-		return NULL;
-	}
-
-	return model->phrase;
-
-}
-
-static bool isrepeating(DICTIONARY *replywords)
-{
-	register int i, j, k;
-	bool same;
-
-	Context;
-	if (replywords->size <= model->order*2+1)
-		return FALSE;
-
-	for (i=model->order+1; i<replywords->size-model->order; i++) {
-		for (j=0; j<i-model->order; j++) {
-			same = TRUE;
-			for (k=0; k<=model->order; k++) {
-				if (wordcmp(replywords->entry[i+k], replywords->entry[j+k]) != 0) {
-					same = FALSE;
-					break;
-				}
-			}
-			if (same)
-				return TRUE;
-		}
-	}
-
-	return FALSE;
-}
-
-static void strip_codes(wchar_t *text)
-{
-	wchar_t *dd = text;
-
-	Context;
-	while (*text) {
-		switch (*text) {
-		case 2:						/* Bold text */
-			text++;
-			continue;
-		case 3:						/* mIRC colors? */
-			if (iswdigit(text[1])) {		/* Is the first wchar_t a number? */
-				text += 2;			/* Skip over the ^C and the first digit */
-				if (iswdigit(*text))
-					text++;			/* Is this a double digit number? */
-				if (*text == L',') {		/* Do we have a background color next? */
-					if (iswdigit(text[1]))
-						text += 2;	/* Skip over the first background digit */
-					if (iswdigit(*text))
-						text++;		/* Is it a double digit? */
-				}
-			} else
-				text++;
-			continue;
-		case 7:
-			text++;
-			continue;
-		case 0x16:					/* Reverse video */
-			text++;
-			continue;
-		case 0x1f:					/* Underlined text */
-			text++;
-			continue;
-		case 033:
-			text++;
-			if (*text == L'[') {
-				text++;
-				while ((*text == L';') || iswdigit(*text))
-					text++;
-				if (*text)
-					text++;			/* also kill the following char */
-			}
-			continue;
-		}
-		*dd++ = *text++;				/* Move on to the next char */
-	}
-	*dd = 0;
-}
-
-static bool isinprevs(DICTIONARY *words)
-{
-	Context;
-	if (dissimilar2(words, prev1) && dissimilar2(words, prev2) && dissimilar2(words, prev3) &&
-	    dissimilar2(words, prev4) && dissimilar2(words, prev5))
-		return FALSE;
-	return TRUE;
-}
-
-static bool dissimilar2(DICTIONARY *words1, DICTIONARY *words2)
-{
-	register int i, j;
-	int count = 0;
-
-	Context;
-	for(i=0; i<words1->size; ++i) {
-		for(j=0; j<words2->size; ++j) {
-			if(wordcmp(words1->entry[i], words2->entry[j])==0) {
-				count++;
-				break;
-			}
-		}
-	}
-	if (count>(words1->size/4*3))
-		return FALSE;
-	return TRUE;
-}
-
-static void updateprevs(wchar_t *words)
-{
-	Context;
-	free_words(prev1);
-	free_dictionary(prev1);
-	nfree(prev1);
-
-	prev1 = prev2;
-	prev2 = prev3;
-	prev3 = prev4;
-	prev4 = prev5;
-
-	prev5 = new_dictionary();
-	make_words(words, prev5);
-}
-
-/*
- * The remainder of this code was just pasted from the rest of megahal.c, and
- * modified where necessary to get messages put in the right place, etc.
- */
-
-/*---------------------------------------------------------------------------*/
-/*
- *	Function:	Error
- *
- *	Purpose:	Print the specified message to the error file.
- */
-static void error(char *title, char *fmt, ...)
-{
-	va_list argp;
-	char stuff[512];
-
-	Context;
-	sprintf(stuff, "%s: ", title);
-	va_start(argp, fmt);
-	vsprintf(stuff, fmt, argp);
-	va_end(argp);
-	sprintf(stuff, ".\n");
-	putlog(LOG_MISC, "*", "%s", stuff);
-
-	/* FIXME - I think I need to die here */
-}
-
-/*---------------------------------------------------------------------------*/
-
-static bool warn(char *title, char *fmt, ...)
-{
-	va_list argp;
-	char stuff[512];
-
-	Context;
-	sprintf(stuff, "%s: ", title);
-	va_start(argp, fmt);
-	vsprintf(stuff, fmt, argp);
-	va_end(argp);
-	sprintf(stuff, ".\n");
-	putlog(LOG_MISC, "*", "%s", stuff);
-	return TRUE;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Capitalize
- *
- *	Purpose:	Convert a string to look nice.
- */
-static void capitalize(wchar_t *string)
-{
-	register size_t i;
-	bool start = TRUE;
-
-	Context;
-	for(i=0; i<wcslen(string); ++i) {
-		if(iswalpha(string[i])) {
-			if(start == TRUE)
-				string[i] = (wchar_t)towupper(string[i]);
-			else
-				string[i] = (wchar_t)towlower(string[i]);
-			start = FALSE;
-		}
-		if((i>2)&&(wcschr(L"!.?", string[i-1])!=NULL)&&(iswspace(string[i])))
-			start = TRUE;
-	}
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Upper
- *
- *	Purpose:	Convert a string to its uppercase representation.
- */
-static void upper(wchar_t *string)
-{
-	register size_t i;
-
-	Context;
-	for(i=0; i<wcslen(string); ++i)
-		string[i] = (wchar_t)towupper(string[i]);
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Add_Word
- *
- *	Purpose:	Add a word to a dictionary, and return the identifier
- *			assigned to the word.  If the word already exists in
- *			the dictionary, then return its current identifier
- *			without adding it again.
- */
-static BYTE2 add_word(DICTIONARY *dictionary, STRING word)
-{
-	register int i;
-	int position;
-	bool found;
-
-	Context;
-	/*
-	 *	If the word's already in the dictionary, there is no need to add it
-	 */
-	position = search_dictionary(dictionary, word, &found);
-	if(found == TRUE)
-		goto succeed;
-
-	/*
-	 *	Increase the number of words in the dictionary
-	 */
-	dictionary->size += 1;
-
-	/*
-	 *	Allocate one more entry for the word index
-	 */
-	if(realloc_dictionary(dictionary) == NULL) {
-		error("add_word", "Unable to reallocate the dictionary.");
-		goto fail;
-	}
-
-	/*
-	 *	Copy the new word into the word array
-	 */
-	dictionary->entry[dictionary->size-1].length = word.length;
-	dictionary->entry[dictionary->size-1].word = (wchar_t *)nmalloc(sizeof(wchar_t)*(word.length));
-	if(dictionary->entry[dictionary->size-1].word == NULL) {
-		error("add_word", "Unable to allocate the word.");
-		goto fail;
-	}
-	for(i=0; i<word.length; ++i)
-		dictionary->entry[dictionary->size-1].word[i] = word.word[i];
-
-	/*
-	 *	Shuffle the word index to keep it sorted alphabetically
-	 */
-	for(i=(dictionary->size-1); i>position; --i)
-		dictionary->index[i] = dictionary->index[i-1];
-
-	/*
-	 *	Copy the new symbol identifier into the word index
-	 */
-	dictionary->index[position] = dictionary->size-1;
-
-succeed:
-	return dictionary->index[position];
-
-fail:
-	return 0;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Search_Dictionary
- *
- *	Purpose:	Search the dictionary for the specified word, returning its
- *			position in the index if found, or the position where it
- *			should be inserted otherwise.
- */
-static int search_dictionary(DICTIONARY *dictionary, STRING word, bool *find)
-{
-	int position;
-	int min;
-	int max;
-	int middle;
-	int compar;
-
-	Context;
-	/*
-	 *	If the dictionary is empty, then obviously the word won't be found
-	 */
-	if(dictionary->size == 0) {
-		position = 0;
-		goto notfound;
-	}
-
-	/*
-	 *	Initialize the lower and upper bounds of the search
-	 */
-	min = 0;
-	max = dictionary->size-1;
-	/*
-	 *	Search repeatedly, halving the search space each time, until either
-	 *	the entry is found, or the search space becomes empty
-	 */
-	while(TRUE) {
-		/*
-		 *	See whether the middle element of the search space is greater
-		 *	than, equal to, or less than the element being searched for.
-		 */
-		middle = (min+max)/2;
-		compar = wordcmp(word, dictionary->entry[dictionary->index[middle]]);
-		/*
-		 *	If it is equal then we have found the element.  Otherwise we
-		 *	can halve the search space accordingly.
-		 */
-		if(compar == 0) {
-			position = middle;
-			goto found;
-		} else if(compar > 0) {
-			if(max == middle) {
-				position = middle+1;
-				goto notfound;
-			}
-			min = middle+1;
-		} else {
-			if(min == middle) {
-				position = middle;
-				goto notfound;
-			}
-			max = middle-1;
-		}
-	}
-
-found:
-	*find=TRUE;
-	return position;
-
-notfound:
-	*find=FALSE;
-	return position;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Find_Word
- *
- *	Purpose:	Return the symbol corresponding to the word specified.
- *			We assume that the word with index zero is equal to a
- *			NULL word, indicating an error condition.
- */
-static BYTE2 find_word(DICTIONARY *dictionary, STRING word)
-{
-	int position;
-	bool found;
-
-	Context;
-	position = search_dictionary(dictionary, word, &found);
-
-	if(found == TRUE)
-		return dictionary->index[position];
-	else
-		return 0;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Wordcmp
- *
- *	Purpose:	Compare two words, and return an integer indicating whether
- *			the first word is less than, equal to or greater than the
- *			second word.
- */
-static int wordcmp(STRING word1, STRING word2)
-{
-	register int i;
-	int bound;
-
-	bound = MIN(word1.length,word2.length);
-
-	for(i=0; i<bound; ++i)
-		if(towupper(word1.word[i])!=towupper(word2.word[i]))
-			return (int)(towupper(word1.word[i])-towupper(word2.word[i]));
-
-	if(word1.length<word2.length)
-		return -1;
-	if(word1.length>word2.length)
-		return 1;
-
-	return 0;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Wordcmp
- *
- *	Purpose:	Compare two words, and return an integer indicating whether
- *			the first word is less than, equal to or greater than the
- *			second word.
- */
-static int wordcmp2(STRING word1, wchar_t *word2)
-{
-	register int i;
-	int bound, length2;
-
-	length2 = wcslen(word2);
-	bound = MIN(word1.length,length2);
-
-	for(i=0; i<bound; ++i)
-		if(towupper(word1.word[i])!=towupper(word2[i]))
-			return (int)(towupper(word1.word[i])-towupper(word2[i]));
-
-	if(word1.length<length2)
-		return -1;
-	if(word1.length>length2)
-		return 1;
-
-	return 0;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Free_Dictionary
- *
- *	Purpose:	Release the memory consumed by the dictionary.
- */
-static void free_dictionary(DICTIONARY *dictionary)
-{
-	Context;
-	if(dictionary == NULL)
-		return;
-	if(dictionary->entry != NULL) {
-		nfree(dictionary->entry);
-		dictionary->entry = NULL;
-	}
-	if(dictionary->index != NULL) {
-		nfree(dictionary->index);
-		dictionary->index = NULL;
-	}
-	dictionary->size = 0;
-}
-
-/*---------------------------------------------------------------------------*/
-
-static void free_model(MODEL *model)
-{
-	register int i;
-
-	Context;
-	if(model == NULL)
-		return;
-	if(model->forward != NULL) {
-		free_tree(model->forward);
-	}
-	if(model->backward != NULL) {
-		free_tree(model->backward);
-	}
-	if(model->halcontext != NULL) {
-		nfree(model->halcontext);
-	}
-	for (i=0; i<model->phrasecount; i++)
-		nfree(model->phrase[i]);
-	if(model->phrase != NULL)
-		nfree(model->phrase);
-	if(model->dictionary != NULL) {
-		free_words(model->dictionary);
-		free_dictionary(model->dictionary);
-		nfree(model->dictionary);
-	}
-	nfree(model);
-}
-
-/*---------------------------------------------------------------------------*/
-
-static void free_tree(TREE *tree)
-{
-	static int level = 0;
-	register int i;
-
-	Context;
-	if(tree == NULL)
-		return;
-
-	if(tree->tree!=NULL) {
-		for(i=0; i<tree->branch; ++i) {
-			++level;
-			free_tree(tree->tree[i]);
-			--level;
-		}
-		nfree(tree->tree);
-	}
-	nfree(tree);
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Initialize_Dictionary
- *
- *	Purpose:	Add dummy words to the dictionary.
- */
-static void initialize_dictionary(DICTIONARY *dictionary)
-{
-	STRING word = { 12, L"<BRAINSTART>" };
-	STRING end = { 5, L"<FIN>" };
-
-	Context;
-	(void)add_word(dictionary, word);
-	(void)add_word(dictionary, end);
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	New_Dictionary
- *
- *	Purpose:	Allocate room for a new dictionary.
- */
-static DICTIONARY *new_dictionary(void)
-{
-	DICTIONARY *dictionary = NULL;
-
-	Context;
-	dictionary = (DICTIONARY *)nmalloc(sizeof(DICTIONARY));
-	if(dictionary == NULL) {
-		error("new_dictionary", "Unable to allocate dictionary.");
-		return NULL;
-	}
-
-	dictionary->size = 0;
-	dictionary->index = NULL;
-	dictionary->entry = NULL;
-
-	return dictionary;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Save_Dictionary
- *
- *	Purpose:	Save a dictionary to the specified file.
- */
-static void save_dictionary(FILE *file, DICTIONARY *dictionary)
-{
-	register int i;
-
-	Context;
-	fwrite(&(dictionary->size), sizeof(BYTE4), 1, file);
-	for(i=0; i<dictionary->size; ++i)
-		save_word(file, dictionary->entry[i]);
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Load_Dictionary
- *
- *	Purpose:	Load a dictionary from the specified file.
- */
-static void load_dictionary(FILE *file, DICTIONARY *dictionary)
-{
-	register int i;
-	int size;
-
-	Context;
-	if ( fread(&size, sizeof(BYTE4), 1, file) ) {
-		for(i=0; i<size; ++i) {
-			load_word(file, dictionary);
-		}
-	}
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Save_Word
- *
- *	Purpose:	Save a dictionary word to a file.
- */
-static void save_word(FILE *file, STRING word)
-{
-	register int i;
-
-	Context;
-	fwrite(&(word.length), sizeof(BYTE1), 1, file);
-	for(i=0; i<word.length; ++i)
-		fwrite(&(word.word[i]), sizeof(wchar_t), 1, file);
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Load_Word
- *
- *	Purpose:	Load a dictionary word from a file.
- */
-static void load_word(FILE *file, DICTIONARY *dictionary)
-{
-	register int i;
-	STRING word;
-
-	Context;
-	if ( fread(&(word.length), sizeof(BYTE1), 1, file) ) {
-		word.word = (wchar_t *)nmalloc(sizeof(wchar_t)*word.length);
-		if(word.word == NULL) {
-			error("load_word", "Unable to allocate word");
-			return;
-		}
-		for(i=0; i<word.length; ++i) {
-			if (!fread(&(word.word[i]), sizeof(wchar_t), 1, file) ) {
-				break;
-			}
-		}
-		add_word(dictionary, word);
-		nfree(word.word);
-	}
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	New_Node
- *
- *	Purpose:	Allocate a new node for the n-gram tree, and initialise
- *			its contents to sensible values.
- */
-static TREE *new_node(void)
-{
-	TREE *node = NULL;
-
-	Context;
-	/*
-	 *	Allocate memory for the new node
-	 */
-	node = (TREE *)nmalloc(sizeof(TREE));
-	if(node == NULL) {
-		error("new_node", "Unable to allocate the node.");
-		goto fail;
-	}
-
-	/*
-	 *	Initialise the contents of the node
-	 */
-	node->symbol = 0;
-	node->usage = 0;
-	node->count = 0;
-	node->branch = 0;
-	node->tree = NULL;
-
-	return node;
-
-fail:
-	if(node != NULL)
-		nfree(node);
-	return NULL;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	New_Model
- *
- *	Purpose:	Create and initialise a new ngram model.
- */
-static MODEL *new_model(int order)
-{
-	MODEL *model = NULL;
-
-	Context;
-	model = (MODEL *)nmalloc(sizeof(MODEL));
-	if(model == NULL) {
-		error("new_model", "Unable to allocate model.");
-		goto fail;
-	}
-
-	model->order = order;
-	model->forward = new_node();
-	model->backward = new_node();
-	model->halcontext = (TREE **)nmalloc(sizeof(TREE *)*(order+2));
-	if(model->halcontext == NULL) {
-		error("new_model", "Unable to allocate context array.");
-		goto fail;
-	}
-	initialize_context(model);
-	model->phrasecount = 0;
-	model->phrase = NULL;
-	model->dictionary = new_dictionary();
-	initialize_dictionary(model->dictionary);
-
-	return model;
-
-fail:
-	return NULL;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Update_Model
- *
- *	Purpose:	Update the model with the specified symbol.
- */
-static void update_model(MODEL *model, int symbol)
-{
-	register int i;
-
-	Context;
-	/*
-	 *	Update all of the models in the current context with the specified
-	 *	symbol.
-	 */
-
-	// add the symbol to all contexts - some may be at different levels deep and there may be max [order] different branches being built at once
-	// Question: Why does it go up to order+1? Nothing ever uses that halcontext as far as I can see.Maybe its only here so that the i-1 can be 'add_symbol'ed within the same loop and the programmer was lazy ;)
-	for(i=(model->order+1); i>0; --i)
-		if(model->halcontext[i-1] != NULL)
-			model->halcontext[i] = add_symbol(model->halcontext[i-1], (BYTE2)symbol);
-
-	return;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Update_Context
- *
- *	Purpose:	Update the context of the model without adding the symbol.
- */
-static void update_context(MODEL *model, int symbol)
-{
-	register int i;
-
-	Context;
-	for(i=(model->order+1); i>0; --i)
-		if(model->halcontext[i-1] != NULL)
-			model->halcontext[i] = find_symbol(model->halcontext[i-1], symbol);
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Add_Symbol
- *
- *	Purpose:	Update the statistics of the specified tree with the
- *			specified symbol, which may mean growing the tree if the
- *			symbol hasn't been seen in this context before.
- */
-static TREE *add_symbol(TREE *tree, BYTE2 symbol)
-{
-	TREE *node=NULL;
-
-	Context;
-	/*
-	 *	Search for the symbol in the subtree of the tree node.
-	 */
-	node = find_symbol_add(tree, symbol);
-
-	/*
-	 *	Increment the symbol counts
-	 */
-	if((node->count < 65535)) {
-		node->count += 1;
-		tree->usage += 1;
-	}
-
-	return node;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Find_Symbol
- *
- *	Purpose:	Return a pointer to the child node, if one exists, which
- *			contains the specified symbol.
- */
-static TREE *find_symbol(TREE *node, int symbol)
-{
-	register int i;
-	TREE *found = NULL;
-	bool found_symbol = FALSE;
-
-	Context;
-	/*
-	 *	Perform a binary search for the symbol.
-	 */
-	i = search_node(node, symbol, &found_symbol);
-	if(found_symbol == TRUE)
-		found=node->tree[i];
-
-	return found;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Find_Symbol_Add
- *
- *	Purpose:	This function is conceptually similar to find_symbol,
- *			apart from the fact that if the symbol is not found,
- *			a new node is automatically allocated and added to the
- *			tree.
- */
-static TREE *find_symbol_add(TREE *node, int symbol)
-{
-	register int i;
-	TREE *found = NULL;
-	bool found_symbol = FALSE;
-
-	Context;
-	/*
-	 *		Perform a binary search for the symbol.  If the symbol isn't found,
-	 *		attach a new sub-node to the tree node so that it remains sorted.
-	 */
-	i = search_node(node, symbol, &found_symbol);
-	if(found_symbol == TRUE) {
-		found = node->tree[i];
-	} else {
-		found = new_node();
-		found->symbol = symbol;
-		add_node(node, found, i);
-	}
-
-	return found;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Add_Node
- *
- *	Purpose:	Attach a new child node to the sub-tree of the tree
- *			specified.
- */
-static void add_node(TREE *tree, TREE *node, int position)
-{
-	register int i;
-
-	Context;
-	/*
-	 *	Allocate room for one more child node, which may mean allocating
-	 *	the sub-tree from scratch.
-	 */
-	tree->branch += 1;
-	if(realloc_tree(tree) == NULL) {
-		error("add_node", "Unable to reallocate subtree.");
-		return;
-	}
-
-	/*
-	 *	Shuffle the nodes down so that we can insert the new node at the
-	 *	subtree index given by position.
-	 */
-	for(i=tree->branch-1; i>position; --i)
-		tree->tree[i] = tree->tree[i-1];
-
-	/*
-	 *	Add the new node to the sub-tree.
-	 */
-	tree->tree[position]=node;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Search_Node
- *
- *	Purpose:	Perform a binary search for the specified symbol on the
- *			subtree of the given node.  Return the position of the
- *			child node in the subtree if the symbol was found, or the
- *			position where it should be inserted to keep the subtree
- *			sorted if it wasn't.
- */
-static int search_node(TREE *node, int symbol, bool *found_symbol)
-{
-	register int position;
-	int min;
-	int max;
-	int middle;
-	int compar;
-
-	Context;
-	/*
-	 *	Handle the special case where the subtree is empty.
-	 */
-	if(node->branch == 0) {
-		position = 0;
-		goto notfound;
-	}
-
-	/*
-	 *	Perform a binary search on the subtree.
-	 */
-	min = 0;
-	max = node->branch-1;
-	while(TRUE) {
-		middle = (min+max)/2;
-		compar = symbol-node->tree[middle]->symbol;
-		if(compar == 0) {
-			position = middle;
-			goto found;
-		} else if(compar > 0) {
-			if(max == middle) {
-				position = middle+1;
-				goto notfound;
-			}
-			min = middle+1;
-		} else {
-			if(min == middle) {
-				position = middle;
-				goto notfound;
-			}
-			max = middle-1;
-		}
-	}
-
-found:
-	*found_symbol = TRUE;
-	return position;
-
-notfound:
-Context;
-	*found_symbol = FALSE;
-	return position;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Initialize_Context
- *
- *	Purpose:	Set the context of the model to a default value.
- */
-static void initialize_context(MODEL *model)
-{
-	register int i;
-
-	Context;
-	for(i=0; i<=model->order; ++i)
-		model->halcontext[i] = NULL;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Learn
- *
- *	Purpose:	Learn from the user's input.
- */
-static void learn(MODEL *model, DICTIONARY *words)
-{
-	register int i;
-	BYTE2 symbol;
-	bool nospace = TRUE;
-
-	Context;
-	/*
-	 *	We only learn from inputs which are long enough
-	 */
-	if(words->size <= (model->order))
-		return;
-
-	// check if there are spaces in the word or its merely one word+punctuation
-	for(i=1; i<words->size; i++)
-		if(words->entry[i].word[0] != (wchar_t)31) {
-			nospace = FALSE;
-			break;
-		}
-	if (nospace)
-		return;
-
-	// Add a new phrase to the model
-	model->phrasecount++;
-	if(realloc_phrase(model)==NULL) {
-		error("learn", "Unable to reallocate phrase");
-		return;
-	}
-	model->phrase[model->phrasecount-1]=(BYTE2 *)nmalloc(sizeof(BYTE2)*(words->size+2));
-	if (model->phrase[model->phrasecount-1] == NULL) {
-		error("learn", "Unable to allocate phrase");
-		return;
-	}
-	model->phrase[model->phrasecount-1][0] = words->size+1;
-
-	/*
-	 *	Train the model in the forwards direction.  Start by initializing
-	 *	the context of the model.
-	 */
-	initialize_context(model);
-	model->halcontext[0] = model->forward;
-	for(i=0; i<words->size; ++i) {
-		/*
-		 *	Add the symbol to the model's dictionary if necessary, and then
-		 *	update the forward model accordingly.
-		 */
-		symbol = add_word(model->dictionary, words->entry[i]);
-		update_model(model, symbol);
-		model->phrase[model->phrasecount-1][i+1] = symbol;
-	}
-	/*
-	 *	Add the sentence-terminating symbol.
-	 */
-	update_model(model, 1);
-	model->phrase[model->phrasecount-1][words->size+1] = 1;
-
-	/*
-	 *	Train the model in the backwards direction.  Start by initializing
-	 *	the context of the model.
-	 */
-	initialize_context(model);
-	model->halcontext[0] = model->backward;
-	for(i=words->size-1; i>=0; --i) {
-		/*
-		 *	Find the symbol in the model's dictionary, and then update
-		 *	the backward model accordingly.
-		 */
-		symbol = find_word(model->dictionary, words->entry[i]);
-		update_model(model, symbol);
-	}
-	/*
-	 *	Add the sentence-terminating symbol.
-	 */
-	update_model(model, 1);
-
-	return;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Train
- *
- *	Purpose:	Infer a MegaHAL brain from the contents of a text file.
- */
-static void train(MODEL *model, char *filename)
-{
-	FILE *file;
-	char buffer[1024];
-	wchar_t *wbuffer = NULL;
-	DICTIONARY *words = NULL;
-	int length;
-
-	Context;
-	if(filename == NULL)
-		return;
-
-	file=fopen(filename, "r");
-	if(file == NULL) {
-		putlog(LOG_MISC, "*", "Unable to find the personality %s\n", filename);
-		return;
-	}
-
-	fseek(file, 0, 2);
-	length = ftell(file);
-	rewind(file);
-
-	words = new_dictionary();
-
-	while(!feof(file)) {
-
-		if(fgets(buffer, 1024, file)==NULL)
-			break;
-		if(buffer[0] == '#')
-			continue; // comments
-
-		wbuffer=locale_to_wchar(buffer);
-		wbuffer[wcslen(wbuffer)-1] = L'\0';
-
-		upper(wbuffer);
-		make_words(wbuffer, words);
-		learn(model, words);
-		nfree(wbuffer);
-
-	}
-
-	free_dictionary(words);
-	fclose(file);
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Show_Dictionary
- *
- *	Purpose:	Display the dictionary for training purposes.
- */
-static void show_dictionary(DICTIONARY *dictionary)
-{
-	register int i;
-	register int k;
-	FILE *file;
-	char *ldict_word;
-	wchar_t *tmp;
-	char filename[512];
-
-	Context;
-	snprintf(filename, sizeof(filename), "%s%smegahal.dic", directory_cache, SEP);
-	file = fopen(filename, "w");
-	if(file == NULL) {
-		warn("show_dictionary", "Unable to open file");
-		return;
-	}
-
-	for(i=0; i<dictionary->size; ++i) {
-		tmp = (wchar_t *)nmalloc(sizeof(wchar_t)*(dictionary->entry[i].length+1));
-		for(k=0;k<dictionary->entry[i].length;k++)
-			tmp[k] = dictionary->entry[i].word[k];
-		tmp[dictionary->entry[i].length] = L'\0';
-		ldict_word = wchar_to_locale(tmp);
-		fputs(ldict_word, file);
-		nfree(tmp);
-		nfree(ldict_word);
-		fprintf(file, "\n");
-	}
-
-	fclose(file);
+	Context;
+	wait_for_saver();
+	restartwanted = FALSE;
+	if(save_in_background())
+		restartsave = TRUE;
+	else
+		restart_now();
 }
 
-static void save_phrases(MODEL *model)
+// the foreground half of restart_journal(), for when the save can't be or wasn't made in the background - the caller holds the model
+static void restart_now()
 {
-	register int i, j;
-	DICTIONARY *phrase;
-	FILE *file;
-	char *phrase2;
-	char filename[512];
-
 	Context;
-	phrase = new_dictionary();
-	snprintf(filename, sizeof(filename), "%s%smegahal.phr", directory_cache, SEP);
-	file = fopen(filename, "w");
-	if(file == NULL) {
-		warn("save_phrases", "Unable to open file");
-		return;
-	}
-
-	for(i=0; i<model->phrasecount; ++i) {
-
-		phrase->size = model->phrase[i][0]-1;
-		if(realloc_dictionary(phrase) == NULL) {
-			error("save_phrases", "Unable to reallocate dictionary");
-			return;
-		}
-		for(j=0; j<phrase->size; ++j)
-			phrase->entry[j] = model->dictionary->entry[model->phrase[i][j+1]];
-
-		phrase2 = wchar_to_locale(make_output(phrase));
-		fputs(phrase2, file);
-		fprintf(file, "\n");
-		nfree(phrase2);
+	if(!save_brain()) {
+		// the new journal follows on from a brain that wasn't saved, so it is no use
+		close_journal();
+		putlog(LOG_MISC, "*", "Brain save failed, nothing is journalled until it is saved");
 	}
-
-	fclose(file);
-	free_dictionary(phrase);
 }
 
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Save_Model
- *
- *	Purpose:	Save the current state to a MegaHAL brain file.
- */
-static void save_model(char *modelname, MODEL *model)
+// reports how a background save went, and drops the journals the new brain took in
+static void saver_done(int status)
 {
-	register int i, j;
-	FILE *file;
-  char filename[512];
-
 	Context;
-
-	show_dictionary(model->dictionary);
-	save_phrases(model);
-
-	snprintf(filename, sizeof(filename), "%s%s%s", directory_cache, SEP, modelname);
-	file = fopen(filename, "wb");
-	if(file == NULL) {
-		warn("save_model", "Unable to open file `%s'", filename);
-		return;
+	saver = 0;
+	if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		prune_journals(savedjournal);
+		putlog(LOG_MISC, "*", "Brain saved");
+	} else {
+		putlog(LOG_MISC, "*", "Brain save failed, the previous files were kept");
+		// the journal restart_journal() began follows on from the brain that failed
+		if(restartsave)
+			restartwanted = TRUE;
 	}
-
-	fwrite(_T(COOKIE), sizeof(wchar_t), wcslen(_T(COOKIE)), file);
-	fwrite(&(model->order), sizeof(BYTE1), 1, file);
-	save_tree(file, model->forward);
-	save_tree(file, model->backward);
-	save_dictionary(file, model->dictionary);
-	fwrite(&(model->phrasecount), sizeof(BYTE4), 1, file);
-	for(i=0; i<model->phrasecount; ++i)
-		for(j=0; j<model->phrase[i][0]+1; ++j)
-			fwrite(&(model->phrase[i][j]), sizeof(BYTE2), 1, file);
-	fclose(file);
+	restartsave = FALSE;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Save_Tree
- *
- *	Purpose:	Save a tree structure to the specified file.
- */
-static void save_tree(FILE *file, TREE *node)
+// blocks until a background save has finished, so nothing else writes the brain files at the same time
+static void wait_for_saver()
 {
-	static int level=0;
-	register int i;
+	int status;
+	pid_t pid;
 
 	Context;
-	fwrite(&(node->symbol), sizeof(BYTE2), 1, file);
-	fwrite(&(node->usage), sizeof(BYTE4), 1, file);
-	fwrite(&(node->count), sizeof(BYTE2), 1, file);
-	fwrite(&(node->branch), sizeof(BYTE2), 1, file);
-
-	for(i=0; i<node->branch; ++i) {
-		++level;
-		save_tree(file, node->tree[i]);
-		--level;
-	}
+	if(saver <= 0)
+		return;
+	while((pid = waitpid(saver, &status, 0)) < 0 && errno == EINTR);
+	if(pid == saver)
+		saver_done(status);
+	else
+		saver = 0;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Load_Tree
- *
- *	Purpose:	Load a tree structure from the specified file.
- */
-static void load_tree(FILE *file, TREE *node)
+static int pub_megahal(char *nick, char *host, char *hand, char *channel, char *text)
 {
-	static int level = 0;
-	register int i;
+	char prefix[strlen(channel) + strlen(nick) + 13];
+	struct chanset_t *chan = findchan(channel);
 
 	Context;
-	if ( fread(&(node->symbol), sizeof(BYTE2), 1, file) &&
-	     fread(&(node->usage), sizeof(BYTE4), 1, file) &&
-	     fread(&(node->count), sizeof(BYTE2), 1, file) &&
-	     fread(&(node->branch), sizeof(BYTE2), 1, file) ) {
-
-		if(node->branch==0) {
-			return;
-		}
-
-		node->tree = (TREE **)nmalloc(sizeof(TREE *)*(node->branch));
-		if(node->tree == NULL) {
-			error("load_tree", "Unable to allocate subtree");
-			return;
-		}
-
-		for(i=0; i<node->branch; ++i) {
-			node->tree[i] = new_node();
-			++level;
-			load_tree(file, node->tree[i]);
-			--level;
-		}
+	if(!floodcheck())
+		return 0;
+	if(istextinlist(channel, rexcludechans))
+		return 0;
+	if(chan != NULL) {
+		sprintf(prefix, "PRIVMSG %s :%s: ", channel, nick);
+		char *lmbotnick=wchar_to_locale(mbotnick);
+		putlog(LOG_PUBLIC, channel, "<%s> %s: %s", nick, lmbotnick, text);
+		nfree(lmbotnick);
+		do_megahal(DP_HELP, prefix, text, TRUE, nick, channel, replyusec);
 	}
+	return 0;
 }
 
-/*---------------------------------------------------------------------------*/
+static int pub_action(char *nick, char *host, char *hand, char *channel, char *key, char *text)
+{
+	pub_megahal2(nick, host, hand, channel, text);
+	return 0;
+}
 
-/*
- *	Function:	Load_Model
- *
- *	Purpose:	Load a model into memory.
- */
-static bool load_model(char *filename, MODEL *model)
+static int pub_megahal2(char *nick, char *host, char *hand, char *channel, char *text)
 {
-	register int i, j;
-	BYTE2 size;
-	FILE *file;
-	wchar_t cookie[16];
+	// counters per channel for chatter/learning
+	static int *count = NULL, *learncount = NULL;
+	static int chancount = 0, learnchancount = 0;
 
-	Context;
-	if(filename == NULL)
-		return FALSE;
+	char prefix[strlen(channel) + strlen(nick) + 13], *keyword = NULL;
+	wchar_t buffer[512] = L"";
+	wchar_t *wtext;
 
-	file = fopen(filename, "rb");
-	if(file == NULL) {
-		warn("load_model", "Unable to open file `%s'", filename);
-		return FALSE;
-	}
+	int i, pos;
+	struct chanset_t *chan = findchan(channel);
+	bool learnit = FALSE, flg = TRUE;
 
-	if (!fread(cookie, sizeof(wchar_t), wcslen(_T(COOKIE)), file) ||
-	    wcsncmp(cookie, _T(COOKIE), wcslen(_T(COOKIE))) != 0 ||
-	    !fread(&(model->order), sizeof(BYTE1), 1, file)
-	   ) {
-		warn("load_model", "File `%s' is not a MegaHAL brain", filename);
-		goto fail;
+	Context;
+	setlocale(LC_ALL, "");
+	wtext = locale_to_wchar(text);
+	wcscpy(buffer,wtext);
+	nfree(wtext);
+	mystrlwr(buffer);
+	if(mystrstr(buffer, L"http") != NULL) {
+		return 0;
 	}
 
-	order = model->order;
-	load_tree(file, model->forward);
-	load_tree(file, model->backward);
-	load_dictionary(file, model->dictionary);
-
-	if ( !fread(&(model->phrasecount), sizeof(BYTE4), 1, file) ||
-	realloc_phrase(model) == NULL ) {
-		error("load_model", "Unable to reallocate phrase");
-		return FALSE;
+	// handle and respond to phrases with the botnick or keywords in it immediately and then exit
+	make_words(buffer, words); // dont make upper or it will mess things like mystrstr
+	if(words->size == 0) { // might have stripped all codes and returned empty
+		return 0;
 	}
-	for(i=0; i<model->phrasecount; ++i) {
-		if ( fread(&size, sizeof(BYTE2), 1, file) ) {
-			model->phrase[i]=(BYTE2 *)nmalloc(sizeof(BYTE2)*(size+2));
-			if (model->phrase[i] == NULL) {
-				error("learn", "Unable to allocate phrase");
-				return FALSE;
-			}
-		}
-		model->phrase[i][0] = size;
-		for(j=0; j<size; ++j) {
-			if (!fread(&(model->phrase[i][j+1]), sizeof(BYTE2), 1, file)) {
-				break;
-			}
+	if(words->size > 1) {
+		if((wordcmp2(words->entry[0], mbotnick)==0) && ((words->entry[1].word[1] == L':') || (words->entry[1].word[1] == L','))) { // let this be handled by pub_megahal otherwise we respond twice
+			return 0;
 		}
-		model->phrase[i][size+1] = 1; // terminator
 	}
-
-	return TRUE;
-fail:
-	fclose(file);
-
-	return FALSE;
-}
-
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Make_Words
- *
- *	Purpose:	Break a string into an array of words.
- */
-static void make_words(wchar_t *pinput, DICTIONARY *words)
-{
-	size_t offset = 0, tmp = 0;
-	register int i;
-	wchar_t iinput[512] = L"";
-	wchar_t *input = iinput;
-
+	if((words->entry[0].word[0] == L'.') || (words->entry[0].word[0] == L'!')) { // pub command - ignore
+		return 0;
+	}
 	Context;
-	/*
-	 *	Clear the entries in the dictionary
-	 */
-	free_words(words);
-	free_dictionary(words);
-	wcscpy(iinput,pinput);
-	strip_codes(input);
-	/*
-	 *	If the string is empty then do nothing, for it contains no words.
-	 */
-	if(wcslen(input) == 0)
-		return;
-	/*
-	 *	Loop forever.
-	 */
-	while(1) {
-
-		/*
-		 *	If the current character is of the same type as the previous
-		 *	character, then include it in the word.  Otherwise, terminate
-		 *	the current word.
-		 */
-		while(input[0] == L' ')
-			input++;
-		if(!input[0])
+	flg = (istextinlist(channel, rexcludechans)!=NULL); // dont respond/chat in channels that are excluded but learnfrequency is still enabled for now...
+	for (i=0; i<words->size; i++) // find whether one of the response keywords is in the text - find first only
+		if((keyword = istextinlist2(words->entry[i], responsekeywords)))
 			break;
-		if((boundary(input, offset) || (input[offset] == L' '))) {
-
-			/*
-			 *	Add the word to the dictionary
-			 */
-			words->size += 1;
-			if(realloc_dictionary(words) == NULL) {
-				error("make_words", "Unable to reallocate dictionary");
-				return;
-			}
-			if(((input-1)[0] != L' ') && (words->size>1))
-				tmp = 1;
-			words->entry[words->size-1].length = offset+tmp;
-			words->entry[words->size-1].word = (wchar_t *)nmalloc(sizeof(wchar_t)*(offset+tmp));
-			if(tmp)
-				words->entry[words->size-1].word[0]=(wchar_t)31;
-			for(i=0; i<offset; i++)
-				words->entry[words->size-1].word[i+tmp]=input[i];
-			if(offset == wcslen(input))
-				break;
-			input += offset;
-			offset = tmp = 0;
+	if(chan != NULL && (mystrstr(buffer, mbotnick) || keyword) && !flg) { // either botnick or keyword said - respond immediately and exit
+		Context;
+		if(!floodcheck()) {
+			return 0;
+		}
+		if(!keyword)
+			keyword = wchar_to_locale(mbotnick);
+		// if keyword used in beginning or end of phrase, learn it
+		if(wordcmp2(words->entry[0], locale_to_wchar(keyword))==0 || wordcmp2(words->entry[(words->size)-2], locale_to_wchar(keyword))==0) { // -2 to exclude the period
+			learnit = TRUE;
+			sprintf(prefix, "PRIVMSG %s :%s: ", channel, nick);
 		} else {
-			++offset;
+			sprintf(prefix, "PRIVMSG %s :%s, ", channel, nick);
 		}
-	}
-	/*
-	 *	If the last word isn't punctuation, then replace it with a
-	 *	full-stop character.
-	 */
-	if (words->size == 0) {
-		return;
+		// remove the botnick from the text
+		if(mystrstr(buffer, locale_to_wchar(keyword))) {
+			pos = (int)(mystrstr(buffer, locale_to_wchar(keyword)) - buffer);
+			for(i=pos; i<(wcslen(buffer)-wcslen(locale_to_wchar(keyword))); i++)
+				buffer[i] = buffer[i+wcslen(locale_to_wchar(keyword))];
+			buffer[i]=L'\0';
+		}
+		char *lbuffer=wchar_to_locale(buffer);
+		do_megahal(DP_HELP, prefix, lbuffer, learnit, nick, channel, replyusec);
+		nfree(lbuffer);
+		return 0;
 	}
 
-	if(iswalnum(words->entry[words->size-1].word[0]) || (words->entry[words->size-1].word[0]==(wchar_t)31 && iswalnum(words->entry[words->size-1].word[1])) ) {
-		words->size += 1;
-		if(realloc_dictionary(words) == NULL) {
-			error("make_words", "Unable to reallocate dictionary");
-			return;
+	// Learn this phrase?
+	if(learningmode && learnfrequency>0) {
+		// initialize the count array - one int per chan (first time only)
+		Context;
+		if(countchans() && learncount == NULL) {
+			learncount = (int *)nmalloc(sizeof(int)*countchans());
+			for (i=0; i<countchans(); i++)
+				learncount[i] = 0;
+			learnchancount = countchans();
+		}
+		// if number of chans changed, realloc the array
+		if(countchans() && learnchancount != countchans()) {
+			learncount = (int *)nrealloc((int *)(learncount), sizeof(int)*countchans());
+			learnchancount = countchans();
 		}
 
-		words->entry[words->size-1].word = (wchar_t *)nmalloc(sizeof(wchar_t)*(2));
-		words->entry[words->size-1].length = 2;
-		words->entry[words->size-1].word[0] = (wchar_t)31;
-		words->entry[words->size-1].word[1] = L'.';
-	} else if(wcschr(L"!.?", words->entry[words->size-1].word[words->entry[words->size-1].length-1]) == NULL) {
-		words->entry[words->size-1].word = (wchar_t *)nrealloc(words->entry[words->size-1].word, sizeof(wchar_t)*(2));
-		words->entry[words->size-1].length = 2;
-		words->entry[words->size-1].word[0] = (wchar_t)31;
-		words->entry[words->size-1].word[1] = L'.';
+		// increment appropriate counter
+		if(learncount[getchannum(channel)] < learnfrequency) {
+			learncount[getchannum(channel)]++;
+		} else {
+			upper(buffer);
+			make_words(buffer, words);
+			if(words->size > (model->order)) { // only learn phrases with minimum amount of words
+				learn_words(words);
+				learncount[getchannum(channel)] = 0;
+			}
+		}
 	}
-	return;
-}
-
-/*---------------------------------------------------------------------------*/
-/*
- *	Function:	Boundary
- *
- *	Purpose:	Return whether or not a word boundary exists in a string
- *			at the specified location.
- */
-static bool boundary(wchar_t *string, int position)
-{
-
-	Context;
-	if(position == 0)
-		return FALSE;
-
-	if(position == (int)wcslen(string))
-		return TRUE;
-
-	if(
-		((string[position] == L'\'')) &&
-		(iswalnum(string[position-1]) != 0) &&
-		(iswalnum(string[position+1]) != 0)
-	)
-		return FALSE;
-
-	if(
-		(position > 1) &&
-		((string[position-1] == L'\'')) &&
-		(iswalnum(string[position-2]) !=0) &&
-		(iswalnum(string[position]) != 0)
-	)
-		return FALSE;
-
-	if(
-		((string[position] == L'-')) &&
-		(iswalnum(string[position-1]) != 0) &&
-		(iswalnum(string[position+1]) != 0)
-	)
-		return FALSE;
-
-	if(
-		(position > 1) &&
-		((string[position-1] == L'-')) &&
-		(iswalnum(string[position-2]) != 0) &&
-		(iswalnum(string[position]) != 0)
-	)
-		return FALSE;
-
-	if(
-		(iswalnum(string[position]) != 0) &&
-		(iswalnum(string[position-1]) == 0)
-	)
-		return TRUE;
-
-	if(
-		(iswalnum(string[position]) == 0) &&
-		(iswalnum(string[position-1]) != 0)
-	)
-		return TRUE;
-
-/*	if(isdigit(string[position])!=isdigit(string[position-1]))
-		return(TRUE);
-*/
-	return FALSE;
-}
-
-/*---------------------------------------------------------------------------*/
-/*
- *	Function:	Generate_Reply
- *
- *	Purpose:	Take a string of user input and return a string of output
- *			which may vaguely be construed as containing a reply to
- *			whatever is in the input string.
- */
-static wchar_t *generate_reply(MODEL *model, DICTIONARY *words)
-{
-	static DICTIONARY *dummy = NULL;
-	DICTIONARY *replywords;
-	DICTIONARY *keywords;
-	float surprise;
-	float max_surprise;
-	wchar_t *output;
-	static wchar_t *output_none = NULL;
-	int basetime;
 
+	// From here, chatter stuff only
+	// check if chatter is turned off or if this chan is in the exclude list
 	Context;
-	/*
-	 *	Create an array of keywords from the words in the user's input
-	 */
-	keywords = make_keywords(model, words);
+	if(istextinlist(channel, texcludechans) || talkfrequency == 0)
+		return 0;
 
-	/*
-	 *	Make sure some sort of reply exists
-	 */
-	if(output_none == NULL) {
-		output_none = nmalloc(512);
-		if(output_none != NULL)
-			wcscpy(output_none, L"I don't know enough to answer you yet!");
+	// initialize the count array - one int per chan (first time only)
+	if(countchans() && count == NULL) {
+		count = (int *)nmalloc(sizeof(int)*countchans());
+		for (i=0; i<countchans(); i++)
+			count[i] = 0;
+		chancount = countchans();
+	}
+	// if number of chans changed, realloc the array
+	if(countchans() && chancount != countchans()) {
+		count = (int *)nrealloc((int *)(count), sizeof(int)*countchans());
+		chancount = countchans();
 	}
-	output = output_none;
-	if(dummy == NULL)
-		dummy = new_dictionary();
-	replywords = reply(model, dummy);
-	basetime = time(NULL);
-	while(((maxreplywords && replywords->size>maxreplywords) || dissimilar(words, replywords)==FALSE || isrepeating(replywords) || isinprevs(replywords)) && (time(NULL)-basetime)<timeout )
-		replywords = reply(model, dummy);
-	output = make_output(replywords);
-	/*
-	 *	Loop for the specified waiting period, generating and evaluating
-	 *	replies
-	 */
-	max_surprise = (float)-1.0;
-	basetime = time(NULL);
-	do {
-		replywords = reply(model, keywords);
-		if ((maxreplywords && replywords->size>maxreplywords) || dissimilar(words, replywords)==FALSE ||
-		    isrepeating(replywords) || isinprevs(replywords))
-			continue;
-		surprise = evaluate_reply(model, keywords, replywords);
-		if(surprise > max_surprise) {
-			max_surprise = surprise;
-			output = make_output(replywords);
-		}
-	} while((time(NULL)-basetime) < timeout);
-	updateprevs(output);
-
-	/*
-	 *	Return the best answer we generated
-	 */
-	return output;
-}
-
-/*---------------------------------------------------------------------------*/
 
-/*
- *	Function:	Dissimilar
- *
- *	Purpose:	Return TRUE or FALSE depending on whether the dictionaries
- *			are the same or not.
- */
-static bool dissimilar(DICTIONARY *words1, DICTIONARY *words2)
-{
-	register int i;
+	// increment appropriate counter
+	if(count[getchannum(channel)] < talkfrequency) {
+		count[getchannum(channel)]++;
+		return 0;
+	} else {
+		if (!floodcheck())
+			return 0;
+		count[getchannum(channel)] = 0;
+	}
 
-	Context;
-	if(words1->size != words2->size)
-		return TRUE;
-	for(i=0; i<words1->size; ++i)
-		if(wordcmp(words1->entry[i], words2->entry[i])!=0)
-			return TRUE;
-	return FALSE;
+	if(chan != NULL) {
+		sprintf(prefix, "PRIVMSG %s :", channel);
+		do_megahal(DP_HELP, prefix, text, FALSE, NULL, channel, replyusec);
+	}
+	if(keyword)
+		nfree(keyword);
+	return 0;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Make_Keywords
- *
- *	Purpose:	Put all the interesting words from the user's input into
- *			a keywords dictionary, which will be used when generating
- *			a reply.
- */
-static DICTIONARY *make_keywords(MODEL *model, DICTIONARY *words)
+static int dcc_megahal(struct userrec *u, int idx, char *par)
 {
-	static DICTIONARY *keys=NULL;
-	register int i;
-	register int j;
-	int c;
-
 	Context;
-	if(keys == NULL)
-		keys = new_dictionary();
-	free_words(keys);
-	free_dictionary(keys);
-
-	for(i=0; i<words->size; ++i) {
-		/*
-		 *		Find the symbol ID of the word.  If it doesn't exist in
-		 *		the model, or if it begins with a non-alphanumeric
-		 *		wchar_tacter, or if it is in the exclusion array, then
-		 *		skip over it.
-		 */
-		c = 0;
-		for(j=0; j<swp->size; ++j)
-			if(wordcmp(swp->from[j], words->entry[i]) == 0) {
-				add_key(model, keys, swp->to[j]);
-				++c;
-			}
-		if(c == 0)
-			add_key(model, keys, words->entry[i]);
-	}
-
-	if(keys->size>0)
-		for(i=0; i<words->size; ++i) {
-			c=0;
-			for(j=0; j<swp->size; ++j)
-				if(wordcmp(swp->from[j], words->entry[i]) == 0) {
-					add_aux(model, keys, swp->to[j]);
-					++c;
-				}
-			if(c == 0)
-				add_aux(model, keys, words->entry[i]);
-		}
-
-	return keys;
+	if(!floodcheck())
+		return 0;
+	do_megahal(idx, "", par, TRUE, NULL, NULL, dccreplyusec);
+	return 0;
 }
 
-/*---------------------------------------------------------------------------*/
 
-/*
- *	Function:	Add_Key
- *
- *	Purpose:	Add a word to the keyword dictionary.
- */
-static void add_key(MODEL *model, DICTIONARY *keys, STRING word)
+
+// returns a copy of the entries of an index list, for going through the phrases they stand for while deleting them - the caller frees it
+static BYTE4 *copy_postings(POSTINGS *list, BYTE4 *count)
 {
-	int symbol;
-	bool fnd;
+	BYTE4 *copy;
 
-	Context;
-	symbol = find_word(model->dictionary, word);
-	if(symbol == 0)
-		return;
-	if((word.word[0]!=(wchar_t)31 && iswalnum(word.word[0])==0) || (word.word[0]==(wchar_t)31 && iswalnum(word.word[1])==0))
-		return;
-	search_dictionary(ban, word, &fnd);
-	if(fnd)
-		return;
-	search_dictionary(aux, word, &fnd);
-	if(fnd)
-		return;
+	*count = list->size-list->head;
+	if(*count == 0)
+		return NULL;
+	copy = (BYTE4 *)nmalloc(sizeof(BYTE4)*(*count));
+	if(copy == NULL) {
+		error("copy_postings", "Unable to allocate copy");
+		*count = 0;
+		return NULL;
+	}
+	memcpy(copy, POSTED(list)+list->head, sizeof(BYTE4)*(*count));
 
-	add_word(keys, word);
+	return copy;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Add_Aux
- *
- *	Purpose:	Add an auxilliary keyword to the keyword dictionary.
- */
-static void add_aux(MODEL *model, DICTIONARY *keys, STRING word)
+// orders two serials or groups for qsort()
+static int compare_serials(const void *a, const void *b)
 {
-	int symbol;
-	bool fnd;
-
-	Context;
-	symbol = find_word(model->dictionary, word);
-	if(symbol == 0)
-		return;
-	if(iswalnum(word.word[0]) == 0)
-		return;
-	search_dictionary(aux, word, &fnd);
-	if(!fnd)
-		return;
+	BYTE4 x = *(const BYTE4 *)a, y = *(const BYTE4 *)b;
 
-	add_word(keys, word);
+	return x < y ? -1 : x > y;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Reply
- *
- *	Purpose:	Generate a dictionary of reply words appropriate to the
- *			given dictionary of keywords.
- */
-static DICTIONARY *reply(MODEL *model, DICTIONARY *keys)
+// finds the closest matching phrase in the model to some text if (possible)
+static int find_phrase(wchar_t *text, bool *found)
 {
-	static DICTIONARY *replies = NULL;
-	register int i;
-	int symbol;
-	bool start = TRUE;
-	int basetime;
+	register int i, j, k;
+	int maxSize = 500;
+	SYMBOL symbols[maxSize];
+	SYMBOL symbol;
+	int size = 0, highmatch = 0, count = 0;
+	bool flag = TRUE;
+	BYTE4 *groups, total = 0, gathered = 0, at, oldest = 0;
+	SYMBOL *candidate;
+	POSTINGS *list;
 
 	Context;
-	if(replies == NULL)
-		replies = new_dictionary();
-	free_dictionary(replies);
-
-	/*
-	 *	Start off by making sure that the model's context is empty.
-	 */
-	initialize_context(model);
-	model->halcontext[0] = model->forward;
-	used_key = FALSE;
+	upper(text);
+	make_words(text, words);
+	if(words->size == 0)
+		return 0;
 
-	/*
-	 *	Generate the reply in the forward direction.
-	 */
-	/* This used to be while(TRUE) and while it should never get stuck in an infinite loop in theory, this was changed just in case to timeout cause it can grab ram like crazy until it sigterms */
-	basetime = time(NULL);
-	while((time(NULL)-basetime) < timeout+2) {
-		/*
-		 *	Get a random symbol from the current context.
-		 */
-		if(start == TRUE)
-			symbol = seed(model, keys);
-		else
-			symbol = babble(model, keys, replies);
-		if((symbol==0) || (symbol==1))
-			break;
-		start = FALSE;
-
-		/*
-		 *	Append the symbol to the reply dictionary.
-		 */
-		replies->size += 1;
-		if(realloc_dictionary(replies) == NULL) {
-			error("reply", "Unable to reallocate dictionary");
-			return NULL;
-		}
+	// create an array of unique symbols
+	// make sure the words exist in the main dictionary already and that they arent repeated
+	// we compress repeated symbols for two reasons: 1. so that we dont find repeated matches later
+	// 2. in case some parts of the phrase were repeated by the bot and the user tries to make it forget that
 
-		replies->entry[replies->size-1].length = model->dictionary->entry[symbol].length;
-		replies->entry[replies->size-1].word = model->dictionary->entry[symbol].word;
+	for(i=0; i<words->size; i++) {
+		if(!(symbol = find_word(model->dictionary, words->entry[i])))
+			continue;
+		// minimum 2 letters in each word
+		if(model->dictionary->entry[symbol].length < 2)
+			continue;
+		flag = TRUE;
+		for(j=0; j<size; j++)
+			if(symbols[j] == symbol)
+				flag = FALSE;
+		if(size >= maxSize)
+			flag = FALSE;
+		if(flag)
+			symbols[size++] = symbol;
+	}
 
-		/*
-		 *	Extend the current context of the model with the current symbol.
-		 */
-		update_context(model, symbol);
+	// only the phrases in the groups on the lists of those symbols can match any of them, so gather the groups
+	for(k=0; k<size; k++)
+		if(symbols[k] < model->index.symbols)
+			total += model->index.symbol[symbols[k]].size-model->index.symbol[symbols[k]].head;
+	if(total == 0) {
+		*found = FALSE;
+		return 0;
+	}
+	groups = (BYTE4 *)nmalloc(sizeof(BYTE4)*total);
+	if(groups == NULL) {
+		error("find_phrase", "Unable to allocate groups");
+		*found = FALSE;
+		return 0;
 	}
-	if((time(NULL)-basetime) >= timeout+2)
-		putlog(LOG_MISC, "*", "TIMEOUT1!");
+	for(k=0; k<size; k++) {
+		if(symbols[k] >= model->index.symbols)
+			continue;
+		list = &model->index.symbol[symbols[k]];
+		memcpy(groups+gathered, POSTED(list)+list->head, sizeof(BYTE4)*(list->size-list->head));
+		gathered += list->size-list->head;
+	}
+	qsort(groups, total, sizeof(BYTE4), compare_serials);
 
+	// now we try to find the closest match among those phrases - every copy of one scores the same, and the oldest wins a tie
+	for(at=0; at<total; at++) {
+		if(at > 0 && groups[at] == groups[at-1])
+			continue;
+		candidate = model->index.group[groups[at]].phrase;
+		list = &model->index.group[groups[at]].copies;
 
-	/*
-	 *	Start off by making sure that the model's context is empty.
-	 */
-	initialize_context(model);
-	model->halcontext[0] = model->backward;
+		// check that its at least a third of the size of the phrase or else even tiny phrases can match many repeated symbols in a long one
+		if(size < ((candidate[0]-1)/3))
+			continue;
 
-	/*
-	 *	Re-create the context of the model from the current reply
-	 *	dictionary so that we can generate backwards to reach the
-	 *	beginning of the string.
-	 */
-	if(replies->size > 0)
-		for(i=MIN(replies->size-1, model->order); i>=0; --i) {
-			symbol = find_word(model->dictionary, replies->entry[i]);
-			update_context(model, symbol);
+		count = 0;
+		for(j=1; j<candidate[0]-1; j++)
+			for(k=0; k<size; k++)
+				if(symbols[k] == candidate[j])
+					count++;
+		// check minimum length
+		if(count < model->order)
+			continue;
+		// check that it matches at least a third of the phrase
+		if(count < ((candidate[0]-1)/3))
+			continue;
+
+		// compare to previous matches
+		if(count > highmatch || (count == highmatch && POSTED(list)[list->head] < oldest)) {
+			highmatch = count;
+			oldest = POSTED(list)[list->head];
 		}
+	}
+	nfree(groups);
 
-	/*
-	 *	Generate the reply in the backward direction.
-	 */
-	basetime = time(NULL);
-	while((time(NULL)-basetime) < timeout+2) {
-		/*
-		 *	Get a random symbol from the current context.
-		 */
-		symbol = babble(model, keys, replies);
-		if((symbol==0) || (symbol==1))
-			break;
+	if(highmatch == 0)  {
+		*found = FALSE;
+		return 0;
+	} else {
+		*found = TRUE;
+		return phrase_place(model, oldest);
+	}
+}
 
-		/*
-		 *	Prepend the symbol to the reply dictionary.
-		 */
-		replies->size += 1;
-		if(realloc_dictionary(replies) == NULL) {
-			error("reply", "Unable to reallocate dictionary");
-			return NULL;
-		}
+// deletes all phrases that are identical to the specified one (phrases can be entered twice, upping the counters)
+static void del_all_phrases(int phrase)
+{
+	BYTE4 group, *serials, count;
 
-		/*
-		 *	Shuffle everything up for the prepend.
-		 */
-		for(i=replies->size-1; i>0; --i) {
-			replies->entry[i].length = replies->entry[i-1].length;
-			replies->entry[i].word = replies->entry[i-1].word;
-		}
+	Context;
+	group = find_group(model, PHRASE(model, phrase), hash_phrase(PHRASE(model, phrase)));
+	if(group == NO_GROUP || (serials = copy_postings(&model->index.group[group].copies, &count)) == NULL) {
+		del_phrase(phrase);
+		return;
+	}
+	// newest first, so that the places of the ones still to go don't change
+	while(count > 0)
+		del_phrase(phrase_place(model, serials[--count]));
+	nfree(serials);
+}
 
-		replies->entry[0].length = model->dictionary->entry[symbol].length;
-		replies->entry[0].word = model->dictionary->entry[symbol].word;
+// deletes every phrase the symbol is in and returns how many there were
+static int del_word_phrases(SYMBOL symbol)
+{
+	BYTE4 *groups, *serials, count, total = 0;
+	POSTINGS *copies;
+	register BYTE4 i;
 
-		/*
-		 *	Extend the current context of the model with the current symbol.
-		 */
-		update_context(model, symbol);
+	Context;
+	if(symbol >= model->index.symbols)
+		return 0;
+	groups = copy_postings(&model->index.symbol[symbol], &count);
+	if(groups == NULL)
+		return 0;
+	for(i=0; i<count; ++i) {
+		copies = &model->index.group[groups[i]].copies;
+		total += copies->size-copies->head;
+	}
+	serials = (BYTE4 *)nmalloc(sizeof(BYTE4)*total);
+	if(serials == NULL) {
+		error("del_word_phrases", "Unable to allocate serials");
+		nfree(groups);
+		return 0;
+	}
+	total = 0;
+	for(i=0; i<count; ++i) {
+		copies = &model->index.group[groups[i]].copies;
+		memcpy(serials+total, POSTED(copies)+copies->head, sizeof(BYTE4)*(copies->size-copies->head));
+		total += copies->size-copies->head;
 	}
-	if((time(NULL)-basetime) >= timeout+2)
-		putlog(LOG_MISC, "*", "TIMEOUT2!");
+	nfree(groups);
+	qsort(serials, total, sizeof(BYTE4), compare_serials);
 
-	return replies;
-}
+	// newest first, so that the places of the ones still to go don't change
+	for(i=total; i>0; --i)
+		del_phrase(phrase_place(model, serials[i-1]));
+	nfree(serials);
 
-/*---------------------------------------------------------------------------*/
+	return total;
+}
 
-/*
- *	Function:	Evaluate_Reply
- *
- *	Purpose:	Measure the average surprise of keywords relative to the
- *			language model.
- */
-static float evaluate_reply(MODEL *model, DICTIONARY *keys, DICTIONARY *words)
+static int dcc_forget(struct userrec *u, int idx, char *text)
 {
-	register int i;
 	register int j;
-	int symbol;
-	float probability;
-	int count;
-	float entropy = (float)0.0;
-	TREE *node;
-	int num = 0;
+	int phrase;
 	bool fnd;
+	DICTIONARY *words;
+	wchar_t *output, *wtext;
 
 	Context;
-	if(words->size <= 0)
-		return (float)0.0;
-	initialize_context(model);
-	model->halcontext[0] = model->forward;
-	for(i=0; i<words->size; ++i) {
-		symbol = find_word(model->dictionary, words->entry[i]);
-
-		// only calculate values for words in the reply that are also keywords in the original sentence
-		search_dictionary(keys, words->entry[i], &fnd);
-		if(fnd) {
-			probability = (float)0.0;
-			count = 0;
-			++num;
-			for(j=0; j<model->order; ++j)
-				if(model->halcontext[j] != NULL) {
-					node = find_symbol(model->halcontext[j], symbol);
-					// the less that this word is used in this context, the higher the score
-					// this is because we are dividing the amount of times the word is used in this context by the usage counter of the parent context
-					if (surprise)
-						probability += (float)(node->count)/(float)(model->halcontext[j]->usage);
-					else
-						probability += (float)((float)1.0-((node->count)/(float)(model->halcontext[j]->usage)));
-					++count;
-				}
-
-			// log of <1 numbers are negative which is why we do -=
-			// this will weigh the result according to the size of the context i think
-			// in other words, the bigger the context, the higher the result value becomes
-			if(count > 0.0)
-				entropy -= (float)log(probability/(float)count);
-		}
-
-		update_context(model, symbol);
+	setlocale(LC_ALL, "");
+	if(!text[0])
+		return 0;
+	if(!TRY_MODEL()) {
+		dprintf(idx, "%s\n", BUSY_TEXT);
+		return 0;
 	}
 
-	initialize_context(model);
-	model->halcontext[0] = model->backward;
-	for(i=words->size-1; i>=0; --i) {
-		symbol = find_word(model->dictionary, words->entry[i]);
-
-		search_dictionary(keys, words->entry[i], &fnd);
-		if(fnd) {
-			probability = (float)0.0;
-			count = 0;
-			++num;
-			for(j=0; j<model->order; ++j)
-				if(model->halcontext[j] != NULL) {
-					node = find_symbol(model->halcontext[j], symbol);
-					if (surprise)
-						probability += (float)(node->count)/(float)(model->halcontext[j]->usage);
-					else
-						probability += (float)((float)1.0-((node->count)/(float)(model->halcontext[j]->usage)));
-					++count;
-				}
-
-			if(count > 0.0)
-				entropy -= (float)log(probability/(float)count);
+	words = new_dictionary();
+	wtext = locale_to_wchar(text);
+	phrase = find_phrase(wtext, &fnd);
+	if(fnd) {
+		words->size=PHRASE(model, phrase)[0]-1;
+		if(realloc_dictionary(words)==NULL) {
+			error("dcc_forget", "Unable to reallocate dictionary");
+			UNLOCK_MODEL();
+			return 0;
 		}
+		for(j=0; j<words->size; j++)
+			words->entry[j] = model->dictionary->entry[PHRASE(model, phrase)[j+1]];
 
-		update_context(model, symbol);
+		output = make_output(replycontext, words);
+		capitalize(output);
+		char *loutput=wchar_to_locale(output);
+		dprintf(idx, "You mean \"%s\"? OK, I'll try...\n", loutput);
+		nfree(loutput);
+		del_all_phrases(phrase);
+		trimdictionary();
+	} else {
+		dprintf(idx, "There is no way that I am going to forget about that, sorry.\n");
 	}
+	UNLOCK_MODEL();
 
-	// hmm this looks like it helps to average out all sentences including long sentences with many keywords so that they are all comparable?
-	if(num >= 8)
-		entropy /= (float)sqrt(num-1);
-	if(num >= 16)
-		entropy /= (float)num;
-
-	return entropy;
+	nfree(wtext);
+	return 0;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Make_Output
- *
- *	Purpose:	Generate a string from the dictionary of reply words.
- */
-static wchar_t *make_output(DICTIONARY *words)
+static int pub_forget(char *nick, char *host, char *hand, char *channel, char *text)
 {
-	static wchar_t *output = NULL;
-	register int i;
 	register int j;
-	int length, tmp = 0;
-	static wchar_t *output_none = NULL;
+	int phrase;
+	bool fnd;
+	DICTIONARY *words;
+	wchar_t *output, *wtext;
 
 	Context;
-	if(output_none == NULL)
-		output_none = nmalloc(512);
-
-	if(output == NULL) {
-		output = (wchar_t *)nmalloc(sizeof(wchar_t));
-		if(output == NULL) {
-			error("make_output", "Unable to allocate output");
-			return output_none;
-		}
-	}
-
-	if(words->size == 0) {
-		if(output_none != NULL)
-			wcscpy(output_none, L"I am utterly speechless!");
-		return output_none;
+	setlocale(LC_ALL, "");
+	putlog(LOG_MISC, "*", "forget  %s  by %s", text, hand);
+	if(!text[0])
+		return 0;
+	if(!TRY_MODEL()) {
+		dprintf(DP_HELP, "PRIVMSG %s :%s\n", channel, BUSY_TEXT);
+		return 0;
 	}
 
-	length = 1;
-	for(i=0; i<words->size; ++i)
-		length += (words->entry[i].length+1);
-
-	output = (wchar_t *)nrealloc(output, sizeof(wchar_t)*length);
-	if(output == NULL) {
-		error("make_output", "Unable to reallocate output.");
-		if(output_none != NULL)
-			wcscpy(output_none, L"I forgot what I was going to say!");
-		return output_none;
-	}
+	words = new_dictionary();
+	wtext = locale_to_wchar(text);
+	phrase = find_phrase(wtext, &fnd);
+	if(fnd) {
+		words->size=PHRASE(model, phrase)[0]-1;
+		if(realloc_dictionary(words)==NULL) {
+			error("pub_forget", "Unable to reallocate dictionary");
+			UNLOCK_MODEL();
+			return 0;
+		}
+		for(j=0; j<words->size; j++)
+			words->entry[j] = model->dictionary->entry[PHRASE(model, phrase)[j+1]];
 
-	length = 0;
-	for(i=0; i<words->size; ++i) {
-		if (words->entry[i].word[0] == (wchar_t)31)
-			tmp = 1;
-		else tmp = 0;
-		if (i>0 && (words->entry[i].word[0] != (wchar_t)31))
-			output[length++]=L' ';
-		for(j=0; j<words->entry[i].length-tmp; ++j)
-			output[length++]=words->entry[i].word[j+tmp];
+		output = make_output(replycontext, words);
+		capitalize(output);
+		char *loutput=wchar_to_locale(output);
+		dprintf(DP_HELP, "PRIVMSG %s :You mean \"%s\"? OK, I'll try...\n", channel, loutput);
+		nfree(loutput);
+		del_all_phrases(phrase);
+		trimdictionary();
+	} else {
+		dprintf(DP_HELP, "PRIVMSG %s :There is no way that I am going to forget about that, sorry.\n", channel);
 	}
+	UNLOCK_MODEL();
 
-	output[length]=L'\0';
-
-	return output;
+	nfree(wtext);
+	return 0;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Babble
- *
- *	Purpose:	Return a random symbol from the current context, or a
- *			zero symbol identifier if we've reached either the
- *			start or end of the sentence.  Select the symbol based
- *			on probabilities, favouring keywords.  In all cases,
- *			use the longest available context to choose the symbol.
- */
-static int babble(MODEL *model, DICTIONARY *keys, DICTIONARY *words)
+static int pub_forgetword(char *nick, char *host, char *hand, char *channel, char *text)
 {
-	TREE *node = NULL;
-	register int i;
-	int count;
-	int symbol = 0;
-	bool fnd, fnd2;
-
-	Context;
-	/*
-	 *	Select the longest available context.
-	 */
-	for(i=0; i<=model->order; ++i)
-		if(model->halcontext[i] != NULL)
-			node=model->halcontext[i];
+	SYMBOL symbol;
+	int num;
+	DICTIONARY *words=NULL;
+	wchar_t *wtext=NULL;
 
-	if(node->branch == 0)
+	if(!text[0])
 		return 0;
 
-	/*
-	 *	Choose a symbol at random from this context.
-	 */
-	i = rnd(node->branch);
-	count = rnd(node->usage);
-	while(count >= 0) {
-		/*
-		 *	If the symbol occurs as a keyword, then use it.  Only use an
-		 *	auxilliary keyword if a normal keyword has already been used.
-		 */
-		symbol = node->tree[i]->symbol;
-
-		search_dictionary(keys, model->dictionary->entry[symbol], &fnd);
-		search_dictionary(aux, model->dictionary->entry[symbol], &fnd2);
-		if(fnd && ((used_key==TRUE) || !fnd2) && (word_exists(words, model->dictionary->entry[symbol])==FALSE)) {
-			used_key = TRUE;
-			break;
-		}
-		count -= node->tree[i]->count;
-		i = (i >= (node->branch-1)) ? 0 : i+1;
+	Context;
+	setlocale(LC_ALL, "");
+	if(!TRY_MODEL()) {
+		dprintf(DP_HELP, "PRIVMSG %s :%s\n", channel, BUSY_TEXT);
+		return 0;
+	}
+	wtext=locale_to_wchar(text);
+	putlog(LOG_MISC, "*", "forget %s by %s", text, hand);
+	words=new_dictionary();
+	upper(wtext);
+	make_words(wtext, words);
+	if(!(symbol = find_word(model->dictionary, words->entry[0]))) {
+		UNLOCK_MODEL();
+		dprintf(DP_HELP, "PRIVMSG %s :I am not familiar with that word.\n", channel);
+		nfree(wtext);
+		return 0;
 	}
 
-	return symbol;
+	num = del_word_phrases(symbol);
+	trimdictionary();
+	UNLOCK_MODEL();
+	capitalize(wtext);
+	char *lwtext=wchar_to_locale(wtext);
+	dprintf(DP_HELP, "PRIVMSG %s :%s has been mentioned to me %d times in the past. But it's all forgotten now.\n", channel, lwtext, num);
+	nfree(lwtext);
+	free_dictionary(words);
+	nfree(wtext);
+	return 0;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Word_Exists
- *
- *	Purpose:	A silly brute-force searcher for the reply string.
- */
-static bool word_exists(DICTIONARY *dictionary, STRING word)
+static int dcc_megaver(struct userrec *u, int idx, char *text)
 {
-	register int i;
-
 	Context;
-	for(i=0; i<dictionary->size; ++i)
-		if(wordcmp(dictionary->entry[i], word) == 0)
-			return TRUE;
-	return FALSE;
+	if(!floodcheck())
+		return 0;
+	dprintf(idx, "MegaHAL module v%s by z0rc, Zev ^Baron^ Toledano and Jason Hutchens\n", VER);
+	return 0;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Seed
- *
- *	Purpose:	Seed the reply by guaranteeing that it contains a
- *			keyword, if one exists.
- */
-static int seed(MODEL *model, DICTIONARY *keys)
+static int pub_megaver(char *nick, char *host, char *hand, char *channel, char *text)
 {
-	register int i;
-	int symbol;
-	int stop;
-	bool fnd;
-
 	Context;
-	/*
-	 *	Fix, thanks to Mark Tarrabain
-	 */
-	if(model->halcontext[0]->branch == 0)
-		symbol = 0;
-	else
-		symbol = model->halcontext[0]->tree[rnd(model->halcontext[0]->branch)]->symbol;
-
-	if(keys->size>0) {
-		i = rnd(keys->size);
-		stop = i;
-		while(TRUE) {
-			search_dictionary(aux, keys->entry[i], &fnd);
-			if((find_word(model->dictionary, keys->entry[i])!=0) && !fnd) {
-				symbol = find_word(model->dictionary, keys->entry[i]);
-				return symbol;
-			}
-			++i;
-			if(i == keys->size)
-				i=0;
-			if(i == stop)
-				return symbol;
-		}
-	}
-
-	return symbol;
+	if(!floodcheck())
+		return 0;
+	dprintf(DP_HELP, "PRIVMSG %s :MegaHAL module v%s by z0rc, Zev ^Baron^ Toledano and Jason Hutchens\n", channel, VER);
+	return 0;
 }
 
-/*---------------------------------------------------------------------------*/
 
-/*
- *	Function:	New_Swap
- *
- *	Purpose:	Allocate a new swap structure.
- */
-static SWAP *new_swap(void)
+// returns the amount of branches and nodes in a tree
+// if branch is specified it goes to a subbranch of the main 2 TREES
+// forward and backward can be specified too
+static int tcl_treesize STDVAR
 {
-	SWAP *list;
+	char s[50];
+	int branch = -1;
+	int backward = 0;
 
 	Context;
-	list = (SWAP *)nmalloc(sizeof(SWAP));
-	if(list == NULL) {
-		error("new_swap", "Unable to allocate swap");
-		return NULL;
+	if(argv[1])
+		branch = atoi(argv[1]);
+	if(argv[2])
+		backward = atoi(argv[2]);
+
+	if(!TRY_MODEL()) {
+		Tcl_AppendResult(irp, BUSY_TEXT, NULL);
+		return TCL_ERROR;
 	}
-	list->size = 0;
-	list->from = NULL;
-	list->to = NULL;
+	if(backward) {
+		if((branch < model->backward->branch) && (branch > -1))
+			sprintf(s, "%d %d %d %d", model->backward->tree[branch]->branch, recurse_tree(model->backward->tree[branch]), COUNTS(model->backward)[branch], model->backward->tree[branch]->usage);
+		else
+			sprintf(s, "%d %d %d %d", model->backward->branch, recurse_tree(model->backward), 0, model->backward->usage);
+	} else {
+		if((branch < model->forward->branch) && (branch > -1))
+			sprintf(s, "%d %d %d %d", model->forward->tree[branch]->branch, recurse_tree(model->forward->tree[branch]), COUNTS(model->forward)[branch], model->forward->tree[branch]->usage);
+		else
+			sprintf(s, "%d %d %d %d", model->forward->branch, recurse_tree(model->forward), 0, model->forward->usage);
+	}
+	UNLOCK_MODEL();
 
-	return list;
+	Tcl_AppendResult(irp, s, NULL);
+	return TCL_OK;
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Add_Swap
- *
- *	Purpose:	Add a new entry to the swap structure.
- */
-static void add_swap(SWAP *list, wchar_t *s, wchar_t *d)
-{
-	Context;
-	list->size += 1;
 
-	if(list->from == NULL) {
-		list->from = (STRING *)nmalloc(sizeof(STRING));
-		if(list->from == NULL) {
-			error("add_swap", "Unable to allocate list->from");
-			return;
-		}
-	}
+/* The following two functions are just for playing around in the brain and to view branches
+   They're a tad messy but can be used to learn about the brain, debug, etc */
 
-	if(list->to == NULL) {
-		list->to = (STRING *)nmalloc(sizeof(STRING));
-		if(list->to == NULL) {
-			error("add_swap", "Unable to allocate list->to");
-			return;
-		}
-	}
+static void recurse_branch(BRANCHVIEW *view, TREE *node)
+{
+	register int i, j, k;
+	int tmp=0;
+	wchar_t s[32];
 
-	list->from = (STRING *)nrealloc(list->from, sizeof(STRING)*(list->size));
-	if(list->from == NULL) {
-		error("add_swap", "Unable to reallocate from");
-		return;
+	Context;
+	if(model->dictionary && (node->symbol < model->dictionary->size)) {
+		if(view->text[0] && view->text[wcslen(view->text)-1] == L'\n')
+			wcscat(view->text, view->indent);
+		wcscat(view->text, L" ");
+		swprintf(s, 32, L"[%d]", node->symbol);
+		wcscat(view->text, s);
+		if((int)model->dictionary->entry[node->symbol].word[0] == 31)
+			tmp = 1;
+		else
+			tmp = 0;
+		wcsncat(view->text, model->dictionary->entry[node->symbol].word+tmp, model->dictionary->entry[node->symbol].length-tmp);
+		swprintf(s, 32, L"(%ld)", node->usage);
+		wcscat(view->text, s);
+		if(view->level < 8)
+			view->length[view->level] = model->dictionary->entry[node->symbol].length+1+wcslen(s);
 	}
 
-	list->to = (STRING *)realloc(list->to, sizeof(STRING)*(list->size));
-	if(list->to == NULL) {
-		error("add_swap", "Unable to reallocate to");
-		return;
+	for(i=0; i<node->branch; ++i) {
+		++view->level;
+		view->newl = TRUE;
+		recurse_branch(view, node->tree[i]);
+		--view->level;
+		if(view->newl)
+			wcscat(view->text, L"\n");
+		view->indent[0] = L'\0';
+		for (j=0; j<=view->level && j<8; j++)
+			for (k=0; k<view->length[j] && wcslen(view->indent)<511; k++)
+				wcscat(view->indent, L" ");
+		view->newl = FALSE;
 	}
-
-	list->from[list->size-1].length = wcslen(s);
-	list->from[list->size-1].word = mystrdup(s);
-	list->to[list->size-1].length = wcslen(d);
-	list->to[list->size-1].word = mystrdup(d);
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Initialize_Swap
- *
- *	Purpose:	Read a swap structure from a file.
- */
-static SWAP *initialize_swap(char *filename)
+static int tcl_viewbranch STDVAR
 {
-	SWAP *list;
-	FILE *file = NULL;
-	char buffer[1024];
-	char *from;
-	char *to;
+	int branch = -1;
+	int backward = 0;
+	BRANCHVIEW *view;
 
 	Context;
 	setlocale(LC_ALL, "");
-	list = new_swap();
-
-	if(filename == NULL)
-		return list;
-
-	file = fopen(filename, "r");
-	if(file == NULL)
-		return list;
+	if(argv[1])
+		branch = atoi(argv[1]);
+	if(argv[2])
+		backward = atoi(argv[2]);
+	if(!TRY_MODEL()) {
+		Tcl_AppendResult(irp, BUSY_TEXT, NULL);
+		return TCL_ERROR;
+	}
+	view = (BRANCHVIEW *)nmalloc(sizeof(BRANCHVIEW));
+	if(view == NULL)
+		return TCL_ERROR;
+	view->text[0] = L'\0';
+	view->indent[0] = L'\0';
+	view->level = 0;
+	view->newl = TRUE;
 
-	while(!feof(file)) {
-		if(fgets(buffer, 1024, file)==NULL)
-			break;
-		if(buffer[0]=='#')
-			continue;
-		from = strtok(buffer, "\t ");
-		to = strtok(NULL, "\t \n#");
-		if (from && to) {
-			wchar_t * wfrom = locale_to_wchar(from);
-			wchar_t * wto = locale_to_wchar(to);
-			add_swap(list, wfrom , wto);
+	if(backward) {
+		if ((branch > -1) && (branch < model->backward->branch)) {
+			if(model->backward->tree[branch]->branch > 200)
+				swprintf(view->text, 512, L"Branch is too big");
+			else
+				recurse_branch(view, model->backward->tree[branch]);
+		} else {
+			if(model->backward->branch > 200)
+				swprintf(view->text, 512, L"Branch out of range or too big");
+			else
+				recurse_branch(view, model->backward);
+		}
+	} else {
+		if ((branch > -1) && (branch < model->forward->branch)) {
+			if(model->forward->tree[branch]->branch > 200)
+				swprintf(view->text, 512, L"Branch is too big");
+			else
+				recurse_branch(view, model->forward->tree[branch]);
+		} else {
+			if(model->forward->branch > 200)
+				swprintf(view->text, 512, L"Branch out of range or too big");
+			else
+				recurse_branch(view, model->forward);
 		}
 	}
+	UNLOCK_MODEL();
 
-	fclose(file);
-	return list;
+	char *lglob = wchar_to_locale(view->text);
+	Tcl_AppendResult(irp, lglob, NULL);
+	nfree(lglob);
+	nfree(view);
+	return TCL_OK;
 }
 
-/*---------------------------------------------------------------------------*/
 
-static void free_swap(SWAP *swap)
+static void reloadphrases()
 {
-	register int i;
-
+  char filename[PATH_SIZE];
 	Context;
-	if(swap == NULL)
-		return;
 
-	for(i=0; i<swap->size; ++i) {
-		free_word(swap->from[i]);
-		free_word(swap->to[i]);
-	}
-	nfree(swap->from);
-	nfree(swap->to);
-	nfree(swap);
-}
+	// the journal can't rebuild this, so it stops here and the caller saves the new model to start one
+	close_journal();
+	free_model(model);
+	model = new_model(order);
 
-/*---------------------------------------------------------------------------*/
+	snprintf(filename, sizeof(filename), "%s%smegahal.phr", directory_cache, SEP);
+	train(model, filename);
 
-/*
- *	Function:	Initialize_List
- *
- *	Purpose:	Read a dictionary from a file.
- */
-static DICTIONARY *initialize_list(char *filename)
+}
+
+// builds the global model again at another order from the phrases it holds - the dictionary and the phrases carry
+// over as they are, so only the trees are trained afresh, and like learn() the new order drops phrases without more
+// words than it, and then the words only they used
+static void rebuild_model(int neworder)
 {
-	DICTIONARY *list;
-	FILE *file = NULL;
-	STRING word = {0,NULL};
-	char *string = NULL;
-	wchar_t *wstring = NULL;
-	char buffer[1024];
+	MODEL *rebuilt;
+	DICTIONARY *dictionary;
+	register BYTE4 i, kept = 0;
 
 	Context;
-	setlocale(LC_ALL, "");
-	list = new_dictionary();
-
-	if(filename == NULL)
-		return list;
+	rebuilt = new_model(neworder);
+	if(rebuilt == NULL)
+		return;
 
-	file = fopen(filename, "r");
-	if(file == NULL)
-		return list;
+	// the journal can't rebuild this, so it stops here and the caller saves the new model to start one
+	close_journal();
+	dictionary = rebuilt->dictionary;
+	rebuilt->dictionary = model->dictionary;
+	model->dictionary = dictionary;
+	rebuilt->phrases = model->phrases;
+	rebuilt->index = model->index;
+	rebuilt->phrasecount = model->phrasecount;
+	initialize_phrases(&model->phrases);
+	initialize_index(&model->index);
+	model->phrasecount = 0;
+	free_model(model);
+	model = rebuilt;
 
-	while(!feof(file)) {
+	/*
+	 *	Take the phrases too short for the new order out of the index
+	 *	while the serials are still in order, which may free their
+	 *	symbols, and leave a gap where they were.
+	 */
+	for(i=0; i<model->phrasecount; ++i) {
+		// the length counts the terminator as well as the words
+		if(PHRASE(model, i)[0]-1 > neworder)
+			continue;
+		unindex_phrase(model, i);
+		PHRASE(model, i) = NULL;
+	}
 
-		if(fgets(buffer, 1024, file) == NULL)
-			break;
-		if(buffer[0] == '#')
+	for(i=0; i<model->phrasecount; ++i) {
+		if(PHRASE(model, i) == NULL)
 			continue;
-		string = strtok(buffer, "\t \n#");
-		if((string!=NULL) && (strlen(string)>0)) {
-			wstring = locale_to_wchar(string);
-			word.length = wcslen(wstring);
-			word.word = locale_to_wchar(buffer);
-			add_word(list, word);
-			nfree(word.word);
-			nfree(wstring);
-		}
+		SERIAL(model, kept) = SERIAL(model, i);
+		PHRASE(model, kept++) = PHRASE(model, i);
+		learn_phrase(model, PHRASE(model, i));
 	}
 
-	fclose(file);
-	return list;
+	if(kept < model->phrasecount) {
+		model->phrasecount = kept;
+		trimdictionary();
+	}
 }
 
-/*---------------------------------------------------------------------------*/
-
-/*
- *	Function:	Rnd
- *
- *	Purpose:	Return a random integer between 0 and range-1.
- */
-static int rnd(int range)
+// reloads and relearns the brain with a new order size
+static int tcl_setmaxcontext STDVAR
 {
-	static bool flag=FALSE;
+	int neworder;
 
 	Context;
-	if(flag==FALSE) {
-		srand48(time(NULL));
+	neworder = order;
+	if(argv[1])
+		neworder = atoi(argv[1]);
+	if(neworder < 1 || neworder > 5 || neworder == order)
+		return 0;
+
+	if(!TRY_MODEL()) {
+		Tcl_AppendResult(irp, BUSY_TEXT, NULL);
+		return TCL_ERROR;
 	}
-	flag = TRUE;
-	return floor(drand48()*(double)(range));
+	order=neworder;
+	rebuild_model(neworder);
+	restart_journal();
+	UNLOCK_MODEL();
+	putlog(LOG_MISC, "*", "Brain transferred (order: %d)", order);
+	return TCL_OK;
 }
 
-/*---------------------------------------------------------------------------*/
+static int tcl_reloadphrases STDVAR
+{
+	Context;
+	if(!TRY_MODEL()) {
+		Tcl_AppendResult(irp, BUSY_TEXT, NULL);
+		return TCL_ERROR;
+	}
+	reloadphrases();
+	restart_journal();
+	UNLOCK_MODEL();
+	putlog(LOG_MISC, "*", "Phrases reloaded");
+	return TCL_OK;
+}
 
-static void load_personality(MODEL **model)
+static int tcl_learnfile STDVAR
 {
-	FILE *file;
-	char filename[512];
-	char filename_train[512];
-	bool btrain = FALSE;
+	char filename[PATH_SIZE], result[64];
 
 	Context;
-	setlocale(LC_ALL, "");
+	BADARGS(1, 2, " ?filename|cancel?");
 
-	/*
-	 *	Check to see if the brain exists
-	 */
-	snprintf(filename, sizeof(filename), "%s%smegahal.brn", directory_cache, SEP);
-	snprintf(filename_train, sizeof(filename_train), "%s%smegahal.trn", directory_resources, SEP);
-	file = fopen(filename, "r");
-	if(file == NULL) {
-		file = fopen(filename_train, "r");
-		btrain = TRUE;
-		if(file == NULL) {
-			error("load_personality", "Unable to allocate directory");
+	if(argc == 1) {
+		// how far the file being learnt has got, or nothing
+		if(learning != NULL) {
+			snprintf(result, sizeof(result), "%d %ld", learn_percent(), learning->lines);
+			Tcl_AppendResult(irp, learning->name, " ", result, NULL);
 		}
+		return TCL_OK;
 	}
-
-	if(!file) {
-		error("load_personality", "Unable to find brain");
-		return;
+	if(!strcmp(argv[1], "cancel")) {
+		if(learning != NULL) {
+			if(!TRY_MODEL()) {
+				Tcl_AppendResult(irp, BUSY_TEXT, NULL);
+				return TCL_ERROR;
+			}
+			putlog(LOG_MISC, "*", "Stopped learning file: %s (%ld lines)", learning->name, learning->lines);
+			stop_training(learning);
+			learning = NULL;
+			UNLOCK_MODEL();
+		}
+		return TCL_OK;
+	}
+	if(learning != NULL) {
+		putlog(LOG_MISC, "*", "Already learning file: %s", learning->name);
+		return TCL_OK;
 	}
-	fclose(file);
-	putlog(LOG_MISC, "*", "Changing to MegaHAL personality brains = \"%s\", train = \"%s\".\n", directory_cache, directory_resources);
-
-	/*
-	 *	Free the current personality
-	 */
-	free_model(*model);
-	free_words(ban);
-	free_dictionary(ban);
-	free_words(aux);
-	free_dictionary(aux);
-	free_swap(swp);
-
-	/*
-	 *	Create a language model
-	 */
-	*model = new_model(order);
 
-	/*
-	 *	Train the model on a text if one exists
-	 */
-	if(btrain || load_model(filename, *model) == FALSE) {
-		train(*model, filename_train);
+	snprintf(filename, sizeof(filename), "%s%s%s", directory_resources, SEP, argv[1]);
+	if(!TRY_MODEL()) {
+		Tcl_AppendResult(irp, BUSY_TEXT, NULL);
+		return TCL_ERROR;
 	}
+	learning = start_training(filename);
+	UNLOCK_MODEL();
+	if(learning == NULL)
+		return TCL_OK;
 
-	/*
-	 *	Read a dictionary containing banned keywords, auxiliary keywords,
-	 *	greeting keywords and swap keywords
-	 */
-	snprintf(filename, sizeof(filename), "%s%smegahal.ban", directory_resources, SEP);
-	ban = initialize_list(filename);
-	snprintf(filename, sizeof(filename), "%s%smegahal.aux", directory_resources, SEP);
-	aux = initialize_list(filename);
-	snprintf(filename, sizeof(filename), "%s%smegahal.swp", directory_resources, SEP);
-	swp = initialize_swap(filename);
+	learnlogged = now;
+	putlog(LOG_MISC, "*", "Learning file: %s", filename);
+	return TCL_OK;
 }
 
-/*---------------------------------------------------------------------------*/
-
-static void change_personality(MODEL **model, const char * _directory_resources, const char * _directory_cache)
+static int tcl_trimbrain STDVAR
 {
-	if (_directory_resources) {
-		snprintf(directory_resources, sizeof(directory_resources), "%s", _directory_resources);
-	}
+	int newsize;
 
-	if (_directory_cache) {
-		snprintf(directory_cache, sizeof(directory_cache), "%s", _directory_cache);
-	} else if (_directory_resources) {
-		snprintf(directory_cache, sizeof(directory_cache), "%s%s%s", directory_resources, SEP, DIR_DEFAULT_CACHE);
-	}
+	Context;
+	putlog(LOG_MISC, "*", "Trimming brain...");
+	newsize = maxsize;
+	// get the size we are aiming for
+	if(argv[1])
+		newsize = atoi(argv[1]);
 
-	load_personality(model);
+	if(!TRY_MODEL()) {
+		// a reply has the model, so it is trimmed the next second it is free
+		trimwanted = newsize;
+		putlog(LOG_MISC, "*", "Brain will be trimmed once the reply in progress is done");
+		return TCL_OK;
+	}
+	trimbrain(newsize);
+	UNLOCK_MODEL();
+	putlog(LOG_MISC, "*", "Brain trimmed");
+	return TCL_OK;
 }
 
-/*---------------------------------------------------------------------------*/
 
-static void free_words(DICTIONARY *words)
+static int tcl_savebrain STDVAR
 {
-	register int i;
+	bool wait;
 
 	Context;
-	if(words == NULL)
-		return;
+	BADARGS(1, 2, " ?wait?");
+	wait = (argc == 2 && !strcmp(argv[1], "wait"));
+	if(argc == 2 && !wait) {
+		Tcl_AppendResult(irp, "bad option \"", argv[1], "\": should be wait", NULL);
+		return TCL_ERROR;
+	}
+	if(wait) {
+		wait_for_saver();
+	} else if(saver > 0) {
+		putlog(LOG_MISC, "*", "Brain is already being saved");
+		return TCL_OK;
+	}
+	putlog(LOG_MISC, "*", "Saving brain...");
+	// only a save that was told to wait waits for the reply in progress
+	if(wait)
+		LOCK_MODEL();
+	else if(!TRY_MODEL()) {
+		savewanted = TRUE;
+		putlog(LOG_MISC, "*", "Brain will be saved once the reply in progress is done");
+		return TCL_OK;
+	}
+	save_now(wait);
+	UNLOCK_MODEL();
+	return TCL_OK;
+}
 
-	if(words->entry != NULL)
-		for(i=0; i<words->size; ++i)
-			free_word(words->entry[i]);
+static int tcl_reloadbrain STDVAR
+{
+	Context;
+	setlocale(LC_ALL, "");
+	// like savebrain, reloadbrain wait waits for the reply in progress instead of saying it is busy
+	bool wait = (argc >= 2 && !strcmp(argv[1], "wait"));
+	char *resources = argc >= 2+wait ? argv[1+wait] : NULL;
+	char *cache = argc >= 3+wait ? argv[2+wait] : NULL;
+	wait_for_saver();
+	if(wait)
+		LOCK_MODEL();
+	else if(!TRY_MODEL()) {
+		Tcl_AppendResult(irp, BUSY_TEXT, NULL);
+		return TCL_ERROR;
+	}
+	change_personality(&model, resources, cache);
+	UNLOCK_MODEL();
+	putlog(LOG_MISC, "*", "Brain reloaded");
+	return TCL_OK;
 }
 
-/*---------------------------------------------------------------------------*/
+static int tcl_setmegabotnick STDVAR
+{
+	Context;
+	setlocale(LC_ALL, "");
+	BADARGS(2, 2, " <botnick>");
+	wcscpy(mbotnick,locale_to_wchar(argv[1]));
+	mystrlwr(mbotnick);
+	return TCL_OK;
+}
 
-static void free_word(STRING word)
+static int tcl_learningmode STDVAR
 {
 	Context;
-	nfree(word.word);
+	BADARGS(2, 2, " on/off");
+	if (!strcasecmp(argv[1], "off")) {
+		learningmode = FALSE;
+		putlog(LOG_MISC, "*", "Brain learning mode set to off");
+	} else {
+		learningmode = TRUE;
+		putlog(LOG_MISC, "*", "Brain learning mode set to on");
+	}
+	return TCL_OK;
 }
 
+static int tcl_talkfrequency STDVAR
+{
+	Context;
+	BADARGS(2, 2, " <#oflines>");
+	if (argv[1]) {
+		talkfrequency = atoi(argv[1]);
+		putlog(LOG_MISC, "*", "Talk frequency set to %d", atoi(argv[1]));
+	}
+	return 0;
+}
 
 /* Some personal notes by ^Baron^ about the inner structure of the brain (so that I dont have to break my head over the data structure again):
  * All words are stored in a single DICTIONARY struct
@@ -4088,6 +2335,7 @@ static void free_word(STRING word)
  * The main dictionary is always in model->dictionary
  * TREE is the most commonly used struct and each instance represents a word
  * The word is stored as a symbol with usage and count counters (count=branch use count, usage=how many times all its subbranches are used)
+ * (the count of a TREE actually lives in its parent, in the COUNTS() array next to the child pointers and their SYMBOLS())
  * Each TREE can have many branches which are stored in the tree field as an array of TREES and the branch field contains the size of this array
  * There is only one MODEL and it contains the main two TREE branches from which everything else is found
  * The halcontext stores temporary references to TREES while its building or learning a sentence etc and it is reset to NULL every time
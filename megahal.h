@@ -77,8 +77,38 @@
 #define BYTE1 uint8_t
 #define BYTE2 uint16_t
 #define BYTE4 uint32_t
+#define BYTE8 uint64_t
 
 #define SEP "/"
+// room for a directory setting, a separator and the longest file name kept in it
+#define PATH_SIZE 576
+
+/*
+ *	Symbols, and the counts stored beside them, are 16 bits wide unless
+ *	the module is built with MEGAHAL_WIDE_SYMBOLS defined, which lifts the
+ *	65535 word and count ceilings for big brains at the cost of twice the
+ *	space per child.  The width is recorded in the brain file.
+ */
+#ifdef MEGAHAL_WIDE_SYMBOLS
+#define SYMBOL BYTE4
+#define SYMBOL_MAX UINT32_MAX
+#else
+#define SYMBOL BYTE2
+#define SYMBOL_MAX UINT16_MAX
+#endif
+
+#define POOL_SLAB 262144
+#define POOL_CLASSES 13
+#define PHRASE_CHUNK 65536
+#define SEARCH_WINDOW 32
+#define DICTIONARY_BUCKETS 64
+#define REPLY_GUARD 3000000
+#define MAX_GENERATORS 64
+#define SAVE_BLOCK 1048576
+#define SAVE_COLUMN 16384
+#define TRAIN_BATCH 4096
+#define TRAIN_STEP 256
+#define TRAIN_SLICE 200000
 
 /*===========================================================================*/
 
@@ -86,15 +116,29 @@
 #undef TRUE
 typedef enum { FALSE, TRUE } bool;
 
+/*
+ *	Words are always stored in upper case, with the hash of that form
+ *	cached beside them, so that two words are only compared character
+ *	by character when their hashes and lengths already agree.
+ */
 typedef struct {
 	BYTE1 length;
+	BYTE4 hash;
 	wchar_t *word;
 } STRING;
 
+/*
+ *	Words are found through an open addressing hash table keyed on the
+ *	cached hash of each word.  Each bucket holds the word's symbol plus one, or
+ *	zero when it is empty, and the table is kept at most half full.
+ *	Dictionaries that are only ever appended to, such as the words of a
+ *	message or a reply, have no table at all.
+ */
 typedef struct {
 	BYTE4 size;
 	STRING *entry;
-	BYTE2 *index;
+	BYTE4 buckets;
+	SYMBOL *table;
 } DICTIONARY;
 
 typedef struct {
@@ -103,24 +147,313 @@ typedef struct {
 	STRING *to;
 } SWAP;
 
+/*
+ *	A set of symbols, one bit per symbol of the model dictionary.  Symbols
+ *	beyond the size of the set are never in it.
+ */
+typedef struct {
+	BYTE4 size;
+	BYTE4 *bits;
+} BITSET;
+
+#define SET_BIT(set,symbol) ((set)->bits[(symbol)>>5] |= (BYTE4)1<<((symbol)&31))
+#define TEST_BIT(set,symbol) (((symbol) < (set)->size) && ((set)->bits[(symbol)>>5]>>((symbol)&31)&1))
+
+/*
+ *	The children of a node are kept in one block: capacity child pointers
+ *	followed by the symbols and then the counts of those children, so
+ *	that searching and walking a context only touches dense arrays.
+ */
 typedef struct NODE {
-	BYTE2 symbol;
+	SYMBOL symbol;
 	BYTE4 usage;
-	BYTE2 count;
-	BYTE2 branch;
+	SYMBOL branch;
+	BYTE4 capacity;
 	struct NODE **tree;
 } TREE;
 
+#define SYMBOLS(node) ((SYMBOL *)((node)->tree+(node)->capacity))
+#define COUNTS(node) (SYMBOLS(node)+(node)->capacity)
+#define ARRAY_SIZE(class) ((sizeof(TREE *)+2*sizeof(SYMBOL))<<(class))
+
+typedef struct SLAB {
+	struct SLAB *next;
+} SLAB;
+
+typedef struct BLOCK {
+	struct BLOCK *prev;
+	struct BLOCK *next;
+} BLOCK;
+
+/*
+ *	The pool counts the nodes in use and the bytes it has allocated as
+ *	they change, so that the size of a model is known without walking
+ *	its trees.
+ */
+typedef struct {
+	SLAB *slab;
+	char *top;
+	size_t left;
+	TREE *free_node;
+	void *free_array[POOL_CLASSES];
+	BLOCK *big;
+	BYTE4 nodes;
+	size_t bytes;
+} NODEPOOL;
+
+/*
+ *	The phrases of a model are kept in the order they were learnt, each
+ *	one its length followed by its symbols, packed into chunks of at least
+ *	PHRASE_CHUNK symbols.  A ring of pointers to them, whose capacity is a
+ *	power of two, makes adding a phrase and dropping the oldest O(1).  A
+ *	phrase learnt again is stored once, and every copy in the ring points
+ *	at the same symbols.  A phrase never straddles two chunks, and a chunk
+ *	counts the distinct phrases in it, so that it is freed once the last
+ *	of them goes.
+ */
+typedef struct PHRASECHUNK {
+	struct PHRASECHUNK *next;
+	struct PHRASECHUNK *prev;
+	BYTE4 size;
+	BYTE4 used;
+	BYTE4 live;
+} PHRASECHUNK;
+
+typedef struct {
+	SYMBOL **ring;
+	BYTE4 *serial;
+	BYTE4 capacity;
+	BYTE4 first;
+	BYTE4 nextserial;
+	PHRASECHUNK *oldest;
+	PHRASECHUNK *newest;
+	size_t bytes;
+} PHRASESTORE;
+
+#define CHUNK_SYMBOLS(chunk) ((SYMBOL *)((chunk)+1))
+
+/*
+ *	Every phrase also gets a serial number, kept in a ring beside the
+ *	pointers, which goes up with each phrase learnt and doesn't change
+ *	when the phrases before it are deleted.  A serial is turned back into
+ *	the phrase's place by a binary search.
+ *
+ *	The index groups identical phrases in a hash table.  A group owns the
+ *	symbols its copies share and lists their serials, so how many there
+ *	are is its reference count, and it goes with the last of them.  The
+ *	groups are numbered in the order they were made, and each symbol
+ *	lists the groups it is in, so that forgetting only looks at the
+ *	phrases concerned.  Once most numbers belong to groups that have gone
+ *	the rest are numbered again from 0.
+ *
+ *	A list is kept in ascending order.  The entries before head have been
+ *	deleted from the front, and a list that never held more than one keeps
+ *	it in place of an array.
+ */
+typedef struct {
+	BYTE4 head;
+	BYTE4 size;
+	BYTE4 capacity;
+	union {
+		BYTE4 one;
+		BYTE4 *many;
+	} entry;
+} POSTINGS;
+
+typedef struct {
+	BYTE4 hash;
+	BYTE4 next;
+	SYMBOL *phrase;
+	PHRASECHUNK *chunk;
+	POSTINGS copies;
+} PHRASEGROUP;
+
+typedef struct {
+	POSTINGS *symbol;
+	BYTE4 symbols;
+	PHRASEGROUP *group;
+	BYTE4 groups;
+	BYTE4 capacity;
+	BYTE4 live;
+	BYTE4 *bucket;
+	BYTE4 buckets;
+	size_t bytes;
+} PHRASEINDEX;
+
+#define NO_GROUP UINT32_MAX
+#define POSTED(list) ((list)->capacity == 0 ? &(list)->entry.one : (list)->entry.many)
+
 typedef struct {
 	BYTE1 order;
+	NODEPOOL pool;
 	TREE *forward;
 	TREE *backward;
 	TREE **halcontext;
 	BYTE4 phrasecount;
-	BYTE2 **phrase;
+	PHRASESTORE phrases;
+	PHRASEINDEX index;
 	DICTIONARY *dictionary;
+	BYTE8 journal;
 } MODEL;
 
+#define PHRASE(model,i) ((model)->phrases.ring[((model)->phrases.first+(i))&((model)->phrases.capacity-1)])
+#define SERIAL(model,i) ((model)->phrases.serial[((model)->phrases.first+(i))&((model)->phrases.capacity-1)])
+
+/*
+ *	Between saves, everything learnt and forgotten is appended to a
+ *	journal as records of a type byte, a length and that many bytes, so
+ *	that it can be replayed on top of the brain after a crash.  Each
+ *	brain names the journal that carries on from it by a random token,
+ *	and a journal that was carried on in another ends with a record
+ *	holding that one's token.
+ */
+typedef struct {
+	char cookie[8];
+	BYTE1 version;
+	BYTE1 charwidth;
+	BYTE1 pad[6];
+	BYTE8 token;
+} JOURNALHEADER;
+
+/*
+ *	Everything needed to generate and evaluate replies against a model
+ *	which is only read, so that several can search at once: a context
+ *	array, random number state, buffers for the current and the best
+ *	reply and the set of symbols already used in the current one.  A
+ *	generator running on a thread of its own never logs, it leaves what
+ *	went wrong in trouble for generate_reply() to log once the search is over.
+ */
+typedef struct GENCONTEXT {
+	TREE **halcontext;
+	int order;
+	unsigned short seed[3];
+	DICTIONARY *replies;
+	DICTIONARY *best;
+	float max_surprise;
+	BITSET usedset;
+	bool used_key;
+	const char *trouble;
+	struct REPLYCONTEXT *owner;
+} GENCONTEXT;
+
+/*
+ *	The state of making one reply at a time: the keywords and symbol sets
+ *	of the input, the output buffer, the search shared by the generators
+ *	and the generators themselves.  Nothing in the engine keeps reply
+ *	state anywhere else, so each context can be used by its own thread
+ *	and reused from one reply to the next.
+ */
+typedef struct REPLYCONTEXT {
+	DICTIONARY *keys;
+	DICTIONARY *dummy;
+	BITSET keyset;
+	BITSET auxset;
+	BITSET banset;
+	wchar_t *output;
+	wchar_t message[64];
+	MODEL *model;
+	DICTIONARY *words;
+	long long basetime;
+	int budget;
+	int candidates;
+	atomic_int done;
+	int size;
+	GENCONTEXT *gen;
+} REPLYCONTEXT;
+
+/*
+ *	What viewbranch is building while it walks a branch.
+ */
+typedef struct {
+	wchar_t text[15000];
+	wchar_t indent[512];
+	int length[8];
+	int level;
+	bool newl;
+} BRANCHVIEW;
+
+/*
+ *	A brain is saved through a block of memory that is only written out
+ *	when it fills up, instead of one fwrite() for every field.
+ */
+typedef struct {
+	FILE *file;
+	BYTE1 *data;
+	size_t used;
+	size_t size;
+	size_t offset;
+	bool failed;
+} SAVEBUFFER;
+
+/*
+ *	The columns of a tree are saved in one walk over it, each gathered in
+ *	a block of its own and written at its place in the file when it fills.
+ */
+typedef struct {
+	BYTE1 data[SAVE_COLUMN];
+	size_t used;
+	off_t at;
+} SAVECOLUMN;
+
+/*
+ *	Since format 2 a brain is a run of sections, each starting at a
+ *	multiple of eight bytes: the header, followed since format 3 by the
+ *	journal token, then for each tree its node count and one column each
+ *	of symbols, usages, counts and branches with the nodes in preorder,
+ *	then the dictionary as word offsets into one block
+ *	of characters and the phrases as offsets into one block of symbols.
+ *	Since format 4 that block holds each phrase once, and is followed by
+ *	the number of phrases and a column with which one each of them is.
+ *	Nothing in it is a pointer, so it is loaded straight from a mapping of
+ *	the file.  The cursor walks the mapping a section at a time.
+ */
+typedef struct {
+	BYTE1 *base;
+	size_t size;
+	size_t at;
+} MAPPING;
+
+#define MAPPED_SYMBOL(column,width,i) ((width)==sizeof(BYTE2) ? ((BYTE2 *)(column))[i] : (SYMBOL)((BYTE4 *)(column))[i])
+
+/*
+ *	A text file being learnt, read a batch of lines at a time and learnt a
+ *	step at a time, next being the first line of the batch not learnt yet.
+ *	The lines of a batch are kept in one block of text, each made into words
+ *	when its step comes, and the phrases a step adds to the model are kept
+ *	until the trees have been trained on them.
+ */
+typedef struct {
+	FILE *file;
+	char *name;
+	off_t length;
+	off_t done;
+	long lines;
+	int count;
+	int next;
+	char *text;
+	size_t used;
+	size_t size;
+	size_t start[TRAIN_BATCH];
+	DICTIONARY *words[TRAIN_BATCH];
+	SYMBOL *phrases[TRAIN_BATCH];
+} TRAINING;
+
+/*
+ *	The lines or phrases of a batch that one thread works on, and the tree
+ *	it learns them into before they are merged with the model's.  A helper
+ *	thread runs work on it, and leaves the first error it meets in trouble.
+ */
+typedef struct {
+	TRAINING *training;
+	int first;
+	int last;
+	MODEL *partial;
+#ifdef MEGAHAL_THREADS
+	void *(*work)(void *);
+	char trouble[256];
+#endif
+} TRAINSHARE;
+
 typedef enum { UNKNOWN, QUIT, EXIT, SAVE, DELAY, HELP, SPEECH, VOICELIST, VOICE, BRAIN, PROGRESS, THINK } COMMAND_WORDS;
 
 typedef struct {
@@ -129,76 +462,204 @@ typedef struct {
 	COMMAND_WORDS command;
 } COMMAND;
 
+#ifdef MEGAHAL_THREADS
+/* a reply waiting for (or done by) the worker thread, and where to send it */
+typedef struct REPLYJOB {
+	struct REPLYJOB *next;
+	int idx;
+	long sock;
+	char *prefix;
+	char *nick;
+	char *chan;
+	wchar_t *text;
+	int budget;
+	wchar_t *output;
+} REPLYJOB;
+
+/* words put aside for learning while the worker has the model */
+typedef struct LEARNJOB {
+	struct LEARNJOB *next;
+	DICTIONARY *words;
+} LEARNJOB;
+
+/* a message from another thread, waiting for the main loop to log it */
+typedef struct LOGJOB {
+	struct LOGJOB *next;
+	int type;
+	char *chan;
+	char *text;
+} LOGJOB;
+#endif
+
 /* megahal funcs */
 
-static void add_aux(MODEL *, DICTIONARY *, STRING);
-static void add_key(MODEL *, DICTIONARY *, STRING);
-static void add_node(TREE *, TREE *, int);
+static void add_aux(MODEL *, REPLYCONTEXT *, STRING);
+static void add_key(MODEL *, REPLYCONTEXT *, STRING);
+static bool add_node(NODEPOOL *, TREE *, TREE *, int);
 static void add_swap(SWAP *, wchar_t *, wchar_t *);
-static TREE *add_symbol(TREE *, BYTE2);
-static BYTE2 add_word(DICTIONARY *, STRING);
-static int babble(MODEL *, DICTIONARY *, DICTIONARY *);
+static TREE *add_symbol(NODEPOOL *, TREE *, SYMBOL);
+static SYMBOL add_word(DICTIONARY *, STRING);
+static int babble(MODEL *, GENCONTEXT *, BITSET *);
 static bool boundary(wchar_t *, int);
 static void capitalize(wchar_t *);
 static void change_personality(MODEL **, const char *, const char *);
 static bool dissimilar(DICTIONARY *, DICTIONARY *);
 static void error(char *, char *, ...);
-static float evaluate_reply(MODEL *, DICTIONARY *, DICTIONARY *);
+static void report(char *);
+static float evaluate_reply(MODEL *, GENCONTEXT *, BITSET *, DICTIONARY *);
 static TREE *find_symbol(TREE *, int);
-static TREE *find_symbol_add(TREE *, int);
-static BYTE2 find_word(DICTIONARY *, STRING);
+static int find_symbol_add(NODEPOOL *, TREE *, int);
+static SYMBOL find_word(DICTIONARY *, STRING);
 static void free_dictionary(DICTIONARY *);
 static void free_model(MODEL *);
-static void free_tree(TREE *);
+static void free_tree(NODEPOOL *, TREE *);
+static void initialize_pool(NODEPOOL *);
+static void *pool_alloc(NODEPOOL *, size_t);
+static void free_pool(NODEPOOL *);
+static int array_class(int);
+static TREE **new_array(NODEPOOL *, int);
+static void free_array(NODEPOOL *, TREE **, int);
 static void free_word(STRING);
 static void free_words(DICTIONARY *);
-static wchar_t *generate_reply(MODEL *, DICTIONARY *);
-static void initialize_context(MODEL *);
+static wchar_t *generate_reply(MODEL *, REPLYCONTEXT *, DICTIONARY *, int);
+static long long usec_now(void);
+static void *search_replies(void *);
+static bool make_generators(REPLYCONTEXT *, MODEL *, int);
+static REPLYCONTEXT *new_replycontext(void);
+static void free_replycontext(REPLYCONTEXT *);
+static wchar_t *set_message(REPLYCONTEXT *, const wchar_t *);
+static void initialize_context(MODEL *, TREE **);
 static void initialize_dictionary(DICTIONARY *);
 static DICTIONARY *initialize_list(char *);
 static SWAP *initialize_swap(char *);
 static void free_swap(SWAP *);
 static void learn(MODEL *, DICTIONARY *);
+static SYMBOL *add_phrase(MODEL *, DICTIONARY *);
+static void learn_phrase(MODEL *, SYMBOL *);
+static TRAINING *start_training(char *);
+static int read_batch(TRAINING *);
+static bool learn_batch(TRAINING *, MODEL *, long long);
+static void learn_lines(TRAINING *, MODEL *, int, int, int);
+static void stop_training(TRAINING *);
+static int train_threads(int);
+static void run_shares(void *(*)(void *), TRAINSHARE *, int);
+#ifdef MEGAHAL_THREADS
+static void *run_share(void *);
+#endif
+static void *split_lines(void *);
+static void *learn_phrases(void *);
+static void merge_tree(NODEPOOL *, TREE *, TREE *);
 static void load_dictionary(FILE *, DICTIONARY *);
 static bool load_model(char *, MODEL *);
 static void load_personality(MODEL **);
-static void load_tree(FILE *, TREE *);
+static void load_tree(FILE *, NODEPOOL *, TREE *, SYMBOL *, int);
+static bool load_symbol(FILE *, int, SYMBOL *);
 static void load_word(FILE *, DICTIONARY *);
 static wchar_t *locale_to_wchar(char *);
-static DICTIONARY *make_keywords(MODEL *, DICTIONARY *);
-static wchar_t *make_output(DICTIONARY *);
+static DICTIONARY *make_keywords(MODEL *, REPLYCONTEXT *, DICTIONARY *);
+static bool resize_bitset(BITSET *, BYTE4);
+static void free_bitset(BITSET *);
+static void make_symbolset(MODEL *, BITSET *, DICTIONARY *);
+static wchar_t *make_output(REPLYCONTEXT *, DICTIONARY *);
 static void make_words(wchar_t *, DICTIONARY *);
 static DICTIONARY *new_dictionary(void);
 static MODEL *new_model(int);
-static TREE *new_node(void);
+static TREE *new_node(NODEPOOL *);
 static SWAP *new_swap(void);
-static DICTIONARY *reply(MODEL *, DICTIONARY *);
-static void save_dictionary(FILE *, DICTIONARY *);
-static void save_model(char *, MODEL *);
-static void save_tree(FILE *, TREE *);
-static void save_word(FILE *, STRING);
+static DICTIONARY *reply(MODEL *, GENCONTEXT *, DICTIONARY *, BITSET *);
+static int rnd(GENCONTEXT *, int);
+static void save_dictionary(SAVEBUFFER *, DICTIONARY *);
+static bool load_mapped_dictionary(MAPPING *, DICTIONARY *);
+static bool save_model(char *, MODEL *);
+static FILE *begin_save(char *, char *, size_t, const char *);
+static bool finish_save(FILE *, char *, char *, bool);
+static void save_groups(SAVEBUFFER *, MODEL *);
+static void save_tree(SAVEBUFFER *, TREE *);
+static void save_node(SAVECOLUMN *, SAVEBUFFER *, TREE *, SYMBOL);
+static void save_field(SAVECOLUMN *, SAVEBUFFER *, const void *, size_t);
+static void flush_column(SAVECOLUMN *, SAVEBUFFER *);
+static void save_padding(SAVEBUFFER *);
+static bool load_mapped(FILE *, MODEL *, int, int);
+static void journal_name(char *, size_t, BYTE8);
+static FILE *create_journal(BYTE8);
+static void write_journal(BYTE1, const void *, BYTE4);
+static void journal_words(DICTIONARY *);
+static bool replay_record(BYTE1, BYTE1 *, BYTE4, BYTE8 *);
+static void replay_journals(void);
+static void rotate_journal(void);
+static void prune_journals(BYTE8);
+static void sync_journal(void);
+static void close_journal(void);
+static bool save_brain(void);
+static void *map_section(MAPPING *, size_t);
+static bool load_mapped_tree(MAPPING *, NODEPOOL *, TREE *, int, int, SYMBOL *);
+static bool load_mapped_phrases(MAPPING *, MODEL *, int, int);
+static void save_bytes(SAVEBUFFER *, const void *, size_t);
+static void flush_savebuffer(SAVEBUFFER *);
 static int search_dictionary(DICTIONARY *, STRING, bool *);
+static BYTE4 hash_word(STRING);
+static void fold_word(STRING *);
+static BYTE4 find_bucket(DICTIONARY *, STRING);
+static bool rehash_dictionary(DICTIONARY *, BYTE4);
+static int count_below(SYMBOL *, int, SYMBOL);
 static int search_node(TREE *, int, bool *);
-static int seed(MODEL *, DICTIONARY *);
-static void show_dictionary(DICTIONARY *);
+static int seed(MODEL *, GENCONTEXT *, DICTIONARY *);
+static bool show_dictionary(DICTIONARY *);
 static void train(MODEL *, char *);
-static void update_context(MODEL *, int);
+static void update_context(MODEL *, TREE **, int);
 static void update_model(MODEL *, int);
 static void upper(wchar_t *);
 static bool warn(char *, char *, ...);
 static char *wchar_to_locale(wchar_t *);
 static int wordcmp(STRING, STRING);
-static int wordcmp2(STRING, wchar_t *);
-static bool word_exists(DICTIONARY *, STRING);
+static wchar_t *mystrdup(const wchar_t *);
+static int recurse_tree(TREE *);
+static void decrement_tree(NODEPOOL *, TREE *, TREE *);
+static void trimdictionary();
+static void renumber_tree(TREE *, SYMBOL *);
+static void trimbrain(int);
+static void del_phrase(int);
+static BYTE4 del_oldest_phrases(BYTE4, int);
+static void unlearn_phrase(MODEL *, SYMBOL *);
+static DICTIONARY *realloc_dictionary(DICTIONARY *);
+static TREE *realloc_tree(NODEPOOL *, TREE *);
+static void initialize_phrases(PHRASESTORE *);
+static void free_phrases(PHRASESTORE *);
+static bool reserve_phrases(MODEL *, BYTE4, size_t);
+static SYMBOL *append_phrase(MODEL *, SYMBOL);
+static void drop_oldest_phrases(MODEL *, BYTE4);
+static void remove_phrase(MODEL *, BYTE4);
+static SYMBOL *repeat_phrase(MODEL *, SYMBOL *);
+static void release_chunk(PHRASESTORE *, PHRASECHUNK *);
+static void initialize_index(PHRASEINDEX *);
+static void free_index(PHRASEINDEX *);
+static void renumber_serials(MODEL *);
+static bool index_phrase(MODEL *, BYTE4);
+static void unindex_phrase(MODEL *, BYTE4);
+static void renumber_index(MODEL *, SYMBOL *, BYTE4);
+static BYTE4 hash_phrase(SYMBOL *);
+static BYTE4 find_group(MODEL *, SYMBOL *, BYTE4);
+static BYTE4 new_group(MODEL *, SYMBOL *, BYTE4);
+static void compact_groups(PHRASEINDEX *);
+static void link_group(PHRASEINDEX *, BYTE4);
+static void unlink_group(PHRASEINDEX *, BYTE4);
+static bool rehash_groups(PHRASEINDEX *, BYTE4);
+static BYTE4 phrase_place(MODEL *, BYTE4);
+static bool add_posting(PHRASEINDEX *, POSTINGS *, BYTE4);
+static void remove_posting(PHRASEINDEX *, POSTINGS *, BYTE4);
+static void free_postings(PHRASEINDEX *, POSTINGS *);
+static bool save_phrases(MODEL *);
+static bool isrepeating(DICTIONARY *);
+static bool isinprevs(DICTIONARY *);
+static void updateprevs(wchar_t *);
+static void strip_codes(wchar_t *);
+static bool dissimilar2(DICTIONARY *, DICTIONARY *);
 
 /* eggdrop funcs */
 
+#ifdef MAKING_MEGAHAL
 struct userrec; /* kill warnings */
 
-static wchar_t *mystrdup(const wchar_t *);
-static void mystrlwr(wchar_t *string);
-static wchar_t* mynewsplit(wchar_t **);
-static const wchar_t *mystrstr(const wchar_t *, const wchar_t *);
 char *megahal_start();
 static int megahal_expmem();
 static int dictionary_expmem(DICTIONARY *);
@@ -208,8 +669,47 @@ static bool floodcheck();
 static char *istextinlist(char *, char *);
 static char *istextinlist2(STRING, char *);
 static int countchans();
+static wchar_t* mynewsplit(wchar_t **);
+static void mystrlwr(wchar_t *string);
+static const wchar_t *mystrstr(const wchar_t *, const wchar_t *);
+static int wordcmp2(STRING, wchar_t *);
+static BYTE4 *copy_postings(POSTINGS *, BYTE4 *);
+static int compare_serials(const void *, const void *);
+static int find_phrase(wchar_t *, bool *);
+static void del_all_phrases(int);
+static int del_word_phrases(SYMBOL);
+static void reloadphrases();
+static void rebuild_model(int);
 static int getchannum(char *);
-static void do_megahal(int, char *, char *, bool, char *, char *);
+static void do_megahal(int, char *, char *, bool, char *, char *, int);
+static void send_reply(int, char *, wchar_t *, char *, char *);
+static void learn_words(DICTIONARY *);
+#ifdef MEGAHAL_THREADS
+static void drain_learning(void);
+static void queue_reply(int, char *, wchar_t *, char *, char *, int);
+static void free_replyjob(REPLYJOB *);
+static void *reply_worker(void *);
+static void start_worker(void);
+static void stop_worker(void);
+static void log_messages(void);
+static void send_finished(void);
+static void start_wakepipe(void);
+static void stop_wakepipe(void);
+static void wakepipe_activity(int, char *, int);
+static void wakepipe_eof(int);
+static void wakepipe_display(int, char *);
+#endif
+static void megahal_secondly();
+static bool save_in_background();
+static void save_now(bool);
+static void restart_journal();
+static void restart_now();
+static void do_wanted();
+static void saver_done(int);
+static void compact_journal();
+static void learn_slice();
+static int learn_percent();
+static void wait_for_saver();
 static int pub_megahal(char *, char *, char *, char *, char *);
 static int pub_megahal2(char *, char *, char *, char *, char *);
 static int pub_action(char *, char *, char *, char *, char *, char *);
@@ -217,38 +717,21 @@ static int dcc_megahal(struct userrec *, int, char *);
 static int dcc_forget(struct userrec *, int, char *);
 static int pub_forget(char *, char *, char *, char *, char *);
 static int pub_forgetword(char *, char *, char *, char *, char *);
-static int find_phrase(wchar_t *, bool *);
-static void del_all_phrases(int);
 static int dcc_megaver(struct userrec *, int, char *);
 static int pub_megaver(char *, char *, char *, char *, char *);
-static int recurse_tree(TREE *);
-static void recurse_branch(TREE *);
-static void decrement_tree(TREE *, TREE *);
-static void trimdictionary();
-static void recurse_tree_and_decrement_symbols(TREE *, int, int, int *);
+static void recurse_branch(BRANCHVIEW *, TREE *);
 static int tcl_treesize();
 static int tcl_viewbranch();
 static int tcl_trimbrain();
 static int tcl_setmaxcontext();
 static int tcl_reloadphrases();
-static void reloadphrases();
 static int tcl_learnfile();
-static void del_phrase(int);
 static int tcl_setmegabotnick();
 static int tcl_savebrain();
 static int tcl_reloadbrain();
 static int tcl_learningmode();
 static int tcl_talkfrequency();
-static DICTIONARY *realloc_dictionary(DICTIONARY *);
-static TREE *realloc_tree(TREE *);
-static BYTE2 **realloc_phrase(MODEL *);
-static void save_phrases(MODEL *);
-static bool isrepeating(DICTIONARY *);
-static bool isinprevs(DICTIONARY *);
-static void updateprevs(wchar_t *);
-static void strip_codes(wchar_t *);
-static bool dissimilar2(DICTIONARY *, DICTIONARY *);
-static int amount_bigger_than(int *, int, int);
+#endif
 
 /*===========================================================================*/
 
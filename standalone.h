@@ -0,0 +1,15 @@
+/*
+ *	standalone.h -- what eggdrop would otherwise provide to engine.c, for
+ *	building the engine as libmegahal without a bot around it.
+ */
+
+#define MODULE_NAME "libmegahal"
+
+#define nmalloc(x) malloc(x)
+#define nfree(x) free(x)
+#define nrealloc(x, y) realloc((x), (y))
+#define Context
+
+#define LOG_MISC 0
+
+static void putlog(int, const char *, const char *, ...);